@@ -1,6 +1,25 @@
 
 #include "fs.h"
 
+// The block cache keeps at most bc_stat.bs_maxblocks blocks in memory.
+// bc_cached lists the blocks that are in memory, in the order the clock
+// hand visits them when a block has to be evicted.
+static uint32_t bc_cached[BC_MAXBLOCKS];
+static uint32_t bc_hand;
+struct BcStat bc_stat = { 0, BC_NBLOCKS };
+
+// Blocks being read into the cache without waiting for the disk (see
+// bc_ready).  Each is read into its own staging page at BC_FETCHVA, and
+// only mapped at its DISKMAP address by bc_reap once the read is done,
+// so nobody sees a half-read block meanwhile.
+#define BC_NFETCH	32
+#define BC_FETCHVA	0x0c000000
+
+static struct Fetch {
+	struct IdeReq f_req;
+	uint32_t f_blockno;	// 0 if the slot is free
+} bc_fetches[BC_NFETCH];
+
 // Return the virtual address of this disk block.
 void*
 diskaddr(uint32_t blockno)
@@ -17,22 +36,123 @@ va_is_mapped(void *va)
 	return (uvpd[PDX(va)] & PTE_P) && (uvpt[PGNUM(va)] & PTE_P);
 }
 
-// Is this virtual address dirty?
+// Is this virtual address dirty?  Clean blocks are mapped read-only, so
+// a block is dirty exactly when it is writable (see bc_dirty).
 bool
 va_is_dirty(void *va)
 {
-	return (uvpt[PGNUM(va)] & PTE_D) != 0;
+	return (uvpt[PGNUM(va)] & PTE_W) != 0;
+}
+
+// The dirty blocks, so that writing them back does not mean looking at
+// every block on the disk.  A block goes in here when it is first
+// written, which faults since clean blocks are mapped read-only, or
+// before the file system writes it (bc_dirty).  d_file says which file
+// the block holds data of, if that is known, for file_flush.
+static struct Dirty {
+	uint32_t d_blockno;
+	struct File *d_file;
+	uint32_t d_filebno;
+} bc_dirty_list[BC_MAXBLOCKS];
+static uint32_t bc_ndirty;
+
+// Return the index of 'blockno' in the dirty list, or -1.
+static int
+bc_dirty_find(uint32_t blockno)
+{
+	uint32_t i;
+
+	for (i = 0; i < bc_ndirty; i++)
+		if (bc_dirty_list[i].d_blockno == blockno)
+			return i;
+	return -1;
+}
+
+// Sort the 'n' block numbers in 'a' (a Shell sort).
+static void
+bc_sort(uint32_t *a, uint32_t n)
+{
+	uint32_t gap, i, j, v;
+
+	for (gap = n / 2; gap > 0; gap /= 2)
+		for (i = gap; i < n; i++) {
+			v = a[i];
+			for (j = i; j >= gap && a[j - gap] > v; j -= gap)
+				a[j] = a[j - gap];
+			a[j] = v;
+		}
+}
+
+// Is 'blockno' one of the 'n' sorted block numbers in 'a'?
+static bool
+bc_sorted_has(const uint32_t *a, uint32_t n, uint32_t blockno)
+{
+	uint32_t lo, hi, mid;
+
+	for (lo = 0, hi = n; lo < hi; ) {
+		mid = (lo + hi) / 2;
+		if (a[mid] == blockno)
+			return true;
+		if (a[mid] < blockno)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
 }
 
-// CHALLENGE:
-// Flush the block containing the given address to disk if necessary.
-// Based off of last year's solution which used va_is_mapped and
-// va_is_dirty.  If the block isn't mapped or isn't dirty, do nothing.
+// Write the 'n' blocks listed in 'blocknos', which must all be in
+//  memory, back to disk.  Each run of up to BC_RAMAX blocks that are
+//  adjacent on disk, and so in the cache too, goes in one disk command.
+//  The dirty ones are write-protected again and leave the dirty list.
+//  Sorts 'blocknos'.  Returns n.
+int
+bc_write_blocks(uint32_t *blocknos, uint32_t n)
+{
+	uint32_t i, j, ndirty;
+	void *va;
+
+	bc_sort(blocknos, n);
+	for (i = 0; i < n; i = j) {
+		for (j = i + 1; j < n && j - i < BC_RAMAX &&
+			     blocknos[j] == blocknos[j - 1] + 1; j++)
+			;
+		if (ide_write(blocknos[i] * BLKSECTS, diskaddr(blocknos[i]),
+			      (j - i) * BLKSECTS) < 0)
+			panic("error writing blocks %d-%d in FS", blocknos[i],
+			      blocknos[j - 1]);
+	}
+
+	ndirty = 0;
+	for (i = 0; i < n; i++) {
+		va = diskaddr(blocknos[i]);
+		if (!va_is_dirty(va))
+			continue;
+		if (sys_page_map(0, va, 0, va,
+				 uvpt[PGNUM(va)] & PTE_SYSCALL & ~PTE_W) != 0)
+			panic("couldn't write-protect block %d", blocknos[i]);
+		ndirty++;
+	}
+	for (i = 0; ndirty > 0 && i < bc_ndirty; )
+		if (bc_sorted_has(blocknos, n, bc_dirty_list[i].d_blockno)) {
+			bc_dirty_list[i] = bc_dirty_list[--bc_ndirty];
+			ndirty--;
+		} else
+			i++;
+	return n;
+}
+
+// Flush the block containing the given address to disk if it is in
+// memory and dirty, or just in memory if 'force' is true.  Forcing is
+// for blocks that clients may have written through shared mappings,
+// which the file system never sees.
 //
-// If 'force' is true, don't check the dirty bit.
-void
+// Returns the number of blocks written, 0 or 1.
+int
 flush_block(void *addr, bool force)
 {
+	uint32_t blockno;
+
 	// Sanity-check the address
 	if((int)addr < DISKMAP || (int)addr >= DISKMAP+DISKSIZE)
 		panic("flush_block called on bad address 0x%08x", addr);
@@ -40,17 +160,263 @@ flush_block(void *addr, bool force)
 	// Round the address to the nearest block size
 	addr = ROUNDDOWN(addr, BLKSIZE);
 
-	// If the block at address addr exists and is dirty, flush
-	// it to the disk.
-	if(va_is_mapped(addr) && (force || va_is_dirty(addr))) {
-		// Write the block to disk, converting addr to
-		//  a block number.
-		ide_write(((uint32_t)addr-DISKMAP)/BLKSECTS, addr, BLKSECTS);
+	if(!va_is_mapped(addr) || !(force || va_is_dirty(addr)))
+		return 0;
+	blockno = ((uint32_t)addr-DISKMAP)/BLKSIZE;
+	return bc_write_blocks(&blockno, 1);
+}
+
+// Write back the dirty blocks holding blocks 'min' up to 'max' of file
+//  'f', or every dirty block if 'f' is NULL, coalescing adjacent ones.
+//  Returns the number of blocks written.
+int
+bc_flush(struct File *f, uint32_t min, uint32_t max)
+{
+	static uint32_t blocknos[BC_MAXBLOCKS];
+	struct Dirty *d;
+	uint32_t i, n;
+
+	n = 0;
+	for (i = 0; i < bc_ndirty; i++) {
+		d = &bc_dirty_list[i];
+		if (!f || (d->d_file == f && d->d_filebno >= min &&
+			   d->d_filebno < max))
+			blocknos[n++] = d->d_blockno;
+	}
+	return bc_write_blocks(blocknos, n);
+}
+
+// Mark the block at 'addr' dirty and make it writable, reading it in
+//  first if need be, before the file system writes it.  'f' and 'filebno' are
+//  the file and block of it whose data the block holds, or NULL and 0.
+//  If clients map the block copy-on-write, it gets a page of its own,
+//  which helpers must then stop using.
+void
+bc_dirty(void *addr, struct File *f, uint32_t filebno)
+{
+	uint32_t blockno = ((uint32_t) addr - DISKMAP) / BLKSIZE;
+	pte_t pte;
+	int i;
+
+	addr = ROUNDDOWN(addr, BLKSIZE);
+	if (!va_is_mapped(addr))
+		read_block(addr);
+	pte = uvpt[PGNUM(addr)];
+	if (pte & PTE_W) {
+		// Blocks are dirtied by faults before anyone says whose they
+		// are, and freed blocks go to other files
+		if (f && (i = bc_dirty_find(blockno)) >= 0) {
+			bc_dirty_list[i].d_file = f;
+			bc_dirty_list[i].d_filebno = filebno;
+		}
+		return;
+	}
+
+	if (bc_ndirty == BC_MAXBLOCKS)
+		panic("too many dirty blocks");
+	if (pte & PTE_COW) {
+		if (sys_page_alloc(0, PFTEMP, PTE_U|PTE_W) != 0)
+			panic("couldn't allocate a new page for copy-on-write");
+		memcpy(PFTEMP, addr, BLKSIZE);
+		if (sys_page_map(0, PFTEMP, 0, addr, PTE_U|PTE_W) != 0)
+			panic("couldn't remap the temporary page for copy-on-write");
+		peer_replaced(blockno);
+	} else if (sys_page_map(0, addr, 0, addr,
+				(pte & PTE_SYSCALL) | PTE_W) != 0)
+		panic("couldn't make block %d writable", blockno);
+	bc_dirty_list[bc_ndirty].d_blockno = blockno;
+	bc_dirty_list[bc_ndirty].d_file = f;
+	bc_dirty_list[bc_ndirty].d_filebno = filebno;
+	bc_ndirty++;
+}
+
+// Choose a block to evict with the clock algorithm, write it back if it
+//  is dirty, and unmap it.  A block whose PTE_A is set gets a second
+//  chance instead.  Clearing PTE_A means remapping the page, so a dirty
+//  block is written back, and write-protected, at that point.
+//  The superblock, which the fault handler itself reads, blocks that
+//  clients have mapped and blocks still being read in are never
+//  evicted.  A helper's pages are also the primary's, so it may always
+//  drop them.
+//
+//  Returns the victim's index in bc_cached, or -1 if every block is
+//  pinned.
+static int
+bc_evict(void)
+{
+	uint32_t i, n;
+	pte_t pte;
+	void *va;
+	int r;
+
+	// Two trips around the clock clear every PTE_A there is to clear
+	for (n = 0; n <= 2 * bc_stat.bs_nblocks; n++) {
+		i = bc_hand;
+		bc_hand = (bc_hand + 1) % bc_stat.bs_nblocks;
+		va = diskaddr(bc_cached[i]);
+		if (bc_cached[i] == 1 || !va_is_mapped(va) ||
+		    (!fs_helper && pageref(va) > 1))
+			continue;
+		pte = uvpt[PGNUM(va)];
+		if (pte & PTE_W) {
+			flush_block(va, false);
+			bc_stat.bs_writebacks++;
+		} else if (pte & PTE_A) {
+			if ((r = sys_page_map(0, va, 0, va, pte & PTE_SYSCALL)) < 0)
+				panic("bc_evict: sys_page_map: %e", r);
+		}
+		if (pte & PTE_A)
+			continue;
+		if ((r = sys_page_unmap(0, va)) < 0)
+			panic("bc_evict: sys_page_unmap: %e", r);
+		bc_stat.bs_evictions++;
+		return i;
+	}
+	return -1;
+}
+
+// Forget any bc_ready read of 'blockno', waiting for the disk to finish
+//  with its staging page first.  The block is being brought in another
+//  way, and once that copy is written to or evicted, the staging copy
+//  would be stale.
+static void
+bc_fetch_cancel(uint32_t blockno)
+{
+	struct Fetch *f;
+	int r;
+
+	for (f = bc_fetches; f < bc_fetches + BC_NFETCH; f++) {
+		if (f->f_blockno != blockno)
+			continue;
+		ide_wait(&f->f_req);
+		if ((r = sys_page_unmap(0, f->f_req.ir_buf)) < 0)
+			panic("bc_fetch_cancel: sys_page_unmap: %e", r);
+		f->f_blockno = 0;
+	}
+}
+
+// Record that 'blockno' is about to come into memory, evicting blocks
+//  to stay within the cache limit.  The cache goes over the limit only
+//  if every block in it is pinned.  A bc_ready read of the block still
+//  in flight or not yet reaped is dropped.
+static void
+bc_insert(uint32_t blockno)
+{
+	int i;
+
+	bc_fetch_cancel(blockno);
+
+	// Shrink to the limit if it was lowered
+	while (bc_stat.bs_nblocks > bc_stat.bs_maxblocks) {
+		if ((i = bc_evict()) < 0)
+			break;
+		bc_cached[i] = bc_cached[--bc_stat.bs_nblocks];
+		if (bc_hand >= bc_stat.bs_nblocks)
+			bc_hand = 0;
+	}
 
-		// Now we need to reset the PTE_D bit at addr
-		if(sys_page_map(0, addr, 0, addr, uvpt[PGNUM(addr)]&PTE_SYSCALL) != 0)
-			panic("Failed to reset dirty bit on block at address %x", addr);
+	// Take over the victim's place in the clock
+	if (bc_stat.bs_nblocks >= bc_stat.bs_maxblocks &&
+	    (i = bc_evict()) >= 0) {
+		bc_cached[i] = blockno;
+		return;
 	}
+	if (bc_stat.bs_nblocks == BC_MAXBLOCKS)
+		panic("block cache is full of pinned blocks");
+	bc_cached[bc_stat.bs_nblocks++] = blockno;
+}
+
+// Give block 'blockno', which has just been allocated to hold block
+//  'filebno' of 'f' (or NULL and 0), a zeroed page in the cache, without
+//  reading its old contents from disk, and mark it dirty.
+void
+bc_alloc(uint32_t blockno, struct File *f, uint32_t filebno)
+{
+	void *va = diskaddr(blockno);
+
+	if (!va_is_mapped(va)) {
+		bc_insert(blockno);
+		if (sys_page_alloc(0, va, PTE_U) != 0)
+			panic("couldn't allocate a new page for file system");
+	}
+	bc_dirty(va, f, filebno);
+	memset(va, 0, BLKSIZE);
+}
+
+// Set the number of blocks the cache may hold.  Blocks over the new
+//  limit are evicted as other blocks are read in.
+int
+bc_set_limit(uint32_t maxblocks)
+{
+	if (maxblocks < BC_MINBLOCKS || maxblocks > BC_MAXBLOCKS)
+		return -E_INVAL;
+	bc_stat.bs_maxblocks = maxblocks;
+	return 0;
+}
+
+// Forget block 'blockno' without writing it back, if it is in memory.
+//  Helpers do this with blocks whose page the primary has replaced.
+void
+bc_drop(uint32_t blockno)
+{
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < bc_stat.bs_nblocks; i++)
+		if (bc_cached[i] == blockno)
+			break;
+	if (i == bc_stat.bs_nblocks)
+		return;
+	if ((r = sys_page_unmap(0, diskaddr(blockno))) < 0)
+		panic("bc_drop: sys_page_unmap: %e", r);
+	bc_cached[i] = bc_cached[--bc_stat.bs_nblocks];
+	if (bc_hand >= bc_stat.bs_nblocks)
+		bc_hand = 0;
+}
+
+// Forget every block but the superblock.
+void
+bc_drop_all(void)
+{
+	uint32_t i;
+
+	for (i = bc_stat.bs_nblocks; i-- > 0; )
+		if (bc_cached[i] != 1)
+			bc_drop(bc_cached[i]);
+}
+
+// Map fresh pages for the 'nblocks' blocks starting at 'blockno' and
+//  read the blocks into them with one disk command.  A helper maps the
+//  primary's pages instead.
+static void
+bc_read(uint32_t blockno, uint32_t nblocks)
+{
+	char *addr = (char *) DISKMAP + blockno * BLKSIZE;
+	uint32_t i;
+
+	if (fs_helper) {
+		peer_read(blockno, nblocks);
+		return;
+	}
+
+	// Allocate a new page for each block
+	for (i = 0; i < nblocks; i++)
+		if(sys_page_alloc(0, addr + i*BLKSIZE, PTE_U|PTE_W) != 0)
+			panic("couldn't allocate a new page for file system");
+
+	// Call ide_read, which takes a sector number and a number of
+	//  sectors.  We want to read full pages, or BLKSECTS sectors
+	//  per block, starting at the first sector of the first block.
+	if(ide_read(blockno*BLKSECTS, addr, nblocks*BLKSECTS) != 0)
+		panic("error reading blocks %d-%d in FS", blockno,
+		      blockno + nblocks - 1);
+
+	// The blocks match the disk, so map them read-only until written
+	for (i = 0; i < nblocks; i++)
+		if(sys_page_map(0, addr + i*BLKSIZE, 0, addr + i*BLKSIZE,
+				PTE_U) != 0)
+			panic("couldn't write-protect block %d",
+			      blockno + i);
 }
 
 // Challenge:
@@ -65,24 +431,148 @@ read_block(void *addr)
 	if (super && blockno >= super->s_nblocks)
 		panic("reading non-existent block %08x\n", blockno);
 
-	// Allocate a page in the disk map region, read the contents
-	// of the block from the disk into that page.
-	// Hint: first round addr to page boundary.
-	addr = ROUNDDOWN(addr, PGSIZE);
+	// Make room for the block if it is not already in the cache
+	if (!va_is_mapped(ROUNDDOWN(addr, PGSIZE)))
+		bc_insert(blockno);
+	bc_read(blockno, 1);
+}
 
-	// Allocate a new page for the address
-	if(sys_page_alloc(0, addr, PTE_U|PTE_W) != 0)
-		panic("couldn't allocate a new page for file system");
+// Read the 'nblocks' blocks starting at 'blockno', none of which may be
+//  in memory, with a single disk command.  The first block is the one
+//  the file system is about to use; the rest are read ahead.
+void
+read_blocks(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t i;
 
-	// Call ide_read, which takes a sector number and a number of
-	//  sectors.  We want to read a full page, or BLKSCTS sectors,
-	//  starting at the first sector of the target block.
-	if(ide_read(blockno*BLKSECTS, addr, BLKSECTS) != 0)
-		panic("error reading block %d in FS", blockno);
+	if (nblocks == 0 || nblocks > BC_RAMAX ||
+	    (super && blockno + nblocks > super->s_nblocks))
+		panic("reading bad block range %08x+%d", blockno, nblocks);
+
+	// Make room for all of them before mapping any, so that none of
+	// them is picked to make room for another
+	for (i = 0; i < nblocks; i++)
+		bc_insert(blockno + i);
+	bc_read(blockno, nblocks);
+	bc_stat.bs_readahead += nblocks - 1;
+}
+
+// Blocks bc_reap has brought in that nobody has looked up since, so that
+// bc_lookup counts the lookup they were fetched for as a miss.
+static uint32_t bc_reaped[BC_NFETCH];
+static uint32_t bc_nreaped;
+
+// Count a lookup of block 'blockno' by the file system as a hit or a
+// miss, and return whether the block is in memory.  The counters change
+// only here, so bs_hits + bs_misses is the number of lookups.  A block
+// that only just arrived because an earlier bc_ready found it missing
+// counts as a miss.
+bool
+bc_lookup(uint32_t blockno)
+{
+	uint32_t i;
+
+	if (!va_is_mapped(diskaddr(blockno))) {
+		bc_stat.bs_misses++;
+		return false;
+	}
+	for (i = 0; i < BC_NFETCH; i++)
+		if (bc_reaped[i] == blockno) {
+			bc_reaped[i] = 0;
+			bc_stat.bs_misses++;
+			return true;
+		}
+	bc_stat.bs_hits++;
+	return true;
+}
+
+// Returns true if block 'blockno' is in the cache.  If it is not, start
+// reading it in, unless that is already under way, and return false; the
+// block is in the cache after a later bc_reap.
+bool
+bc_ready(uint32_t blockno)
+{
+	struct Fetch *f, *free = NULL;
+	char *va;
+	int r;
+
+	if (va_is_mapped(diskaddr(blockno)))
+		return true;
+	for (f = bc_fetches; f < bc_fetches + BC_NFETCH; f++)
+		if (f->f_blockno == blockno)
+			return false;
+		else if (!f->f_blockno && !free)
+			free = f;
+	// Out of slots: try again when some fetch has been reaped
+	if (!free)
+		return false;
+
+	va = (char *) BC_FETCHVA + (free - bc_fetches) * PGSIZE;
+	if ((r = sys_page_alloc(0, va, PTE_U|PTE_W)) < 0)
+		panic("bc_ready: sys_page_alloc: %e", r);
+	memset(&free->f_req, 0, sizeof(free->f_req));
+	free->f_req.ir_secno = blockno * BLKSECTS;
+	free->f_req.ir_nsecs = BLKSECTS;
+	free->f_req.ir_buf = va;
+	free->f_blockno = blockno;
+	ide_submit(&free->f_req);
+	// Without the disk interrupt nobody would notice the read finish
+	if (!ide_async())
+		ide_wait(&free->f_req);
+	return false;
+}
+
+// Returns true if some bc_ready read is still waiting for the disk.
+bool
+bc_fetching(void)
+{
+	struct Fetch *f;
+
+	for (f = bc_fetches; f < bc_fetches + BC_NFETCH; f++)
+		if (f->f_blockno && f->f_req.ir_status == IDE_PENDING)
+			return true;
+	return false;
+}
+
+// Move the blocks whose bc_ready reads are done into the cache.  A block
+// brought in another way meanwhile has cancelled its read (see
+// bc_insert), so the staging copy is never older than the cached one.  This is not done when the reads complete, since that
+// may be in the middle of a page fault, where evicting blocks is unsafe.
+// Returns the number of reads finished.
+int
+bc_reap(void)
+{
+	struct Fetch *f;
+	uint32_t blockno;
+	void *va;
+	int n, r;
+
+	n = 0;
+	for (f = bc_fetches; f < bc_fetches + BC_NFETCH; f++) {
+		if (!f->f_blockno || f->f_req.ir_status == IDE_PENDING)
+			continue;
+		if (f->f_req.ir_status < 0)
+			panic("error reading block %d in FS", f->f_blockno);
+		// Free the slot first, so bc_insert doesn't cancel it
+		blockno = f->f_blockno;
+		f->f_blockno = 0;
+		va = diskaddr(blockno);
+		if (!va_is_mapped(va)) {
+			bc_insert(blockno);
+			if ((r = sys_page_map(0, f->f_req.ir_buf, 0, va, PTE_U)) < 0)
+				panic("bc_reap: sys_page_map: %e", r);
+			bc_reaped[bc_nreaped++ % BC_NFETCH] = blockno;
+		}
+		if ((r = sys_page_unmap(0, f->f_req.ir_buf)) < 0)
+			panic("bc_reap: sys_page_unmap: %e", r);
+		n++;
+	}
+	return n;
 }
 
 // Fault any disk block that is read in to memory by
-// loading it from disk.
+// loading it from disk, and mark blocks dirty when they are first
+// written.
 static void
 bc_pgfault(struct UTrapframe *utf)
 {
@@ -94,7 +584,13 @@ bc_pgfault(struct UTrapframe *utf)
 		      utf->utf_eip, addr, utf->utf_err);
 
 	// Read the missing block into memory
-	read_block(addr);
+	if (!va_is_mapped(ROUNDDOWN(addr, BLKSIZE))) {
+		read_block(addr);
+		return;
+	}
+	if (!(utf->utf_err & FEC_WR))
+		panic("read fault on block at %08x in FS", addr);
+	bc_dirty(addr, NULL, 0);
 }
 
 
@@ -37,6 +37,45 @@ block_is_free(uint32_t blockno)
 	return false;
 }
 
+// The allocator looks for free blocks from a goal block: the block after
+// the one before in the file, so that files grow contiguously, or else
+// where the last search left off (next fit).  It scans the bitmap a word
+// at a time and finds the first free block of a word with one bit scan
+// (bsf).  The bitmap blocks it changes are not written at once but all
+// together, by the next file_flush or fs_sync.
+static uint32_t alloc_next;		// where searches without a goal start
+static uint32_t bitmap_lo, bitmap_hi;	// bitmap blocks changed since written
+static bool alloc_fast = true;		// see alloc_set_fast
+
+// Note that the bitmap bit of block 'blockno' has changed.
+static void
+bitmap_touch(uint32_t blockno)
+{
+	uint32_t i = blockno / BLKBITSIZE;
+
+	if (bitmap_lo == bitmap_hi) {
+		bitmap_lo = i;
+		bitmap_hi = i + 1;
+	} else {
+		bitmap_lo = MIN(bitmap_lo, i);
+		bitmap_hi = MAX(bitmap_hi, i + 1);
+	}
+}
+
+// Write back the bitmap blocks changed since last time that are still
+// dirty.  Returns the number of blocks written.
+static int
+bitmap_flush(void)
+{
+	uint32_t blocknos[DISKSIZE / BLKSIZE / BLKBITSIZE], i, n;
+
+	for (n = 0, i = bitmap_lo; i < bitmap_hi; i++)
+		if (va_is_mapped(diskaddr(2 + i)) && va_is_dirty(diskaddr(2 + i)))
+			blocknos[n++] = 2 + i;
+	bitmap_lo = bitmap_hi = 0;
+	return bc_write_blocks(blocknos, n);
+}
+
 // Mark a block free in the bitmap
 void
 free_block(uint32_t blockno)
@@ -44,49 +83,131 @@ free_block(uint32_t blockno)
 	if (blockno == 0)
 		panic("attempt to free block 0");
 	bitmap[blockno/32] |= 1<<(blockno%32);
+	bitmap_touch(blockno);
+}
+
+// Return bitmap word 'w' without the bits past the end of the disk,
+// which fsformat leaves set.
+static uint32_t
+bitmap_word(uint32_t w)
+{
+	if ((w + 1) * 32 > super->s_nblocks)
+		return bitmap[w] & ((1 << (super->s_nblocks % 32)) - 1);
+	return bitmap[w];
 }
 
-// Search the bitmap for a free block and allocate it.  When you
-// allocate a block, inmmediately flush the changed bitmap block
-// to disk.
+// The allocator without any of the above, for comparison: first fit
+// from block 0, a bit at a time, writing the bitmap block straight away.
+static int
+alloc_block_simple(void)
+{
+	uint32_t b;
+
+	for (b = 0; b < super->s_nblocks; b++)
+		if (block_is_free(b)) {
+			bitmap[b/32] &= ~(1<<(b%32));
+			flush_block(&bitmap[b/32], false);
+			return b;
+		}
+	return -E_NO_DISK;
+}
+
+// Allocate up to 'want' free blocks in a row, the first of them the
+// first free block at or after 'goal', or after where the last search
+// ended if 'goal' is 0, wrapping around the end of the disk.  Stores
+// the number allocated, at least 1, in *pn.
 //
-// Return block number allocated on success,
+// Returns the first block allocated on success,
 // -E_NO_DISK if we are out of blocks.
-//
-// Hint: use free_block as an example for manipulating the bitmap
 int
-alloc_block(void)
-{
-	int i, j;
-	// Search through the bitmap array for a value that is not
-	// 0 (all blocks allocated).  Each value in the array deals
-	// with 32 blocks.
-	for(i = 0; i < (super->s_nblocks+31)/32; i++) {
-		if(bitmap[i] != 0) {
-			// The first free bit should be the least
-			// significant one bit, loop to find it.
-			for(j = 0; j < 32; ((bitmap[i] >> j)&1) == 0);
-
-			// Check if we're out of blocks
-			if(i*32+j >= super->s_nblocks) break;
-
-			// Quick way to set the correct bit
-			// eg: 0x01010000 & 0x01001111 = 0x01000000
-			bitmap[i] &= bitmap[i]-1;
-
-			// Flush the change in the bitmap to disk
-			flush_block(&bitmap[i], false);
-
-			// Finally, return the block number that
-			// was allocated
-			return i*32+j;
-		}
+alloc_extent(uint32_t goal, uint32_t want, uint32_t *pn)
+{
+	uint32_t nwords, w, i, word, b, n;
+
+	// Only the primary file server changes the file system
+	if (fs_helper)
+		return -E_NO_DISK;
+
+	if (!alloc_fast) {
+		*pn = 1;
+		return alloc_block_simple();
+	}
+
+	if (goal == 0 || goal >= super->s_nblocks)
+		goal = alloc_next < super->s_nblocks ? alloc_next : 0;
+
+	// The goal's word without the bits before the goal, then each
+	// word after it, ending with the goal's word again in full
+	nwords = (super->s_nblocks + 31) / 32;
+	w = goal / 32;
+	word = bitmap_word(w) & ~((1 << (goal % 32)) - 1);
+	for (i = 0; word == 0 && i < nwords; i++) {
+		w = (w + 1) % nwords;
+		word = bitmap_word(w);
 	}
+	if (word == 0)
+		return -E_NO_DISK;
+	b = w * 32 + __builtin_ctz(word);
+
+	for (n = 0; n < want && block_is_free(b + n); n++)
+		bitmap[(b + n) / 32] &= ~(1 << ((b + n) % 32));
+	bitmap_touch(b);
+	bitmap_touch(b + n - 1);
+	alloc_next = b + n;
+	*pn = n;
+	return b;
+}
+
+// Allocate a single block, at or after 'goal' if possible (see
+// alloc_extent).  Returns it, or -E_NO_DISK if we are out of blocks.
+int
+alloc_block(uint32_t goal)
+{
+	uint32_t n;
 
-	// No free blocks are available
+	return alloc_extent(goal, 1, &n);
+}
+
+// Allocate a single block for data that describes a file rather than
+// holding it: the first free block at or below 'goal', searching down
+// and wrapping around to the end of the disk.  Data grows up from its
+// goal, so this keeps such blocks out of the way of the data that
+// follows.  Returns it, or -E_NO_DISK if we are out of blocks.
+static int
+alloc_block_below(uint32_t goal)
+{
+	uint32_t b, n;
+
+	if (fs_helper)
+		return -E_NO_DISK;
+	if (!alloc_fast)
+		return alloc_block_simple();
+
+	b = MIN(goal, super->s_nblocks - 1);
+	for (n = 0; n < super->s_nblocks; n++) {
+		if (block_is_free(b)) {
+			bitmap[b/32] &= ~(1<<(b%32));
+			bitmap_touch(b);
+			return b;
+		}
+		// Skip whole words with nothing free
+		if (b % 32 == 31 && bitmap_word(b / 32) == 0) {
+			b -= 31;
+			n += 31;
+		}
+		b = b > 0 ? b - 1 : super->s_nblocks - 1;
+	}
 	return -E_NO_DISK;
 }
 
+// Make alloc_extent work as described above if 'fast' is true, or use
+// the simple allocator instead.
+void
+alloc_set_fast(bool fast)
+{
+	alloc_fast = fast;
+}
+
 
 // --------------------------------------------------------------
 // File system structures
@@ -103,58 +224,442 @@ fs_init(void)
 		ide_set_disk(1);
 	else
 		ide_set_disk(0);
+	if (ide_dma_init())
+		cprintf("IDE uses bus-master DMA\n");
+	else
+		cprintf("IDE uses PIO\n");
 
 	bc_init();
 
 	// Set "super" to point to the super block.
 	super = diskaddr(1);
 	check_super();
+
+	// The bitmap blocks follow it
+	bitmap = diskaddr(2);
+	alloc_next = 2 + (super->s_nblocks + BLKBITSIZE - 1) / BLKBITSIZE;
 }
 
-// Find the disk block number slot for the 'filebno'th block in file 'f'.
-// Set '*ppdiskbno' to point to that slot.
-// The slot will be one of the f->f_direct[] entries,
-// or an entry in the indirect block.
-// When 'alloc' is set, this function will allocate an indirect block
-// if necessary.
+// Overflow block 'blockno', read in if need be
+#define EXTBLK(blockno)	((struct ExtentBlock *) diskaddr(blockno))
+
+// Overflow blocks are tagged with this instead of a file block number in
+// the dirty list (see bc_dirty), so file_flush finds them.
+#define FILEBNO_EXTENTS	0xfffffffe
+
+// The extent last found, where the next search in the same file starts
+// if it can.  Helpers do not use it, since the primary may have changed
+// the extents since.
+static struct {
+	struct File *h_file;
+	uint32_t h_index;
+	uint32_t h_base;	// first file block in the extent
+} ext_hint;
+
+// Find extent 'i' of 'f', one of those past the first NINLINE, in the
+// chain of overflow blocks and store its address in *pe.  The chain is
+// read in as needed, unless 'cached' is set.  Then if an overflow block
+// is not in memory, its number is stored in *pblockno and -E_AGAIN
+// returned.  The extents in the File itself are only ever copied, since
+// the File is packed.
+static int
+extent_overflow(struct File *f, uint32_t i, bool cached, struct Extent **pe,
+		uint32_t *pblockno)
+{
+	uint32_t b, k;
+
+	i -= NINLINE;
+	for (b = f->f_overflow, k = i / NOVERFLOW; ; k--) {
+		if (b == 0)
+			panic("file %s is missing overflow blocks", f->f_name);
+		if (cached && !va_is_mapped(diskaddr(b))) {
+			*pblockno = b;
+			return -E_AGAIN;
+		}
+		if (k == 0)
+			break;
+		b = EXTBLK(b)->eb_next;
+	}
+	*pe = &EXTBLK(b)->eb_ext[i % NOVERFLOW];
+	return 0;
+}
+
+// Copy extent 'i' of 'f' into *e.  'cached', 'pblockno' and the errors
+// are as for extent_overflow.
+static int
+extent_get(struct File *f, uint32_t i, bool cached, struct Extent *e,
+	   uint32_t *pblockno)
+{
+	struct Extent *p;
+	int r;
+
+	if (i < NINLINE) {
+		*e = f->f_extents[i];
+		return 0;
+	}
+	if ((r = extent_overflow(f, i, cached, &p, pblockno)) < 0)
+		return r;
+	*e = *p;
+	return 0;
+}
+
+// Return extent 'i' of 'f', reading in overflow blocks as needed.
+static struct Extent
+file_extent(struct File *f, uint32_t i)
+{
+	struct Extent e;
+
+	extent_get(f, i, false, &e, NULL);
+	return e;
+}
+
+// Make extent 'i' of 'f' 'e', reading in overflow blocks as needed.
+static void
+file_extent_set(struct File *f, uint32_t i, struct Extent e)
+{
+	struct Extent *p;
+
+	if (i < NINLINE) {
+		f->f_extents[i] = e;
+		return;
+	}
+	extent_overflow(f, i, false, &p, NULL);
+	bc_dirty(p, f, FILEBNO_EXTENTS);
+	*p = e;
+}
+
+// Find the extent of 'f' that holds file block 'filebno', and store its
+// index in *pi and the first file block it holds in *pbase.
 //
-// Returns:
-//	0 on success (but note that *ppdiskbno might equal 0).
-//	-E_NOT_FOUND if the function needed to allocate an indirect block, but
-//		alloc was 0.
-//	-E_NO_DISK if there's no space on the disk for an indirect block.
-//	-E_INVAL if filebno is out of range (it's >= NDIRECT + NINDIRECT).
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NOT_FOUND if 'filebno' is past the last extent; then the number
+//		of extents is stored in *pi and the blocks they hold in *pbase.
+//	-E_AGAIN if 'cached' is set and an overflow block is not in memory;
+//		then its number is stored in *pi.
+static int
+extent_find(struct File *f, uint32_t filebno, bool cached, uint32_t *pi,
+	    uint32_t *pbase)
+{
+	struct Extent e;
+	uint32_t i, base;
+	int r;
+
+	i = base = 0;
+	if (!fs_helper && ext_hint.h_file == f && ext_hint.h_base <= filebno &&
+	    ext_hint.h_index < f->f_nextents) {
+		i = ext_hint.h_index;
+		base = ext_hint.h_base;
+	}
+	for (; i < f->f_nextents; i++, base += e.e_len) {
+		if ((r = extent_get(f, i, cached, &e, pi)) < 0)
+			return r;
+		if (filebno < base + e.e_len) {
+			ext_hint.h_file = f;
+			ext_hint.h_index = i;
+			ext_hint.h_base = base;
+			*pi = i;
+			*pbase = base;
+			return 0;
+		}
+	}
+	*pi = i;
+	*pbase = base;
+	return -E_NOT_FOUND;
+}
+
+// Find the disk block holding block 'filebno' of 'f' and store it, or 0
+// if the file has none there, in *pdiskbno.  This is like pgdir_walk for
+// files.
 //
-// Analogy: This is like pgdir_walk for files.
-// Hint: Don't forget to clear any block you allocate.
+// Returns 0 on success, -E_INVAL if filebno is out of range.
 static int
-file_block_walk(struct File *f, uint32_t filebno, uint32_t **ppdiskbno, bool alloc)
+file_block_map(struct File *f, uint32_t filebno, uint32_t *pdiskbno)
 {
+	struct Extent e;
+	uint32_t i, base;
+
+	if (filebno >= MAXFILESIZE / BLKSIZE)
+		return -E_INVAL;
+	*pdiskbno = 0;
+	if (extent_find(f, filebno, false, &i, &base) < 0)
+		return 0;
+	e = file_extent(f, i);
+	if (e.e_start != 0)
+		*pdiskbno = e.e_start + filebno - base;
+	return 0;
+}
+
+// Make room in 'f' for 'n' more extents, allocating overflow blocks if
+// need be.  They go below disk block 'data', where the blocks they
+// describe start, so that the file's next blocks can follow those on.
+// Returns 0 on success, -E_NO_DISK if the disk is full.
+static int
+extent_reserve(struct File *f, uint32_t n, uint32_t data)
+{
+	uint32_t need, k, b, last;
 	int r;
-	uint32_t *ptr;
-	char *blk;
 
-	if (filebno < NDIRECT)
-		ptr = &f->f_direct[filebno];
-	else if (filebno < NDIRECT + NINDIRECT) {
-		if (f->f_indirect == 0) {
-			// CHALLENGE:
-			// If we're not allocating, return failure
-			if(!alloc) return -E_NOT_FOUND;
-
-			// Attempt to allocate an indirect block
-			if((r = alloc_block()) < 0) return r;
-
-			// Zero out the newly allocated block and map
-			// it to the file.
-			memset(diskaddr(r), 0, BLKSIZE);
-			f->f_indirect = r;
+	if (f->f_nextents + n <= NINLINE)
+		return 0;
+	need = ROUNDUP(f->f_nextents + n - NINLINE, NOVERFLOW) / NOVERFLOW;
+	for (k = 0, last = 0; k < need; k++, last = b) {
+		b = last ? EXTBLK(last)->eb_next : f->f_overflow;
+		if (b != 0)
+			continue;
+		if ((r = alloc_block_below(last ? last - 1 : data - 1)) < 0)
+			return r;
+		b = r;
+		bc_alloc(b, f, FILEBNO_EXTENTS);
+		if (last) {
+			bc_dirty(diskaddr(last), f, FILEBNO_EXTENTS);
+			EXTBLK(last)->eb_next = b;
+		} else
+			f->f_overflow = b;
+	}
+	return 0;
+}
+
+// Insert an extent at index 'i' of 'f', which must have room for it.
+static void
+extent_insert(struct File *f, uint32_t i, uint32_t start, uint32_t len)
+{
+	struct Extent e;
+	uint32_t j;
+
+	for (j = f->f_nextents; j > i; j--) {
+		e = file_extent(f, j - 1);
+		file_extent_set(f, j, e);
+	}
+	e.e_start = start;
+	e.e_len = len;
+	file_extent_set(f, i, e);
+	f->f_nextents++;
+	ext_hint.h_file = NULL;
+}
+
+// Merge extents 'i' and 'i' + 1 of 'f' into one if both are holes or
+// the second continues the first on disk.
+static void
+extent_merge(struct File *f, uint32_t i)
+{
+	struct Extent a, b;
+	uint32_t j;
+
+	if (i + 1 >= f->f_nextents)
+		return;
+	a = file_extent(f, i);
+	b = file_extent(f, i + 1);
+	if ((a.e_start == 0) != (b.e_start == 0) ||
+	    (a.e_start != 0 && a.e_start + a.e_len != b.e_start))
+		return;
+	a.e_len += b.e_len;
+	file_extent_set(f, i, a);
+	for (j = i + 1; j + 1 < f->f_nextents; j++) {
+		b = file_extent(f, j + 1);
+		file_extent_set(f, j, b);
+	}
+	f->f_nextents--;
+	ext_hint.h_file = NULL;
+}
+
+// Give blocks 'filebno' up to 'filebno' + 'n' of 'f', which must have
+// no disk blocks, the disk blocks from 'start' on.  The hole they are in
+// is split around them, and they join the extents next to them if those
+// continue on disk.
+//
+// Returns 0 on success, -E_NO_DISK if an overflow block is needed but
+// the disk is full.
+static int
+file_map_extent(struct File *f, uint32_t filebno, uint32_t start, uint32_t n)
+{
+	struct Extent e;
+	uint32_t i, base, m;
+	int r;
+
+	while (n > 0) {
+		r = extent_find(f, filebno, false, &i, &base);
+
+		// Usually the blocks go right after the last extent and
+		// carry on from it on disk
+		if (r < 0 && filebno == base && i > 0) {
+			e = file_extent(f, i - 1);
+			if (e.e_start != 0 && e.e_start + e.e_len == start) {
+				e.e_len += n;
+				file_extent_set(f, i - 1, e);
+				return 0;
+			}
 		}
-		ptr = (uint32_t*)diskaddr(f->f_indirect) + filebno - NDIRECT;
-	} else
+
+		// Each case below adds at most two extents
+		if ((r = extent_reserve(f, 2, start)) < 0)
+			return r;
+		if (extent_find(f, filebno, false, &i, &base) < 0) {
+			// Past the last extent: a hole up to the blocks,
+			// then the blocks
+			if (filebno > base)
+				extent_insert(f, i++, 0, filebno - base);
+			extent_insert(f, i, start, n);
+			if (i > 0)
+				extent_merge(f, i - 1);
+			return 0;
+		}
+
+		e = file_extent(f, i);
+		if (e.e_start != 0)
+			panic("block %d of %s is mapped already", filebno,
+			      f->f_name);
+		m = MIN(n, base + e.e_len - filebno);
+		if (base + e.e_len > filebno + m)
+			extent_insert(f, i + 1, 0, base + e.e_len - filebno - m);
+		if (filebno > base) {
+			e.e_len = filebno - base;
+			file_extent_set(f, i, e);
+			extent_insert(f, ++i, start, m);
+		} else {
+			e.e_start = start;
+			e.e_len = m;
+			file_extent_set(f, i, e);
+		}
+		extent_merge(f, i);
+		if (i > 0)
+			extent_merge(f, i - 1);
+		ext_hint.h_file = NULL;
+
+		filebno += m;
+		start += m;
+		n -= m;
+	}
+	return 0;
+}
+
+// Sequential read detection.  Each stream follows one file, remembering
+// the file block it expects next and how many blocks to read at once when
+// that block is missing from the cache.  The window doubles with every
+// block read in sequence and drops back to one block after a seek.
+#define RA_NSTREAMS	8
+
+struct Readahead {
+	struct File *ra_file;
+	uint32_t ra_next;	// file block expected next
+	uint32_t ra_window;	// blocks to read at the next miss
+};
+
+static struct Readahead readahead[RA_NSTREAMS];
+static uint32_t ra_victim;
+
+// Note that file block 'filebno' of 'f', which is disk block 'diskbno',
+// is about to be used.  If that continues a sequential scan and the block
+// is not in memory, read it and as many of the following file blocks as
+// the window allows in one go, as long as they are also consecutive on
+// disk and not in memory.
+static void
+file_readahead(struct File *f, uint32_t filebno, uint32_t diskbno)
+{
+	struct Readahead *ra;
+	uint32_t n, max, bno;
+
+	for (ra = readahead; ra < readahead + RA_NSTREAMS; ra++)
+		if (ra->ra_file == f)
+			break;
+	if (ra == readahead + RA_NSTREAMS) {
+		ra = &readahead[ra_victim++ % RA_NSTREAMS];
+		ra->ra_file = f;
+		ra->ra_next = 0;
+		ra->ra_window = 1;
+	}
+
+	if (filebno == ra->ra_next)
+		ra->ra_window = MIN(ra->ra_window * 2, BC_RAMAX);
+	else if (filebno + 1 != ra->ra_next)
+		ra->ra_window = 1;
+	ra->ra_next = filebno + 1;
+
+	if (ra->ra_window == 1 || va_is_mapped(diskaddr(diskbno)))
+		return;
+
+	// Leave most of the cache to blocks that are actually in use
+	max = MIN(ra->ra_window, bc_stat.bs_maxblocks / 4);
+	for (n = 1; n < max; n++)
+		if (diskbno + n >= super->s_nblocks ||
+		    file_block_map(f, filebno + n, &bno) < 0 ||
+		    bno != diskbno + n ||
+		    va_is_mapped(diskaddr(diskbno + n)))
+			break;
+	if (n > 1)
+		read_blocks(diskbno, n);
+}
+
+// Find the disk block holding block 'filebno' of 'f', which must be in
+// memory, without faulting anything else in.  Stores the block number,
+// or 0 if the file has no such block, in *pdiskbno.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_AGAIN if an overflow block has to be read in first; then its
+//		block number is stored in *pdiskbno.
+//	-E_INVAL if filebno is out of range.
+int
+file_block_cached(struct File *f, uint32_t filebno, uint32_t *pdiskbno)
+{
+	struct Extent e;
+	uint32_t i, base;
+	int r;
+
+	if (filebno >= MAXFILESIZE / BLKSIZE)
 		return -E_INVAL;
+	*pdiskbno = 0;
+	if ((r = extent_find(f, filebno, true, &i, &base)) == -E_NOT_FOUND)
+		return 0;
+	if (r < 0) {
+		*pdiskbno = i;
+		return r;
+	}
+	e = file_extent(f, i);
+	if (e.e_start != 0)
+		*pdiskbno = e.e_start + filebno - base;
+	return 0;
+}
+
+// Give the blocks of 'f' from 'filebno' up to 'filebno' + 'n' that have
+// no disk block one each.  Each run of such blocks gets an extent, or as
+// few as possible, that follows the file block before it on disk.  The
+// new blocks are zeroed in memory; the disk still has their old contents.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_NO_DISK if the disk is full.
+//	-E_INVAL if a block is out of range.
+static int
+file_alloc_blocks(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t i, j, k, goal, got, bno;
+	int r;
 
-	*ppdiskbno = ptr;
+	for (i = 0; i < n; i += got) {
+		got = 1;
+		if ((r = file_block_map(f, filebno + i, &bno)) < 0)
+			return r;
+		if (bno != 0)
+			continue;
+		// Count the blocks without one from here, and find the
+		// disk block before them
+		for (j = i + 1; j < n; j++)
+			if (file_block_map(f, filebno + j, &bno) < 0 || bno != 0)
+				break;
+		goal = 0;
+		if (filebno + i > 0 &&
+		    file_block_map(f, filebno + i - 1, &bno) == 0 && bno != 0)
+			goal = bno + 1;
+
+		if ((r = alloc_extent(goal, j - i, &got)) < 0)
+			return r;
+		bno = r;
+		if ((r = file_map_extent(f, filebno + i, bno, got)) < 0) {
+			for (k = 0; k < got; k++)
+				free_block(bno + k);
+			return r;
+		}
+		for (k = 0; k < got; k++)
+			bc_alloc(bno + k, f, filebno + i + k);
+	}
 	return 0;
 }
 
@@ -169,24 +674,50 @@ int
 file_get_block(struct File *f, uint32_t filebno, char **blk)
 {
 	int r;
-	uint32_t *ptr;
+	uint32_t diskbno;
 
-	if ((r = file_block_walk(f, filebno, &ptr, 1)) < 0)
+	if ((r = file_block_map(f, filebno, &diskbno)) < 0)
 		return r;
-	if (*ptr == 0) {
+	if (diskbno == 0) {
 		if (debug)
 			cprintf("A new block is being allocated for file %8s, file block number %d\n", f->f_name, filebno);
 		// CHALLENGE: allocate new block for the file at this
 		//  location.
-		if((r = alloc_block()) < 0) return -E_NO_DISK;
-		*ptr = r;
+		if((r = file_alloc_blocks(f, filebno, 1)) < 0) return r;
+		file_block_map(f, filebno, &diskbno);
+	} else {
+		bc_lookup(diskbno);
+		file_readahead(f, filebno, diskbno);
 	}
-	*blk = diskaddr(*ptr);
+	*blk = diskaddr(diskbno);
 	if (debug)
-		cprintf("Found block %d for file %8s at 0x%x (disk block %d)\n", filebno, f->f_name, *blk, *ptr);
+		cprintf("Found block %d for file %8s at 0x%x (disk block %d)\n", filebno, f->f_name, *blk, diskbno);
 	return 0;
 }
 
+// A block of zeros that reads of holes see, in place of a real block.
+// Nothing ever writes it, so it can be handed to clients read-only or
+// copy-on-write.
+static const char zero_block[BLKSIZE] __attribute__((aligned(BLKSIZE)));
+
+// Like file_get_block, but for reading: a hole in the file is not filled
+// in, and *blk is set to a shared block of zeros instead.  The caller
+// must not write through *blk.
+int
+file_read_block(struct File *f, uint32_t filebno, char **blk)
+{
+	int r;
+	uint32_t diskbno;
+
+	if ((r = file_block_map(f, filebno, &diskbno)) < 0)
+		return r;
+	if (diskbno == 0) {
+		*blk = (char *) zero_block;
+		return 0;
+	}
+	return file_get_block(f, filebno, blk);
+}
+
 // Try to find a file named "name" in dir.  If so, set *file to it.
 //
 // Returns 0 and sets *file on success, < 0 on error.  Errors are:
@@ -237,6 +768,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 		f = (struct File*) blk;
 		for (j = 0; j < BLKFILES; j++)
 			if (f[j].f_name[0] == '\0') {
+				bc_dirty(blk, dir, i);
 				*file = &f[j];
 				return 0;
 			}
@@ -244,6 +776,7 @@ dir_alloc_file(struct File *dir, struct File **file)
 	dir->f_size += BLKSIZE;
 	if ((r = file_get_block(dir, i, &blk)) < 0)
 		return r;
+	bc_dirty(blk, dir, i);
 	f = (struct File*) blk;
 	*file = &f[0];
 	return 0;
@@ -365,7 +898,7 @@ file_read(struct File *f, void *buf, size_t count, off_t offset)
 	count = MIN(count, f->f_size - offset);
 
 	for (pos = offset; pos < offset + count; ) {
-		if ((r = file_get_block(f, pos / BLKSIZE, &blk)) < 0)
+		if ((r = file_read_block(f, pos / BLKSIZE, &blk)) < 0)
 			return r;
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
 		memmove(buf, blk + pos % BLKSIZE, bn);
@@ -395,11 +928,19 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	if(offset+count >= f->f_size && (r = file_set_size(f, offset+count)) != 0)
 		return r;
 
+	// Allocate any new blocks together, so they end up in a row
+	if(count > 0 &&
+	   (r = file_alloc_blocks(f, offset/BLKSIZE,
+				  (offset+count-1)/BLKSIZE - offset/BLKSIZE + 1)) < 0)
+		return r;
+
 	// Begin copying bytes from the buffer to the file
 	for(pos = offset; pos < offset+count; ) {
-		// Grab the block containing pos
-		if ((r = file_get_block(f, offset/BLKSIZE, &blk)) < 0)
+		// Grab the block containing pos, and tell the cache whose
+		//  it is before dirtying it
+		if ((r = file_get_block(f, pos/BLKSIZE, &blk)) < 0)
 			return r;
+		bc_dirty(blk, f, pos/BLKSIZE);
 
 		// Calculate how many bytes can be written
 		bn = MIN(BLKSIZE - pos % BLKSIZE, offset + count - pos);
@@ -414,57 +955,56 @@ file_write(struct File *f, const void *buf, size_t count, off_t offset)
 	return count;
 }
 
-// Remove a block from file f.  If it's not there, just silently succeed.
-// Returns 0 on success, < 0 on error
-static int
-file_free_block(struct File *f, uint32_t filebno)
-{
-	int r;
-	uint32_t *blkno;
-
-	// Attempt to grab the correct block
-	if((r = file_block_walk(f, filebno, &blkno, false)) != 0)
-		return r;
-
-	// Free the block by zeroing the file's block slot
-	//  and marking that disk block as free
-	if(*blkno != 0) {
-		 free_block(*blkno);
-		*blkno = 0;
-	}
-
-	// Return success
-	return 0;
-}
-
 // Remove any blocks currently used by file 'f',
 // but not necessary for a file of size 'newsize'.
-// For both the old and new sizes, figure out the number of blocks required,
-// and then clear the blocks from new_nblocks to old_nblocks.
-// If the new_nblocks is no more than NDIRECT, and the indirect block has
-// been allocated (f->f_indirect != 0), then free the indirect block too.
-// (Remember to clear the f->f_indirect pointer so you'll know
-// whether it's valid!)
+// The extent holding the new last block is cut short and those after it
+// dropped, with a hole left at the end, and then overflow blocks that no
+// longer hold any extents are freed too.
 // Do not change f->f_size.
 static void
 file_truncate_blocks(struct File *f, off_t newsize)
 {
-	int newblks, oldblks;
-	uint32_t i;
+	struct Extent e, cut;
+	uint32_t newblks, i, k, base, keep, b, last, next, need;
 
-	// Calculate blocks needed for the old and new size
 	newblks = ROUNDUP(newsize, BLKSIZE)/BLKSIZE;
-	oldblks = ROUNDUP(f->f_size, BLKSIZE)/BLKSIZE;
+	extent_find(f, newblks, false, &i, &base);
 
 	// Free the newly unused blocks
-	for(i = newblks; i < oldblks; i++)
-		file_free_block(f, i);
-
-	// If newblks is less than NDIRECT and the indirect
-	//  block is allocated, free it as well
-	if(newblks <= NDIRECT && f->f_indirect != 0) {
-		free_block(f->f_indirect);
-		f->f_indirect = 0;
+	for(k = i; k < f->f_nextents; k++, base += e.e_len) {
+		e = file_extent(f, k);
+		keep = newblks > base ? newblks - base : 0;
+		if(e.e_start != 0)
+			for(b = keep; b < e.e_len; b++)
+				free_block(e.e_start + b);
+		if(keep != 0) {
+			cut = e;
+			cut.e_len = keep;
+			file_extent_set(f, k, cut);
+			i = k + 1;
+		}
+	}
+	f->f_nextents = MIN(f->f_nextents, i);
+	while(f->f_nextents > 0 &&
+	      file_extent(f, f->f_nextents - 1).e_start == 0)
+		f->f_nextents--;
+	ext_hint.h_file = NULL;
+
+	// Free the overflow blocks after the last one still needed
+	need = f->f_nextents <= NINLINE ? 0 :
+		ROUNDUP(f->f_nextents - NINLINE, NOVERFLOW) / NOVERFLOW;
+	for(k = 0, last = 0; k < need; k++)
+		last = last ? EXTBLK(last)->eb_next : f->f_overflow;
+	if((b = last ? EXTBLK(last)->eb_next : f->f_overflow) == 0)
+		return;
+	if(last) {
+		bc_dirty(diskaddr(last), f, FILEBNO_EXTENTS);
+		EXTBLK(last)->eb_next = 0;
+	} else
+		f->f_overflow = 0;
+	for(; b != 0; b = next) {
+		next = EXTBLK(b)->eb_next;
+		free_block(b);
 	}
 }
 
@@ -472,6 +1012,8 @@ file_truncate_blocks(struct File *f, off_t newsize)
 int
 file_set_size(struct File *f, off_t newsize)
 {
+	if(newsize < 0 || newsize > MAXFILESIZE)
+		return -E_INVAL;
 	if(f->f_size > newsize)
 		file_truncate_blocks(f, newsize);
 	f->f_size = newsize;
@@ -479,41 +1021,48 @@ file_set_size(struct File *f, off_t newsize)
 	return 0;
 }
 
-// Flush the contents and metadata of file f out to disk.
-// Loop over all the blocks in range, or over the whole file
-// if length is 0.
-// Translate the file block number into a disk block number
-// and then check whether that disk block is dirty. If so,
-// write it out.
-// If 'force' is true, skip checking the dirty bit
-void
+// Flush the contents and metadata of file f out to disk: the dirty
+// blocks among those holding 'length' bytes from 'offset' on, or the
+// whole file if length is 0.
+// If 'force' is true, write every block in range that is in memory,
+// dirty or not, since clients may have written to them through shared
+// mappings.  Blocks that are adjacent on disk are written together.
+// Returns the number of blocks written.
+int
 file_flush(struct File *f, size_t length, off_t offset, bool force)
 {
-	int r, i, min, max;
-	uint32_t *blk;
+	static uint32_t blocknos[BC_MAXBLOCKS];
+	int n;
+	uint32_t i, min, max, nblocks, bno;
 
-	// Flush the file meta-data block and the indirect block
-	flush_block(f, false);
-	if(f->f_indirect != 0)
-		flush_block(diskaddr(f->f_indirect), force);
+	// Flush the bitmap blocks that its blocks came from, and the file
+	//  meta-data block
+	n = bitmap_flush();
+	n += flush_block(f, false);
 
-	// Figure out the number of blocks in the file,
-	//  then loop through them.
-	if(length <= 0) {
-		min = offset/BLKSIZE;
-		max = ROUNDUP(offset+length, BLKSIZE)/BLKSIZE;
-	} else {
+	if(length == 0) {
 		min = 0;
 		max = ROUNDUP(f->f_size, BLKSIZE)/BLKSIZE;
+	} else {
+		min = offset/BLKSIZE;
+		max = ROUNDUP(offset+length, BLKSIZE)/BLKSIZE;
 	}
-	for(i = min; i < max; i++) {
-		// Calculate the address of the file block,
-		//  then flush that address.
-		if ((r = file_block_walk(f, i, &blk, 0)) < 0 ||
-		    *blk == 0)
-			continue;
-		flush_block(diskaddr(*blk), force);
-	}
+	if(!force)
+		return n + bc_flush(f, FILEBNO_EXTENTS, FILEBNO_EXTENTS + 1) +
+			bc_flush(f, min, max);
+
+	// Gather the overflow blocks and the blocks in range that are in
+	//  memory.  Read the overflow blocks in first, since that might
+	//  evict blocks already gathered.
+	nblocks = 0;
+	for(bno = f->f_overflow; bno != 0 && nblocks < BC_MAXBLOCKS;
+	    bno = EXTBLK(bno)->eb_next)
+		blocknos[nblocks++] = bno;
+	for(i = min; i < max && nblocks < BC_MAXBLOCKS; i++)
+		if(file_block_cached(f, i, &bno) == 0 && bno != 0 &&
+		   va_is_mapped(diskaddr(bno)))
+			blocknos[nblocks++] = bno;
+	return n + bc_write_blocks(blocknos, nblocks);
 }
 
 // Remove a file by truncating it and then zeroing the name
@@ -534,11 +1083,10 @@ file_remove(const char *path)
 	return 0;
 }
 
-// Sync the entire file system.  A big hammer.
-void
+// Sync the entire file system by writing back every dirty block.
+// Returns the number of blocks written.
+int
 fs_sync(void)
 {
-	int i;
-	for (i = 1; i < super->s_nblocks; i++)
-		flush_block(diskaddr(i), false);
+	return bc_flush(NULL, 0, 0);
 }
@@ -11,12 +11,67 @@
 /* Maximum disk size we can handle (3GB) */
 #define DISKSIZE	0xC0000000
 
+/* Blocks the buffer cache holds before it starts evicting: by default,
+ * at least and at most (see bc_set_limit).  The minimum leaves room for
+ * the pinned superblock and every block a single instruction touches. */
+#define BC_NBLOCKS	512
+#define BC_MINBLOCKS	8
+#define BC_MAXBLOCKS	4096
+
+/* Most blocks read ahead at once: one IDE command's worth of sectors */
+#define BC_RAMAX	(256 / BLKSECTS)
+
 struct Super *super;		// superblock
 uint32_t *bitmap;		// bitmap blocks mapped in memory
 
+/* A disk request (see ide_submit) */
+struct IdeReq {
+	uint32_t ir_secno;		// first sector
+	size_t ir_nsecs;		// sectors to transfer, at most 256
+	void *ir_buf;			// memory to transfer to or from
+	bool ir_write;			// transfer to the disk
+	int ir_status;			// IDE_PENDING, then 0 or < 0
+	void (*ir_done)(struct IdeReq *req); // called when done, if set
+	uint32_t ir_deadline;		// command count to serve it by
+	struct IdeReq *ir_next;		// next in queue or batch
+};
+#define IDE_PENDING	1
+
+/* Notification bit that IRQ_IDE sets for the file system server */
+#define IDE_NOTIFY	0x1
+/* Notification bit a helper sets when it lets go of a lock the primary
+ * wants */
+#define PEER_NOTIFY	0x2
+
+/* State the file server instances share on one PTE_SHARE page (see
+ * peer.c).  Helpers hold the locks for reading while they serve a
+ * request, the primary for writing while it changes what they cover. */
+#define FS_NLOCKS	64
+#define FS_NREPLACED	64
+
+struct FsShared {
+	envid_t fs_primary;		// the server that owns the disk
+	uint32_t fs_maxblocks;		// cache limit, which helpers follow
+	uint32_t fs_hits[FS_NSERVERS];	// cache hits in each helper
+	uint32_t fs_names;		// lock on directory contents
+	uint32_t fs_locks[FS_NLOCKS];	// file locks, hashed by File
+	uint32_t fs_nreplaced;		// cache pages replaced so far
+	uint32_t fs_replaced[FS_NREPLACED]; // blocks of the latest ones
+};
+
+extern struct FsShared *fsshared;
+extern bool fs_helper;		// this server is not the primary
+extern uint32_t fs_index;	// this server's place in envs[] order
+
 /* ide.c */
 bool	ide_probe_disk1(void);
 void	ide_set_disk(int diskno);
+bool	ide_dma_init(void);
+int	ide_set_dma(bool dma);
+void	ide_submit(struct IdeReq *req);
+void	ide_intr(void);
+bool	ide_async(void);
+int	ide_wait(struct IdeReq *req);
 int	ide_read(uint32_t secno, void *dst, size_t nsecs);
 int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 
@@ -24,25 +79,57 @@ int	ide_write(uint32_t secno, const void *src, size_t nsecs);
 void*	diskaddr(uint32_t blockno);
 bool	va_is_mapped(void *va);
 bool	va_is_dirty(void *va);
-void	flush_block(void *addr, bool force);
+int	flush_block(void *addr, bool force);
+int	bc_write_blocks(uint32_t *blocknos, uint32_t n);
+int	bc_flush(struct File *f, uint32_t min, uint32_t max);
+void	bc_dirty(void *addr, struct File *f, uint32_t filebno);
+void	bc_alloc(uint32_t blockno, struct File *f, uint32_t filebno);
 void	read_block(void *addr);
+void	read_blocks(uint32_t blockno, uint32_t nblocks);
+bool	bc_lookup(uint32_t blockno);
+bool	bc_ready(uint32_t blockno);
+bool	bc_fetching(void);
+int	bc_reap(void);
+int	bc_set_limit(uint32_t maxblocks);
+void	bc_drop(uint32_t blockno);
+void	bc_drop_all(void);
 void	bc_init(void);
 
+extern struct BcStat bc_stat;
+
 /* fs.c */
 void	fs_init(void);
 int	file_get_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_read_block(struct File *f, uint32_t file_blockno, char **pblk);
+int	file_block_cached(struct File *f, uint32_t filebno, uint32_t *pdiskbno);
 int	file_create(const char *path, struct File **f);
 int	file_open(const char *path, struct File **f);
 ssize_t	file_read(struct File *f, void *buf, size_t count, off_t offset);
 int	file_write(struct File *f, const void *buf, size_t count, off_t offset);
 int	file_set_size(struct File *f, off_t newsize);
-void	file_flush(struct File *f, size_t length, off_t offset, bool force);
+int	file_flush(struct File *f, size_t length, off_t offset, bool force);
 int	file_remove(const char *path);
-void	fs_sync(void);
+int	fs_sync(void);
+
+/* peer.c */
+void	peer_init(void);
+void	peer_join(void);
+void	peer_read(uint32_t blockno, uint32_t nblocks);
+void	peer_cow(uint32_t blockno);
+void	peer_replaced(uint32_t blockno);
+void	peer_sync(void);
+uint32_t *file_lock(struct File *f);
+void	fslock_read(uint32_t *lock);
+void	fslock_read_unlock(uint32_t *lock);
+bool	fslock_trywrite(uint32_t *lock);
+void	fslock_write_unlock(uint32_t *lock);
+void	fslock_unwant_all(void);
 
 /* int	map_block(uint32_t); */
 bool	block_is_free(uint32_t blockno);
-int	alloc_block(void);
+int	alloc_block(uint32_t goal);
+int	alloc_extent(uint32_t goal, uint32_t want, uint32_t *pn);
+void	alloc_set_fast(bool fast);
 
 /* test.c */
 void	fs_test(void);
@@ -134,16 +134,13 @@ finishdisk(void)
 void
 finishfile(struct File *f, uint32_t start, uint32_t len)
 {
-	int i;
 	f->f_size = len;
 	len = ROUNDUP(len, BLKSIZE);
-	for (i = 0; i < len / BLKSIZE && i < NDIRECT; ++i)
-		f->f_direct[i] = start + i;
-	if (i == NDIRECT) {
-		uint32_t *ind = alloc(BLKSIZE);
-		f->f_indirect = blockof(ind);
-		for (; i < len / BLKSIZE; ++i)
-			ind[i - NDIRECT] = start + i;
+	// Files are laid out contiguously, so one extent does
+	if (len > 0) {
+		f->f_nextents = 1;
+		f->f_extents[0].e_start = start;
+		f->f_extents[0].e_len = len / BLKSIZE;
 	}
 }
 
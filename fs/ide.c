@@ -1,5 +1,7 @@
 /*
- * Minimal PIO-based (non-interrupt-driven) IDE driver code.
+ * Minimal IDE driver code.  Transfers use bus-master DMA, finished by
+ * the disk's interrupt, when the controller supports it, and polled PIO
+ * otherwise.
  * For information about what all this IDE/ATA magic means,
  * see the materials available on the class references page.
  */
@@ -12,8 +14,64 @@
 #define IDE_DF		0x20
 #define IDE_ERR		0x01
 
+#define IDE_CTL		0x3F6		// device control register
+#define IDE_CTL_NIEN	0x02		// no interrupts
+
 static int diskno = 1;
 
+// PCI configuration space access
+#define PCI_CONF_ADDR	0xCF8
+#define PCI_CONF_DATA	0xCFC
+#define PCI_COMMAND	0x04
+#define PCI_CLASS	0x08
+#define PCI_BAR4	0x20
+#define PCI_CMD_MASTER	0x04		// device may master the bus
+#define PCI_CLASS_IDE	0x0101		// mass storage, IDE
+
+// Bus-master IDE registers of the primary channel, which the disks are
+// on, relative to the I/O base in BAR4 of the IDE controller
+#define BM_CMD		0
+#define BM_STATUS	2
+#define BM_PRDT		4
+#define BM_CMD_START	0x01
+#define BM_CMD_READ	0x08		// transfer from disk to memory
+#define BM_ST_ERR	0x02
+#define BM_ST_INTR	0x04
+
+// A physical region descriptor: one physically contiguous piece of a
+// DMA transfer, which must not cross a 64KB boundary.
+struct Prd {
+	uint32_t prd_addr;
+	uint16_t prd_len;
+	uint16_t prd_flags;
+};
+#define PRD_EOT		0x8000		// last descriptor of the table
+
+#define IDE_MAXSECS	256		// most sectors one command moves
+
+// Enough descriptors for a 256-sector transfer that starts part way
+// into a page, even if none of its pages are physically adjacent
+#define IDE_NPRD	(IDE_MAXSECS * SECTSIZE / PGSIZE + 1)
+
+static uint16_t bmbase;		// bus-master I/O base, or 0 if none
+static bool usedma;		// transfer with DMA
+static uint32_t irqbit;		// IDE_NOTIFY if we get IRQ_IDE, else 0
+static struct Prd prdt[IDE_NPRD] __attribute__((aligned(PGSIZE)));
+static physaddr_t prdt_pa;
+
+// Requests wait in ide_queue, sorted by sector, until the disk is free.
+// The disk serves them in one direction: the next request is the first
+// at or after the sector where the last command ended, wrapping around
+// to the lowest sector.  A request that IDE_DEADLINE commands have
+// passed over is served next regardless, so a stream of nearby requests
+// cannot starve it.
+#define IDE_DEADLINE	8
+
+static struct IdeReq *ide_queue;	// waiting requests, by sector
+static struct IdeReq *ide_active;	// batch the DMA command is for
+static uint32_t ide_headpos;		// sector after the last command
+static uint32_t ide_ncommands;		// commands started
+
 static int
 ide_wait_ready(bool check_error)
 {
@@ -59,13 +117,66 @@ ide_set_disk(int d)
 	diskno = d;
 }
 
-int
-ide_read(uint32_t secno, void *dst, size_t nsecs)
+static uint32_t
+pci_conf_read(int dev, int func, int off)
 {
-	int r;
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	return inl(PCI_CONF_DATA);
+}
+
+static void
+pci_conf_write(int dev, int func, int off, uint32_t v)
+{
+	outl(PCI_CONF_ADDR, 0x80000000 | (dev << 11) | (func << 8) | off);
+	outl(PCI_CONF_DATA, v);
+}
 
-	assert(nsecs <= 256);
+// Look for an IDE controller with bus-master registers on PCI bus 0 and
+// let it master the bus.  Transfers use DMA from then on if it is found.
+// Returns true if it is.
+bool
+ide_dma_init(void)
+{
+	uint32_t bar;
+	int dev, func, r;
 
+	for (dev = 0; dev < 32; dev++)
+		for (func = 0; func < 8; func++) {
+			if ((pci_conf_read(dev, func, 0) & 0xFFFF) == 0xFFFF ||
+			    (pci_conf_read(dev, func, PCI_CLASS) >> 16) != PCI_CLASS_IDE)
+				continue;
+			bar = pci_conf_read(dev, func, PCI_BAR4);
+			if (!(bar & 1) || (bar & 0xFFFC) == 0)
+				continue;
+			if ((r = sys_page_phys(prdt)) < 0)
+				panic("ide_dma_init: sys_page_phys: %e", r);
+			prdt_pa = r;
+			bmbase = bar & 0xFFFC;
+			pci_conf_write(dev, func, PCI_COMMAND,
+				       pci_conf_read(dev, func, PCI_COMMAND) | PCI_CMD_MASTER);
+			usedma = true;
+			if (sys_irq_notify(IRQ_IDE, IDE_NOTIFY) == 0)
+				irqbit = IDE_NOTIFY;
+			return true;
+		}
+	return false;
+}
+
+// Choose between DMA and PIO transfers.  Returns -E_NOT_SUPP if DMA is
+// asked for but there is no bus-master controller.
+int
+ide_set_dma(bool dma)
+{
+	if (dma && !bmbase)
+		return -E_NOT_SUPP;
+	usedma = dma;
+	return 0;
+}
+
+// Start command 'cmd' on 'nsecs' sectors from 'secno' on.
+static void
+ide_command(uint32_t secno, size_t nsecs, uint8_t cmd)
+{
 	ide_wait_ready(0);
 
 	outb(0x1F2, nsecs);
@@ -73,39 +184,254 @@ ide_read(uint32_t secno, void *dst, size_t nsecs)
 	outb(0x1F4, (secno >> 8) & 0xFF);
 	outb(0x1F5, (secno >> 16) & 0xFF);
 	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x20);	// CMD 0x20 means read sector
+	outb(0x1F7, cmd);
+}
 
-	for (; nsecs > 0; nsecs--, dst += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
-			return r;
-		insl(0x1F0, dst, SECTSIZE/4);
-	}
+// Describe the buffers of the requests in 'batch' in prdt, one descriptor
+// per run of physically adjacent pages.  A buffer the device is to write
+// to must be mapped writable, since the device bypasses copy-on-write.
+// Returns < 0 if some buffer cannot be used for DMA; the batch then goes
+// by PIO.
+static int
+ide_dma_prepare(struct IdeReq *batch)
+{
+	struct IdeReq *req;
+	struct Prd *prd = NULL;
+	uintptr_t va;
+	size_t len, n;
+	int pa;
 
+	for (req = batch; req; req = req->ir_next) {
+		va = (uintptr_t) req->ir_buf;
+		if (va & 1)
+			return -E_INVAL;
+		for (len = req->ir_nsecs * SECTSIZE; len > 0; va += n, len -= n) {
+			n = MIN(len, PGSIZE - PGOFF(va));
+			if (!req->ir_write && !(uvpt[PGNUM(va)] & PTE_W))
+				return -E_INVAL;
+			if ((pa = sys_page_phys((void *) va)) < 0)
+				return pa;
+			if (prd && prd->prd_addr + prd->prd_len == pa &&
+			    prd->prd_len + n < 0x10000 &&
+			    (prd->prd_addr >> 16) == ((pa + n - 1) >> 16)) {
+				prd->prd_len += n;
+				continue;
+			}
+			prd = prd ? prd + 1 : prdt;
+			if (prd == prdt + IDE_NPRD)
+				return -E_INVAL;
+			prd->prd_addr = pa;
+			prd->prd_len = n;
+			prd->prd_flags = 0;
+		}
+	}
+	prd->prd_flags = PRD_EOT;
 	return 0;
 }
 
-int
-ide_write(uint32_t secno, const void *src, size_t nsecs)
+// Start the DMA transfer described by prdt.  The disk interrupts when it
+// is done, and the controller moves the data without us meanwhile.
+static void
+ide_dma_start(uint32_t secno, size_t nsecs, bool todisk)
+{
+	uint8_t dir = todisk ? 0 : BM_CMD_READ;
+
+	outb(IDE_CTL, 0);
+	outl(bmbase + BM_PRDT, prdt_pa);
+	outb(bmbase + BM_CMD, dir);
+	outb(bmbase + BM_STATUS, inb(bmbase + BM_STATUS) | BM_ST_ERR | BM_ST_INTR);
+	ide_command(secno, nsecs, todisk ? 0xCA : 0xC8);	// WRITE/READ DMA
+	outb(bmbase + BM_CMD, dir | BM_CMD_START);
+}
+
+// Move the 'nsecs' sectors of 'batch' with programmed I/O, polling the
+// disk between sectors.
+static int
+ide_pio(struct IdeReq *batch, size_t nsecs)
 {
+	struct IdeReq *req;
+	char *buf;
+	size_t i;
 	int r;
 
-	assert(nsecs <= 256);
+	outb(IDE_CTL, IDE_CTL_NIEN);
+	// CMD 0x30 means write sector, 0x20 read sector
+	ide_command(batch->ir_secno, nsecs, batch->ir_write ? 0x30 : 0x20);
 
-	ide_wait_ready(0);
+	for (req = batch; req; req = req->ir_next)
+		for (i = 0, buf = req->ir_buf; i < req->ir_nsecs; i++, buf += SECTSIZE) {
+			if ((r = ide_wait_ready(1)) < 0)
+				return r;
+			if (req->ir_write)
+				outsl(0x1F0, buf, SECTSIZE/4);
+			else
+				insl(0x1F0, buf, SECTSIZE/4);
+		}
+	return 0;
+}
 
-	outb(0x1F2, nsecs);
-	outb(0x1F3, secno & 0xFF);
-	outb(0x1F4, (secno >> 8) & 0xFF);
-	outb(0x1F5, (secno >> 16) & 0xFF);
-	outb(0x1F6, 0xE0 | ((diskno&1)<<4) | ((secno>>24)&0x0F));
-	outb(0x1F7, 0x30);	// CMD 0x30 means write sector
+// Mark every request of 'batch' done with status 'r'.
+static void
+ide_complete(struct IdeReq *batch, int r)
+{
+	struct IdeReq *req, *next;
 
-	for (; nsecs > 0; nsecs--, src += SECTSIZE) {
-		if ((r = ide_wait_ready(1)) < 0)
-			return r;
-		outsl(0x1F0, src, SECTSIZE/4);
+	for (req = batch; req; req = next) {
+		next = req->ir_next;
+		req->ir_status = r;
+		if (req->ir_done)
+			req->ir_done(req);
 	}
+}
 
-	return 0;
+// Pick the request to serve next: the one longest past its deadline if
+// any, else the first at or after the sector the disk last ended at,
+// wrapping around to the lowest sector.  Returns the link pointing at it.
+static struct IdeReq **
+ide_pick(void)
+{
+	struct IdeReq **pp, **pick = NULL;
+
+	for (pp = &ide_queue; *pp; pp = &(*pp)->ir_next)
+		if ((int32_t) (ide_ncommands - (*pp)->ir_deadline) >= 0 &&
+		    (!pick || (int32_t) ((*pp)->ir_deadline - (*pick)->ir_deadline) < 0))
+			pick = pp;
+	if (pick)
+		return pick;
+	for (pp = &ide_queue; *pp; pp = &(*pp)->ir_next)
+		if ((*pp)->ir_secno >= ide_headpos)
+			return pp;
+	return &ide_queue;
+}
+
+// Start commands for queued requests until one is left running on the
+// disk.  The picked request takes the requests that continue it on disk
+// in the same direction along into one command.
+static void
+ide_start(void)
+{
+	struct IdeReq **pp, *batch, *last, *next;
+	size_t nsecs;
+
+	while (!ide_active && ide_queue) {
+		pp = ide_pick();
+		batch = last = *pp;
+		*pp = batch->ir_next;
+		nsecs = batch->ir_nsecs;
+		while ((next = *pp) && next->ir_secno == batch->ir_secno + nsecs &&
+		       next->ir_write == batch->ir_write &&
+		       nsecs + next->ir_nsecs <= IDE_MAXSECS) {
+			*pp = next->ir_next;
+			last->ir_next = next;
+			last = next;
+			nsecs += next->ir_nsecs;
+		}
+		last->ir_next = NULL;
+		ide_ncommands++;
+		ide_headpos = batch->ir_secno + nsecs;
+
+		if (usedma && ide_dma_prepare(batch) == 0) {
+			ide_dma_start(batch->ir_secno, nsecs, batch->ir_write);
+			ide_active = batch;
+		} else
+			ide_complete(batch, ide_pio(batch, nsecs));
+	}
 }
 
+// Queue disk request 'req', which the caller fills in except for
+// ir_status, ir_deadline and ir_next.  ir_status stays IDE_PENDING until
+// the transfer is done, when ir_done, if set, is called.  'req' must
+// stay put until then.
+void
+ide_submit(struct IdeReq *req)
+{
+	struct IdeReq **pp;
+
+	assert(req->ir_nsecs > 0 && req->ir_nsecs <= IDE_MAXSECS);
+	req->ir_status = IDE_PENDING;
+	req->ir_deadline = ide_ncommands + IDE_DEADLINE;
+	for (pp = &ide_queue; *pp && (*pp)->ir_secno <= req->ir_secno;
+	     pp = &(*pp)->ir_next)
+		/* do nothing */;
+	req->ir_next = *pp;
+	*pp = req;
+	ide_start();
+}
+
+// Finish the DMA command in progress if the disk is done with it, and
+// start the next one.  This is called for the IDE_NOTIFY notification,
+// and calling it at other times is harmless.
+void
+ide_intr(void)
+{
+	struct IdeReq *batch;
+	int st, r;
+
+	if (!ide_active ||
+	    !((st = inb(bmbase + BM_STATUS)) & (BM_ST_INTR | BM_ST_ERR)))
+		return;
+	outb(bmbase + BM_CMD, ide_active->ir_write ? 0 : BM_CMD_READ);
+	outb(bmbase + BM_STATUS, st | BM_ST_ERR | BM_ST_INTR);
+	r = (ide_wait_ready(1) < 0 || (st & BM_ST_ERR)) ? -1 : 0;
+
+	batch = ide_active;
+	ide_active = NULL;
+	ide_complete(batch, r);
+	ide_start();
+}
+
+// Returns true if DMA requests complete by interrupt, so that waiting for
+// them can be left to the IDE_NOTIFY notification.
+bool
+ide_async(void)
+{
+	return usedma && irqbit;
+}
+
+// Wait for 'req' to finish and return its status.  Only notifications
+// are taken meanwhile; clients trying to send to us wait.  Those other
+// than the disk's are set again for the server loop to see.
+int
+ide_wait(struct IdeReq *req)
+{
+	uint32_t other = 0;
+
+	while (req->ir_status == IDE_PENDING) {
+		if (irqbit && sys_ipc_recv_notify(thisenv->env_id, (void *) UTOP) > 0)
+			other |= thisenv->env_notify_taken & ~IDE_NOTIFY;
+		else if (!irqbit)
+			sys_yield();
+		ide_intr();
+	}
+	if (other)
+		sys_notify(thisenv->env_id, other);
+	return req->ir_status;
+}
+
+int
+ide_read(uint32_t secno, void *dst, size_t nsecs)
+{
+	struct IdeReq req;
+
+	memset(&req, 0, sizeof(req));
+	req.ir_secno = secno;
+	req.ir_nsecs = nsecs;
+	req.ir_buf = dst;
+	req.ir_write = false;
+	ide_submit(&req);
+	return ide_wait(&req);
+}
+
+int
+ide_write(uint32_t secno, const void *src, size_t nsecs)
+{
+	struct IdeReq req;
+
+	memset(&req, 0, sizeof(req));
+	req.ir_secno = secno;
+	req.ir_nsecs = nsecs;
+	req.ir_buf = (void *) src;
+	req.ir_write = true;
+	ide_submit(&req);
+	return ide_wait(&req);
+}
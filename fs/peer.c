@@ -0,0 +1,228 @@
+/*
+ * Several file server instances, one per CPU up to FS_NSERVERS, serve
+ * clients at once.  The first one in envs[] is the primary: only it talks
+ * to the disk or changes the file system.  The others are helpers, which
+ * open files read-only and serve reads of them.  A helper gets every block
+ * it needs from the primary's cache as a PTE_SHARE mapping of the same
+ * page (FSREQ_BLOCKS), so all instances see one copy of each block, and
+ * shares a page of locks with it (struct FsShared).
+ */
+
+#include "fs.h"
+
+// Where the shared page is mapped in each server
+#define FSSHAREVA	0x0d000000
+
+struct FsShared *fsshared;
+bool fs_helper;
+uint32_t fs_index;
+
+// Lock words.  Helpers count themselves in as readers; the primary never
+// sleeps on a lock, since a helper holding one may be waiting for a block
+// from it.  It sets FSLOCK_WANTED instead and puts its request aside, and
+// the last reader out sends it PEER_NOTIFY.  New readers wait while
+// FSLOCK_WANTED is set, so a steady stream of them can't keep the primary
+// out.  A helper holds one lock at a time, so this can't deadlock.
+//
+// The primary remembers the locks it has set FSLOCK_WANTED on, and
+// clears them all with fslock_unwant_all before it retries its parked
+// requests, so a request that went away or now needs other locks leaves
+// no reader waiting.
+#define FSLOCK_WRITER	0x80000000	// the primary holds it
+#define FSLOCK_WANTED	0x40000000	// the primary waits for the readers
+#define FSLOCK_SLEEPING	0x20000000	// readers sleep on the word
+#define FSLOCK_READERS	0x1fffffff
+
+// The locks the primary has set FSLOCK_WANTED on
+static uint32_t *fslock_wanted[FS_NLOCKS + 1];
+static uint32_t fslock_nwanted;
+
+// Set up the shared page in the primary.
+void
+peer_init(void)
+{
+	int r;
+
+	fsshared = (struct FsShared *) FSSHAREVA;
+	if ((r = sys_page_alloc(0, fsshared, PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("peer_init: %e", r);
+	fsshared->fs_primary = thisenv->env_id;
+	fsshared->fs_maxblocks = bc_stat.bs_maxblocks;
+}
+
+// Make this server a helper of the primary, the first file server in
+// envs[], and map the superblock from it.
+void
+peer_join(void)
+{
+	envid_t primary;
+	int i, r;
+
+	primary = ipc_find_env(ENV_TYPE_FS);
+	for (i = 0; i < NENV && envs[i].env_id != thisenv->env_id; i++)
+		if (envs[i].env_type == ENV_TYPE_FS)
+			fs_index++;
+	fs_helper = true;
+	fsshared = (struct FsShared *) FSSHAREVA;
+	if ((r = ipc_call(primary, FSREQ_JOIN, NULL, 0, fsshared, NULL)) < 0)
+		panic("peer_join: %e", r);
+	bc_stat.bs_maxblocks = fsshared->fs_maxblocks;
+	bc_init();
+	super = diskaddr(1);
+}
+
+// Map the 'nblocks' blocks starting at 'blockno' from the primary's
+// cache, which reads them from disk first if it has to.  Only helpers
+// call this, in place of reading the disk.
+void
+peer_read(uint32_t blockno, uint32_t nblocks)
+{
+	uint32_t words[IPC_NWORDS] = { 0 };
+	size_t n;
+	int r;
+
+	for (; nblocks > 0; blockno += n, nblocks -= n) {
+		words[0] = blockno;
+		words[1] = MIN(nblocks, IPC_MAXPAGES);
+		ipc_send_words(fsshared->fs_primary, FSREQ_BLOCKS, words);
+		if ((r = ipc_recv_window(fsshared->fs_primary, NULL,
+					 diskaddr(blockno), words[1], &n)) < 0)
+			panic("peer_read %d+%d: %e", blockno, words[1], r);
+		if (n == 0)
+			panic("peer_read %d+%d: got no blocks", blockno,
+			      words[1]);
+	}
+}
+
+// Have the primary write block 'blockno' back and map it copy-on-write,
+// so that it copies the block before changing it, and map the page from
+// it again.  A helper does this before it gives a client a copy-on-write
+// mapping of the block, so the primary's later writes don't show through.
+void
+peer_cow(uint32_t blockno)
+{
+	uint32_t words[IPC_NWORDS] = { blockno, 1, 1 };
+	size_t n;
+	int r;
+
+	ipc_send_words(fsshared->fs_primary, FSREQ_BLOCKS, words);
+	if ((r = ipc_recv_window(fsshared->fs_primary, NULL,
+				 diskaddr(blockno), 1, &n)) < 0 || n != 1)
+		panic("peer_cow %d: %e", blockno, r);
+}
+
+// Note that the primary has given block 'blockno' a new page, so helpers
+// mapping the old one must drop it.  The primary calls this holding the
+// lock of whatever lives in the block, so a helper that takes that lock
+// and then calls peer_sync never sees the old page.
+void
+peer_replaced(uint32_t blockno)
+{
+	fsshared->fs_replaced[fsshared->fs_nreplaced % FS_NREPLACED] = blockno;
+	__sync_fetch_and_add(&fsshared->fs_nreplaced, 1);
+}
+
+// Catch a helper up with the primary before it serves a request: drop
+// the blocks the primary has replaced since last time, all of them if
+// the log has wrapped, and follow its cache limit.  Also publish this
+// helper's hit count for FSREQ_CACHE.
+void
+peer_sync(void)
+{
+	static uint32_t seen;
+	uint32_t i, n;
+
+	n = fsshared->fs_nreplaced;
+	for (i = seen; i != n && n - seen <= FS_NREPLACED; i++)
+		bc_drop(fsshared->fs_replaced[i % FS_NREPLACED]);
+	// The primary may have reused log entries meanwhile
+	if (fsshared->fs_nreplaced - seen > FS_NREPLACED)
+		bc_drop_all();
+	seen = n;
+	bc_stat.bs_maxblocks = fsshared->fs_maxblocks;
+	fsshared->fs_hits[fs_index] = bc_stat.bs_hits;
+}
+
+// Return the lock covering the contents of file 'f'.
+uint32_t *
+file_lock(struct File *f)
+{
+	return &fsshared->fs_locks[((uintptr_t) f / sizeof(struct File)) % FS_NLOCKS];
+}
+
+void
+fslock_read(uint32_t *lock)
+{
+	uint32_t v;
+
+	for (;;) {
+		v = *(volatile uint32_t *) lock;
+		if (!(v & (FSLOCK_WRITER | FSLOCK_WANTED))) {
+			if (__sync_bool_compare_and_swap(lock, v, v + 1))
+				return;
+		} else if ((v & FSLOCK_SLEEPING) ||
+			   __sync_bool_compare_and_swap(lock, v, v | FSLOCK_SLEEPING))
+			sys_futex_wait(lock, v | FSLOCK_SLEEPING, 0);
+	}
+}
+
+void
+fslock_read_unlock(uint32_t *lock)
+{
+	uint32_t v;
+
+	v = __sync_sub_and_fetch(lock, 1);
+	if (!(v & FSLOCK_READERS) && (v & FSLOCK_WANTED))
+		sys_notify(fsshared->fs_primary, PEER_NOTIFY);
+}
+
+// Take 'lock' for writing if no helper has it.  Otherwise ask for
+// PEER_NOTIFY once they have all let go, and return false.
+bool
+fslock_trywrite(uint32_t *lock)
+{
+	uint32_t i, v;
+
+	for (;;) {
+		v = *(volatile uint32_t *) lock;
+		if (v & FSLOCK_READERS) {
+			if (v & FSLOCK_WANTED)
+				return false;
+			if (__sync_bool_compare_and_swap(lock, v, v | FSLOCK_WANTED)) {
+				for (i = 0; i < fslock_nwanted; i++)
+					if (fslock_wanted[i] == lock)
+						break;
+				if (i == fslock_nwanted)
+					fslock_wanted[fslock_nwanted++] = lock;
+				return false;
+			}
+		} else if (__sync_bool_compare_and_swap(lock, v,
+				(v & ~FSLOCK_WANTED) | FSLOCK_WRITER))
+			return true;
+	}
+}
+
+void
+fslock_write_unlock(uint32_t *lock)
+{
+	uint32_t v;
+
+	v = __sync_fetch_and_and(lock, ~(FSLOCK_WRITER | FSLOCK_SLEEPING));
+	if (v & FSLOCK_SLEEPING)
+		sys_futex_wake(lock, NENV);
+}
+
+// Withdraw the primary's FSLOCK_WANTED from every lock, waking the
+// readers waiting on it.
+void
+fslock_unwant_all(void)
+{
+	uint32_t v, *lock;
+
+	while (fslock_nwanted > 0) {
+		lock = fslock_wanted[--fslock_nwanted];
+		v = __sync_fetch_and_and(lock, ~(FSLOCK_WANTED | FSLOCK_SLEEPING));
+		if (v & FSLOCK_SLEEPING)
+			sys_futex_wake(lock, NENV);
+	}
+}
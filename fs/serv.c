@@ -48,13 +48,38 @@ struct OpenFile opentab[MAXOPEN] = {
 // Virtual address at which to receive page mappings containing client requests.
 union Fsipc *fsreq = (union Fsipc *)0x0ffff000;
 
+// Buffer for requests that arrive by kernel byte copy instead of on a
+// mapped page.
+union Fsipc fsbuf __attribute__((aligned(PGSIZE)));
+
+// Each client's channel page (see FSREQ_CHANNEL) stays mapped at
+// CHANVA + ENVX(envid) * PGSIZE, and chanenv records whose it is.
+#define CHANVA		0x0b000000
+#define CHAN(envid)	((union Fsipc *) (CHANVA + ENVX(envid) * PGSIZE))
+envid_t chanenv[NENV];
+
+// Requests the primary can't serve yet park here while the ones it can
+// go on.  Each client has at most one request outstanding, so there is a
+// slot for each env.  A parked request keeps its arguments on the
+// client's channel page, or on a page of its own at PARKPG(ENVX(whom)).
+#define PARKVA		0x0a000000
+#define PARKPG(i)	((union Fsipc *) (PARKVA + (i) * PGSIZE))
+
+static struct Parked {
+	envid_t pk_whom;		// 0 if the slot is free
+	uint32_t pk_req;
+	union Fsipc *pk_ipc;
+} parked[NENV];
+static uint32_t parkq[NENV];		// the slots in use
+static uint32_t nparked;
+
 void
 serve_init(void)
 {
 	int i;
 	uintptr_t va = FILEVA;
 	for (i = 0; i < MAXOPEN; i++) {
-		opentab[i].o_fileid = i;
+		opentab[i].o_fileid = i | (fs_index << FSID_SHIFT);
 		opentab[i].o_fd = (struct Fd*) va;
 		va += PGSIZE;
 	}
@@ -76,7 +101,10 @@ openfile_alloc(struct OpenFile **o)
 		case 1:
 			if (debug)
 				cprintf("openfile_alloc(): got to case 1\n");
-			opentab[i].o_fileid += MAXOPEN;
+			// A new generation of the id, still naming this server
+			opentab[i].o_fileid = ((opentab[i].o_fileid + MAXOPEN) &
+					       ((1 << FSID_SHIFT) - 1)) |
+					      (fs_index << FSID_SHIFT);
 			*o = &opentab[i];
 			memset(opentab[i].o_fd, 0, PGSIZE);
 			return (*o)->o_fileid;
@@ -179,110 +207,113 @@ serve_open(envid_t envid, struct Fsreq_open *req,
 	return 0;
 }
 
-// Private pagefault handler similar to the one in fork.c.  If a
-//  write fault occurs on a PTE_COW block, copy the contents of
-//  the block to a new page and map the new page to the old.
-static void
-pgfault(struct UTrapframe *utf)
+// Check that open file 'o' may hand out blocks with 'perm', and work
+//  out the permissions the client's mappings should get.
+static int
+block_req_perm(struct OpenFile *o, int perm, int *perm_store)
 {
-	void *addr = (void *) utf->utf_fault_va;
-	uint32_t err = utf->utf_err;
-
-	// Round the address down to the nearest page
-	addr = ROUNDDOWN(addr, PGSIZE);
-
-	// Check that the faulting access was (1) a write, and (2) to a
-	// copy-on-write page.  If not, panic.
-	//
-	// If the second bit of err is not set, the fault is a read
-	if((err&2) == 0)
-		panic("fault was not caused by a write\n");
-	if((uvpt[PGNUM(addr)]&PTE_COW) == 0)
-		panic("faulting page was not copy-on-write");
-
-	// Allocate a new page, map it at a temporary location (PFTEMP),
-	// copy the data from the old page to the new page, then move the new
-	// page to the old page's address.
-	//
-	// First attempt to allocate a new page at the temporary address
-	if(sys_page_alloc(0, PFTEMP, PTE_U|PTE_W) != 0)
-		panic("couldn't allocate a new page for copy-on-write");
-
-	// Next, copy the memory from the old page to the new
-	memcpy(PFTEMP, addr, PGSIZE);
-
-	// Finally, remap the new page to the old address.  Don't bother
-	//  cleaning up PFTEMP.
-	if(sys_page_map(0, PFTEMP, 0, addr, PTE_U|PTE_W) != 0)
-		panic("couldn't remap the temporary page for copy-on-write");
-}
-
-// For the file req->req_fileid, find the block of memory that
-//  holds req->req_offset and stores the address and permissions
-//  in *pg_store and *perm_store.
-int
-serve_block_req(envid_t envid, struct Fsreq_breq *req,
-	   void **pg_store, int *perm_store)
-{
-	int r;
-	struct OpenFile *o;
-
-	if(debug) {
-		cprintf("serve_block_req %08x %08x %08x %08x\n", envid, req->req_fileid, req->req_offset, req->req_perm);
-	}
-
-	// Find the relevant open file to map
-	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
-		return r;
-
 	// If the file is opened in a read-only mode, then the
 	//  block cannot be requested with PTE_W (though it can
 	//  be requested with PTE_COW).
 	//
 	// All files must have read access to request a block
 	if((o->o_mode&O_ACCMODE) == O_WRONLY ||
-	   ((o->o_mode&O_ACCMODE) == O_RDONLY && (req->req_perm&PTE_W) == 1))
+	   ((o->o_mode&O_ACCMODE) == O_RDONLY && (perm&PTE_W) && !(perm&PTE_COW)))
 		return -E_MODE_ERR;
 
 	// In addition, blocks cannot be requested with both PTE_COW
 	//  and PTE_SHARE
-	if((req->req_perm&PTE_COW) && (req->req_perm&PTE_SHARE))
+	if((perm&PTE_COW) && (perm&PTE_SHARE))
 		return -E_INVAL;
 
-	// Ensure that req->offset is contained within the file, and
-	//  grab the page that contains it.
-	r = -E_INVAL;
-	if(req->req_offset < 0 ||
-	   req->req_offset >= o->o_file->f_size ||
-	   (r = file_get_block(o->o_file, req->req_offset/BLKSIZE, (char **)pg_store)) != 0)
+	// If the requested permissions don't include PTE_W, the
+	// permissions should be read-only.  If they do, the permissions
+	// should be PTE_COW.
+	*perm_store = perm;
+	if(perm&PTE_COW) {
+		if(perm&PTE_W)
+			// Unset PTE_W
+			*perm_store &= ~PTE_W;
+		else
+			// Unset PTE_COW
+			*perm_store &= ~PTE_COW;
+	}
+	return 0;
+}
+
+// Find the block of memory that holds 'offset' in open file 'o', read
+//  it into the buffer cache if needed, and store its address in
+//  *pg_store.  'perm' is the permission the client asked for.
+static int
+block_req_page(struct OpenFile *o, uint32_t offset, int perm, void **pg_store)
+{
+	int r;
+	bool shared;
+
+	// Ensure that offset is contained within the file, and
+	//  grab the page that contains it.  Only a page the client may
+	//  write needs a hole filled in; otherwise it gets the zero block.
+	shared = (perm&PTE_W) && !(perm&PTE_COW);
+	if(offset < 0 || offset >= o->o_file->f_size)
+		return -E_INVAL;
+	if(shared)
+		r = file_get_block(o->o_file, offset/BLKSIZE, (char **)pg_store);
+	else
+		r = file_read_block(o->o_file, offset/BLKSIZE, (char **)pg_store);
+	if(r != 0)
 		return r;
 
+	// The zero block is never written, so it needs none of the below
+	if(*pg_store < (void*)DISKMAP || *pg_store >= (void*)(DISKMAP + DISKSIZE))
+		return 0;
+
 	// If the page is not mapped yet, read the block into the buffer cache
 	if(!va_is_mapped(*pg_store))
 		read_block(*pg_store);
 
 	// If requesting a PTE_COW mapping, we should mark the file in
-	//  our address space as PTE_COW as well.
-	*perm_store = req->req_perm;
-	if(*perm_store&PTE_COW) {
+	//  our address space as PTE_COW as well.  Writing the block then
+	//  copies it (see bc_dirty), so write it back first: only writable
+	//  blocks are dirty.  A helper's page is also the primary's, which
+	//  is the one that gets written, so the primary has to do this.
+	if(perm&PTE_COW) {
+		if(fs_helper)
+			peer_cow(((uint32_t) *pg_store - DISKMAP) / BLKSIZE);
+		else
+			flush_block(*pg_store, false);
 		// Map the file block's page as PTE_COW
 		if(sys_page_map(0, *pg_store, 0, *pg_store, PTE_U|PTE_COW) != 0)
 			panic("file system unable to map own page as copy-on-write");
+	} else if(perm&PTE_W) {
+		// Only a writable page can be shared writable, and the client
+		//  may write it
+		bc_dirty(*pg_store, o->o_file, offset/BLKSIZE);
+	}
+	return 0;
+}
 
-		// Set a page-fault handler
-		set_pgfault_handler(pgfault);
+// For the file req->req_fileid, find the block of memory that
+//  holds req->req_offset and stores the address and permissions
+//  in *pg_store and *perm_store.
+int
+serve_block_req(envid_t envid, struct Fsreq_breq *req,
+	   void **pg_store, int *perm_store)
+{
+	int r;
+	struct OpenFile *o;
 
-		// If the requested permissions don't include PTE_W, the
-		// permissions should be read-only.  If they do, the permissions
-		// should be PTE_COW.
-		if(*perm_store&PTE_W)
-			// Unset PTE_W
-			*perm_store &= ~PTE_W;
-		else
-			// Unset PTE_COW
-			*perm_store &= ~PTE_COW;
+	if(debug) {
+		cprintf("serve_block_req %08x %08x %08x %08x\n", envid, req->req_fileid, req->req_offset, req->req_perm);
 	}
 
+	// Find the relevant open file to map
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+
+	if ((r = block_req_perm(o, req->req_perm, perm_store)) < 0 ||
+	    (r = block_req_page(o, req->req_offset, req->req_perm, pg_store)) < 0)
+		return r;
+
 	if (debug) {
 		cprintf("Page mapped correctly to %p.\n", *pg_store);
 		cprintf("Breq - Read from file:\n\t%30s\n", (char *)*pg_store);
@@ -292,6 +323,56 @@ serve_block_req(envid_t envid, struct Fsreq_breq *req,
 	return 0;
 }
 
+// Like serve_block_req, but for req->req_nblocks consecutive blocks
+//  starting at req->req_offset, stopping early at the end of the file.
+//  The blocks go back to the client in one vector message, with runs
+//  of blocks that are adjacent in the buffer cache sent as one segment.
+//  Returns the number of blocks sent, or < 0 on error, in which case
+//  nothing has been sent yet.
+int
+serve_block_reqv(envid_t envid, struct Fsreq_breq *req)
+{
+	struct IpcSeg segs[IPC_MAXSEGS];
+	struct OpenFile *o;
+	uint32_t i, n, offset;
+	int r, nsegs, perm;
+	void *pg;
+
+	if(debug)
+		cprintf("serve_block_reqv %08x %08x %08x %08x %d\n", envid, req->req_fileid, req->req_offset, req->req_perm, req->req_nblocks);
+
+	if ((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
+		return r;
+	if ((r = block_req_perm(o, req->req_perm, &perm)) < 0)
+		return r;
+
+	n = MIN(req->req_nblocks, IPC_MAXPAGES);
+	offset = ROUNDDOWN(req->req_offset, BLKSIZE);
+	nsegs = 0;
+	for (i = 0; i < n; i++, offset += BLKSIZE) {
+		if (offset >= o->o_file->f_size)
+			break;
+		if ((r = block_req_page(o, offset, req->req_perm, &pg)) < 0)
+			return r;
+		if (nsegs > 0 && segs[nsegs-1].seg_va +
+		    segs[nsegs-1].seg_npages*PGSIZE == pg)
+			segs[nsegs-1].seg_npages++;
+		else if (nsegs < IPC_MAXSEGS) {
+			segs[nsegs].seg_va = pg;
+			segs[nsegs].seg_npages = 1;
+			segs[nsegs].seg_perm = perm;
+			nsegs++;
+		} else
+			break;
+	}
+	if (i == 0)
+		return -E_INVAL;
+
+	if ((r = ipc_sendv(envid, i, segs, nsegs)) < 0)
+		return r;
+	return i;
+}
+
 // Set the size of req->req_fileid to req->req_size bytes,
 //  truncating or extending the file as necessary
 int
@@ -417,7 +498,8 @@ serve_stat(envid_t envid, union Fsipc *ipc)
 	return 0;
 }
 
-// Flush all data and metadata of req->req_fileid to disk.
+// Flush all data and metadata of req->req_fileid to disk.  Returns the
+// number of blocks written.
 int
 serve_flush(envid_t envid, union Fsipc *ipc)
 {
@@ -432,8 +514,10 @@ serve_flush(envid_t envid, union Fsipc *ipc)
 
 	if((r = openfile_lookup(envid, req->req_fileid, &o)) < 0)
 		return r;
-	file_flush(o->o_file, req->req_length, req->req_offset, req->req_force);
-	return 0;
+	// A helper's files are read-only, and it may not use the disk
+	if(fs_helper)
+		return 0;
+	return file_flush(o->o_file, req->req_length, req->req_offset, req->req_force);
 }
 
 // Remove the file req->req_path.
@@ -460,14 +544,115 @@ serve_remove(envid_t envid, union Fsipc *ipc)
 	return file_remove(path);
 }
 
-// Sync the file system.
+// Sync the file system.  Returns the number of blocks written.
 int
 serve_sync(envid_t envid, union Fsipc *req)
 {
-	fs_sync();
+	return fs_sync();
+}
+
+// Set the buffer cache limit to ipc->cache.req_maxblocks blocks, if that
+// is not 0, and return the cache's counters in ipc->cacheRet.
+int
+serve_cache(envid_t envid, union Fsipc *ipc)
+{
+	int r;
+
+	if (debug)
+		cprintf("serve_cache %08x %d\n", envid, ipc->cache.req_maxblocks);
+
+	if (ipc->cache.req_maxblocks &&
+	    (r = bc_set_limit(ipc->cache.req_maxblocks)) < 0)
+		return r;
+	fsshared->fs_maxblocks = bc_stat.bs_maxblocks;
+	ipc->cacheRet.ret_stat = bc_stat;
+	for (r = 1; r < FS_NSERVERS; r++)
+		ipc->cacheRet.ret_stat.bs_hits += fsshared->fs_hits[r];
+	return 0;
+}
+
+// Switch the disk driver to DMA or PIO transfers.
+int
+serve_diskdma(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_diskdma %08x %d\n", envid, ipc->diskdma.req_dma);
+
+	return ide_set_dma(ipc->diskdma.req_dma);
+}
+
+// Choose the block allocator (see alloc_set_fast).
+int
+serve_allocmode(envid_t envid, union Fsipc *ipc)
+{
+	if (debug)
+		cprintf("serve_allocmode %08x %d\n", envid, ipc->allocmode.req_fast);
+
+	alloc_set_fast(ipc->allocmode.req_fast);
+	return 0;
+}
+
+// Let helper 'envid' map the page of state the servers share.
+int
+serve_join(envid_t envid, union Fsipc *ipc, void **pg_store, int *perm_store)
+{
+	if (debug)
+		cprintf("serve_join %08x\n", envid);
+
+	*pg_store = fsshared;
+	*perm_store = PTE_P|PTE_U|PTE_W|PTE_SHARE;
 	return 0;
 }
 
+// Send helper 'envid' the req_nblocks cache blocks from req_blockno on,
+// which it maps read-only and shared, reading them in first if needed.
+// Fewer blocks go if reading in one evicted one before it.  With
+// req_cow, the blocks are first written back and mapped copy-on-write
+// here, as block_req_page does, because the helper is about to hand them
+// to a client as a private copy.  Returns the number of blocks sent, or
+// < 0 on error, in which case nothing has been sent yet.
+int
+serve_blocks(envid_t envid, union Fsipc *ipc)
+{
+	struct Fsreq_blocks *req = &ipc->blocks;
+	struct IpcSeg seg;
+	uint32_t n;
+	void *va;
+	int r;
+
+	if (debug)
+		cprintf("serve_blocks %08x %d %d\n", envid, req->req_blockno, req->req_nblocks);
+
+	if (req->req_blockno == 0 || req->req_nblocks == 0 ||
+	    req->req_nblocks > IPC_MAXPAGES ||
+	    req->req_blockno + req->req_nblocks > super->s_nblocks)
+		return -E_INVAL;
+	for (n = 0; n < req->req_nblocks; n++)
+		if (!bc_lookup(req->req_blockno + n))
+			read_block(diskaddr(req->req_blockno + n));
+	for (n = 0; n < req->req_nblocks; n++)
+		if (!va_is_mapped(diskaddr(req->req_blockno + n)))
+			break;
+	if (n == 0) {
+		read_block(diskaddr(req->req_blockno));
+		n = 1;
+	}
+	for (va = diskaddr(req->req_blockno);
+	     req->req_cow && va < diskaddr(req->req_blockno) + n*BLKSIZE;
+	     va += BLKSIZE) {
+		flush_block(va, false);
+		if (sys_page_map(0, va, 0, va, PTE_U|PTE_COW) != 0)
+			panic("serve_blocks: couldn't map block copy-on-write");
+	}
+
+	seg.seg_va = diskaddr(req->req_blockno);
+	seg.seg_npages = n;
+	seg.seg_perm = PTE_P|PTE_U|PTE_SHARE;
+	if ((r = ipc_sendv(envid, n, &seg, 1)) < 0)
+		return r;
+	return n;
+}
+
 typedef int (*fshandler)(envid_t envid, union Fsipc *req);
 
 fshandler handlers[] = {
@@ -482,43 +667,508 @@ fshandler handlers[] = {
 	[FSREQ_REMOVE] =	serve_remove,
 	[FSREQ_SYNC] =		serve_sync,
 	[FSREQ_SET_SIZE] =	serve_set_size,
+	[FSREQ_CACHE] =		serve_cache,
+	[FSREQ_DISKDMA] =	serve_diskdma,
+	[FSREQ_ALLOCMODE] =	serve_allocmode,
+	[FSREQ_JOIN] =		(fshandler)serve_join,
+	[FSREQ_BLOCKS] =	serve_blocks,
 };
 #define NHANDLERS (sizeof(handlers)/sizeof(handlers[0]))
 
+// Unmap the channel pages of clients that have exited, so that their
+//  pages aren't pinned until another client takes the env slot.  A
+//  channel still holding a parked request stays until that is served.
+static void
+serve_channel_sweep(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < NENV; i++)
+		if (chanenv[i] && (envs[i].env_id != chanenv[i] ||
+				   envs[i].env_status == ENV_FREE) &&
+		    parked[i].pk_whom != chanenv[i]) {
+			sys_page_unmap(0, CHAN(chanenv[i]));
+			chanenv[i] = 0;
+		}
+}
+
+// Keep the client's request page, now at fsreq, mapped as its channel
+//  so that later requests and replies can go through it without any
+//  page mapping.  A previous channel of an env with the same slot is
+//  replaced, and those of clients that have gone away are dropped.
+static int
+serve_channel(envid_t envid)
+{
+	int r;
+
+	serve_channel_sweep();
+	if ((r = sys_page_map(0, fsreq, 0, CHAN(envid),
+			      PTE_P | PTE_U | PTE_W)) < 0)
+		return r;
+	chanenv[ENVX(envid)] = envid;
+	return 0;
+}
+
+// Request types small enough to be sent with ipc_call_words, carrying
+// their arguments in the IPC inline words instead of a request page.
+#define WORDREQ(req) \
+	((req) == FSREQ_SET_SIZE || (req) == FSREQ_FLUSH || (req) == FSREQ_SYNC || \
+	 (req) == FSREQ_DISKDMA || (req) == FSREQ_ALLOCMODE || \
+	 (req) == FSREQ_JOIN || (req) == FSREQ_BLOCKS)
+
+// Unpack a word request into a request structure for the usual handler.
+static union Fsipc *
+serve_words(uint32_t req, const uint32_t *words)
+{
+	static union Fsipc wordreq;
+
+	switch (req) {
+	case FSREQ_SET_SIZE:
+		wordreq.set_size.req_fileid = words[0];
+		wordreq.set_size.req_size = words[1];
+		break;
+	case FSREQ_FLUSH:
+		wordreq.flush.req_fileid = words[0];
+		wordreq.flush.req_offset = words[1];
+		wordreq.flush.req_length = words[2];
+		wordreq.flush.req_force = false;
+		break;
+	case FSREQ_SYNC:
+	case FSREQ_JOIN:
+		break;
+	case FSREQ_DISKDMA:
+		wordreq.diskdma.req_dma = words[0];
+		break;
+	case FSREQ_ALLOCMODE:
+		wordreq.allocmode.req_fast = words[0];
+		break;
+	case FSREQ_BLOCKS:
+		wordreq.blocks.req_blockno = words[0];
+		wordreq.blocks.req_nblocks = words[1];
+		wordreq.blocks.req_cow = words[2];
+		break;
+	}
+	return &wordreq;
+}
+
+// Returns true if a helper serves request 'req'.  Helpers only read, so
+// everything else goes to the primary.
+static bool
+helper_serves(uint32_t req, union Fsipc *ipc)
+{
+	switch (req) {
+	case FSREQ_OPEN:
+		return (ipc->open.req_omode &
+			(O_ACCMODE|O_CREAT|O_TRUNC|O_MKDIR)) == O_RDONLY;
+	case FSREQ_READ:
+	case FSREQ_STAT:
+	case FSREQ_BREQ:
+	case FSREQ_FLUSH:
+	case FSREQ_CHANNEL:
+		return true;
+	default:
+		return false;
+	}
+}
+
+// Handle request 'req' from 'whom' with arguments on 'ipc'.  A page to
+// send back with the reply is stored in *pg_store and its permissions in
+// *perm_store.  Returns the reply value, or SERVE_REPLIED if the reply
+// has already been sent.  SERVE_REPLIED is no error code or count that a
+// handler could return.
+#define SERVE_REPLIED	(-MAXERROR - 1)
+
+static int
+serve_dispatch(envid_t whom, uint32_t req, union Fsipc *ipc,
+	       void **pg_store, int *perm_store)
+{
+	int r;
+
+	*pg_store = NULL;
+	if (fs_helper && !helper_serves(req, ipc)) {
+		r = -E_NOT_SUPP;
+	} else if ((req == FSREQ_JOIN || req == FSREQ_BLOCKS) &&
+		   (fs_helper || envs[ENVX(whom)].env_type != ENV_TYPE_FS)) {
+		r = -E_INVAL;
+	} else if (req == FSREQ_OPEN) {
+		r = serve_open(whom, &ipc->open, pg_store, perm_store);
+	} else if (req == FSREQ_JOIN) {
+		r = serve_join(whom, ipc, pg_store, perm_store);
+	} else if (req == FSREQ_BLOCKS) {
+		r = serve_blocks(whom, ipc);
+		if (r > 0)
+			r = SERVE_REPLIED;
+	} else if (req == FSREQ_BREQ && ipc->breq.req_nblocks > 1) {
+		r = serve_block_reqv(whom, &ipc->breq);
+		// On success the blocks have already gone out as the reply
+		if (r > 0)
+			r = SERVE_REPLIED;
+	} else if (req == FSREQ_BREQ) {
+		r = serve_block_req(whom, &ipc->breq, pg_store, perm_store);
+	} else if (req == FSREQ_CHANNEL && ipc == fsreq) {
+		r = serve_channel(whom);
+	} else if (req < NHANDLERS && handlers[req]) {
+		r = handlers[req](whom, ipc);
+	} else {
+		cprintf("Invalid request code %d from %08x\n", req, whom);
+		r = -E_INVAL;
+	}
+	return r;
+}
+
+// Returns true if the blocks holding file blocks 'filebno' up to
+// 'filebno' + 'n' of 'f' are all in the cache, along with the blocks
+// needed to find them.  Otherwise starts reading in the missing ones that
+// it can find, and returns false.
+static bool
+file_ready(struct File *f, uint32_t filebno, uint32_t n)
+{
+	uint32_t i, diskbno;
+	bool ready;
+	int r;
+
+	if (!bc_ready(((uintptr_t) f - DISKMAP) / BLKSIZE))
+		return false;
+	ready = true;
+	for (i = 0; i < n; i++) {
+		if ((r = file_block_cached(f, filebno + i, &diskbno)) == -E_AGAIN) {
+			// The rest are found once the overflow block is in
+			bc_ready(diskbno);
+			return false;
+		}
+		if (r == 0 && diskbno && !bc_ready(diskbno))
+			ready = false;
+	}
+	return ready;
+}
+
+// Returns true if request 'req' from 'whom' can be served from the cache
+// without waiting for the disk.  Otherwise starts reading in the blocks
+// it needs and returns false.  Only requests on open files and for
+// blocks are checked; the others may still have to wait for the disk
+// while they are served.
+static bool
+serve_ready(envid_t whom, uint32_t req, union Fsipc *ipc)
+{
+	struct OpenFile *o;
+	struct File *f;
+	uint32_t off, n, i;
+	bool ready;
+
+	switch (req) {
+	case FSREQ_READ:
+	case FSREQ_WRITE:
+	case FSREQ_STAT:
+	case FSREQ_BREQ:
+		// The file id is the first field of each of these
+		if (openfile_lookup(whom, ipc->read.req_fileid, &o) < 0)
+			return true;
+		break;
+	case FSREQ_BLOCKS:
+		off = ipc->blocks.req_blockno;
+		n = ipc->blocks.req_nblocks;
+		if (off == 0 || n > IPC_MAXPAGES || off + n > super->s_nblocks)
+			return true;
+		ready = true;
+		for (i = 0; i < n; i++)
+			if (!bc_ready(off + i))
+				ready = false;
+		return ready;
+	default:
+		return true;
+	}
+
+	f = o->o_file;
+	if (!bc_ready(((uintptr_t) f - DISKMAP) / BLKSIZE))
+		return false;
+	if (req == FSREQ_STAT)
+		return true;
+	if (req == FSREQ_BREQ) {
+		off = ipc->breq.req_offset;
+		n = MIN(MAX(ipc->breq.req_nblocks, 1), IPC_MAXPAGES) * BLKSIZE;
+	} else {
+		off = o->o_fd->fd_offset;
+		n = MIN(ipc->read.req_n, PGSIZE);
+	}
+	if (off >= f->f_size || n == 0)
+		return true;
+	if (req != FSREQ_WRITE)
+		n = MIN(n, f->f_size - off);
+	return file_ready(f, off / BLKSIZE,
+			  ROUNDUP(off + n, BLKSIZE) / BLKSIZE - off / BLKSIZE);
+}
+
+// Find the locks request 'req' from 'whom' with arguments on 'ipc' holds
+// while it is served: in a helper, what it reads, and in the primary,
+// what it changes.  Stores them in locks[] and returns how many.
+#define SERVE_MAXLOCKS	2
+
+static int
+serve_locks(envid_t whom, uint32_t req, union Fsipc *ipc, uint32_t **locks)
+{
+	char path[MAXPATHLEN];
+	struct OpenFile *o;
+	struct File *f;
+	int n;
+
+	n = 0;
+	switch (req) {
+	case FSREQ_OPEN:
+		if (!fs_helper && !(ipc->open.req_omode & (O_CREAT|O_TRUNC)))
+			break;
+		locks[n++] = &fsshared->fs_names;
+		if (fs_helper)
+			break;
+		memmove(path, ipc->open.req_path, MAXPATHLEN);
+		path[MAXPATHLEN-1] = 0;
+		if (file_open(path, &f) == 0)
+			locks[n++] = file_lock(f);
+		break;
+	case FSREQ_REMOVE:
+		locks[n++] = &fsshared->fs_names;
+		memmove(path, ipc->remove.req_path, MAXPATHLEN);
+		path[MAXPATHLEN-1] = 0;
+		if (file_open(path, &f) == 0)
+			locks[n++] = file_lock(f);
+		break;
+	case FSREQ_READ:
+	case FSREQ_STAT:
+	case FSREQ_BREQ:
+		if (!fs_helper)
+			break;
+		/* fall through */
+	case FSREQ_WRITE:
+	case FSREQ_SET_SIZE:
+		// The file id is the first field of each of these
+		if (openfile_lookup(whom, ipc->read.req_fileid, &o) == 0)
+			locks[n++] = file_lock(o->o_file);
+		break;
+	}
+	return n;
+}
+
+// Get ready to serve request 'req' from 'whom' with arguments on 'ipc',
+// taking the 'n' locks in locks[].  A helper does that as soon as it
+// may, and catches up with the primary.  Returns false, holding nothing,
+// if the primary has to wait for the disk or for helpers to let go of a
+// lock first; it is told about both by notification.
+static bool
+serve_start(envid_t whom, uint32_t req, union Fsipc *ipc,
+	    uint32_t **locks, int n)
+{
+	int i;
+
+	if (fs_helper) {
+		for (i = 0; i < n; i++)
+			fslock_read(locks[i]);
+		peer_sync();
+		return true;
+	}
+
+	if (!serve_ready(whom, req, ipc))
+		return false;
+	for (i = 0; i < n; i++)
+		if (!fslock_trywrite(locks[i])) {
+			while (i-- > 0)
+				fslock_write_unlock(locks[i]);
+			return false;
+		}
+	return true;
+}
+
+static void
+serve_finish(uint32_t **locks, int n)
+{
+	while (n-- > 0)
+		if (fs_helper)
+			fslock_read_unlock(locks[n]);
+		else
+			fslock_write_unlock(locks[n]);
+}
+
+// Free the parking slot of env index 'i'.
+static void
+serve_unpark(uint32_t i)
+{
+	uint32_t j;
+
+	if (parked[i].pk_ipc == PARKPG(i))
+		sys_page_unmap(0, PARKPG(i));
+	parked[i].pk_whom = 0;
+	for (j = 0; parkq[j] != i; j++)
+		/* do nothing */;
+	parkq[j] = parkq[--nparked];
+}
+
+// Park request 'req' from 'whom' with arguments on 'ipc'.  Returns false
+// if there is no memory for it.
+static bool
+serve_park(envid_t whom, uint32_t req, union Fsipc *ipc)
+{
+	uint32_t i = ENVX(whom);
+
+	// What is left in the slot is from an env that has gone away
+	if (parked[i].pk_whom)
+		serve_unpark(i);
+
+	// The page at fsreq, fsbuf and the word request buffer are needed
+	// for the next request
+	if (ipc == fsreq) {
+		if (sys_page_map(0, fsreq, 0, PARKPG(i), PTE_P|PTE_U|PTE_W) < 0)
+			return false;
+		sys_page_unmap(0, fsreq);
+		ipc = PARKPG(i);
+	} else if (ipc != CHAN(whom)) {
+		if (sys_page_alloc(0, PARKPG(i), PTE_P|PTE_U|PTE_W) < 0)
+			return false;
+		memmove(PARKPG(i), ipc, sizeof(union Fsipc));
+		ipc = PARKPG(i);
+	}
+	parked[i].pk_whom = whom;
+	parked[i].pk_req = req;
+	parked[i].pk_ipc = ipc;
+	parkq[nparked++] = i;
+	return true;
+}
+
+// Serve the parked requests that can go now.
+static void
+serve_parked(void)
+{
+	uint32_t *locks[SERVE_MAXLOCKS];
+	struct Parked *pk;
+	uint32_t j;
+	void *pg;
+	int n, perm, r;
+
+	// Those still waiting for helpers want their locks again below
+	fslock_unwant_all();
+	for (j = 0; j < nparked; ) {
+		pk = &parked[parkq[j]];
+		n = serve_locks(pk->pk_whom, pk->pk_req, pk->pk_ipc, locks);
+		if (!serve_start(pk->pk_whom, pk->pk_req, pk->pk_ipc, locks, n)) {
+			j++;
+			continue;
+		}
+		perm = 0;
+		r = serve_dispatch(pk->pk_whom, pk->pk_req, pk->pk_ipc, &pg, &perm);
+		serve_finish(locks, n);
+		// The client may have gone away; that is its problem
+		if (r != SERVE_REPLIED)
+			sys_ipc_try_send(pk->pk_whom, r, pg ? pg : (void *) UTOP, perm);
+		// This moves the last slot in the queue to j
+		serve_unpark(parkq[j]);
+	}
+}
+
+// Reply to 'whom' with 'r', 'pg' and 'perm', unless 'whom' is 0, then
+// return the next request, as ipc_recv would.  While requests are parked,
+// notifications are taken as well, blocks that have been read in put in
+// the cache, and the parked requests that can go now served.  Otherwise
+// the reply and the receive are a single system call.
+static uint32_t
+serve_reply_next(envid_t whom, int r, void *pg, int perm,
+		 envid_t *whom_store, int *perm_store)
+{
+	uint32_t req, notify;
+
+	for (;;) {
+		ide_intr();
+		do
+			serve_parked();
+		while (bc_reap() > 0);
+		if (!nparked && !bc_fetching())
+			break;
+		if (whom) {
+			ipc_send(whom, r, pg, perm);
+			whom = 0;
+		}
+		req = ipc_recv_notify((envid_t *) whom_store, fsreq, perm_store,
+				      &notify);
+		if (!notify)
+			return req;
+	}
+
+	if (whom)
+		return ipc_reply_recv(whom, r, pg, perm, whom_store, fsreq,
+				      perm_store);
+	return ipc_recv(whom_store, fsreq, perm_store);
+}
+
 void
 serve(void)
 {
-	uint32_t req, whom;
-	int perm, r;
+	uint32_t req, whom, *locks[SERVE_MAXLOCKS];
+	int n, perm, r;
 	void *pg;
+	union Fsipc *ipc;
+
+	// Requests sent with ipc_call_buf are copied straight into fsbuf
+	if ((r = ipc_set_rcvbuf(&fsbuf, sizeof(fsbuf))) < 0)
+		panic("serve: ipc_set_rcvbuf: %e", r);
 
+	perm = 0;
+	req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 	while (1) {
-		perm = 0;
-		req = ipc_recv((int32_t *) &whom, fsreq, &perm);
 		if (debug)
 			cprintf("fs req %d from %08x [page %08x: %s]\n",
 				req, whom, uvpt[PGNUM(fsreq)], fsreq);
 
-		// All requests must contain an argument page
-		if (!(perm & PTE_P)) {
+		// A request comes on an argument page mapped at fsreq, on
+		// the client's channel page, as bytes the kernel copied into
+		// fsbuf, or, if it is small enough, in the IPC words.
+		if (perm & PTE_P)
+			ipc = fsreq;
+		else if ((req & FSREQ_ONCHAN) && chanenv[ENVX(whom)] == whom) {
+			ipc = CHAN(whom);
+			req &= ~FSREQ_ONCHAN;
+		} else if (thisenv->env_ipc_rcvlen > 0)
+			ipc = &fsbuf;
+		else if (WORDREQ(req))
+			ipc = serve_words(req,
+					  (const uint32_t *) thisenv->env_ipc_words);
+		else if (req & FSREQ_ONCHAN) {
+			// We have no channel for this env (it took the slot
+			// of an earlier one, or we were restarted), so tell
+			// it to set one up again
+			req = serve_reply_next(whom, -E_NOCHAN, NULL, 0,
+					       (int32_t *) &whom, &perm);
+			continue;
+		} else {
 			cprintf("Invalid request from %08x: no argument page\n",
 				whom);
-			continue; // just leave it hanging...
+			// just leave it hanging...
+			req = serve_reply_next(0, 0, NULL, 0,
+					       (int32_t *) &whom, &perm);
+			continue;
 		}
 
+		// A request that would wait for the disk or for a helper
+		// waits on the side, and the reply goes out when it can go
+		n = serve_locks(whom, req, ipc, locks);
 		pg = NULL;
-		if (req == FSREQ_OPEN) {
-			r = serve_open(whom, (struct Fsreq_open*)fsreq, &pg, &perm);
-		} else if (req == FSREQ_BREQ) {
-			r = serve_block_req(whom, (struct Fsreq_breq*)fsreq, &pg, &perm);
-		} else if (req < NHANDLERS && handlers[req]) {
-			r = handlers[req](whom, fsreq);
-		} else {
-			cprintf("Invalid request code %d from %08x\n", req, whom);
-			r = -E_INVAL;
-		}
-		ipc_send(whom, r, pg, perm);
-		sys_page_unmap(0, fsreq);
+		perm = 0;
+		if (serve_start(whom, req, ipc, locks, n)) {
+			r = serve_dispatch(whom, req, ipc, &pg, &perm);
+			serve_finish(locks, n);
+		} else if (serve_park(whom, req, ipc)) {
+			req = serve_reply_next(0, 0, NULL, 0,
+					       (int32_t *) &whom, &perm);
+			continue;
+		} else
+			r = -E_NO_MEM;
+		if (ipc == fsreq)
+			sys_page_unmap(0, fsreq);
+
+		// Reply and wait for the next request, in one system call
+		// if nothing is parked; the kernel then switches straight
+		// back to the client if nobody else is waiting.
+		if (r == SERVE_REPLIED)
+			req = serve_reply_next(0, 0, NULL, 0,
+					       (int32_t *) &whom, &perm);
+		else
+			req = serve_reply_next(whom, r, pg, perm,
+					       (int32_t *) &whom, &perm);
 	}
 }
 
@@ -527,6 +1177,13 @@ umain(int argc, char **argv)
 {
 	static_assert(sizeof(struct File) == 256);
 	binaryname = "fs";
+
+	// The first file server owns the disk; the others help it
+	if (ipc_find_env(ENV_TYPE_FS) != thisenv->env_id) {
+		peer_join();
+		serve_init();
+		serve();
+	}
 	cprintf("FS is running\n");
 
 	// Check that we are able to do I/O
@@ -535,6 +1192,6 @@ umain(int argc, char **argv)
 
 	serve_init();
 	fs_init();
+	peer_init();
 	serve();
 }
-
@@ -32,6 +32,47 @@ typedef int32_t envid_t;
 // PROJECT: Maximum number of unique page fault handlers per environment
 #define MAXHANDLERS		10
 
+// Default scheduler time slice, in LAPIC timer counts.  An environment
+// may ask for a longer or shorter slice with sys_env_set_quantum.
+#define SCHED_QUANTUM		10000000
+
+// Number of inline words an IPC message carries after its value.
+// Small messages can travel in these instead of a page.
+#define IPC_NWORDS		3
+
+// One run of pages sent by sys_ipc_sendv, which maps up to
+// IPC_MAXPAGES pages from up to IPC_MAXSEGS runs into the receiver's
+// window in a single message.
+struct IpcSeg {
+	void *seg_va;			// Page-aligned start in the sender
+	uint32_t seg_npages;		// Number of pages in the run
+	int seg_perm;			// Receiver's permissions for them
+};
+
+#define IPC_MAXSEGS		16
+#define IPC_MAXPAGES		64
+
+// Largest byte buffer the kernel copies from sender to receiver in one
+// message (sys_ipc_send_buf).
+#define IPC_MAXBUF		PGSIZE
+
+// One of the words sys_futex_waitv sleeps on.  A null fw_addr stands for
+// console input instead, and fw_val is ignored.
+struct FutexWaitv {
+	const volatile uint32_t *fw_addr;	// Word to wait on
+	uint32_t fw_val;			// Sleep only while *fw_addr == fw_val
+};
+
+#define FUTEX_MAXWAIT		32
+
+// A futex wait list entry; an env sleeping on several words is on
+// several lists.
+struct FutexWaiter {
+	physaddr_t fw_key;		// Physical address waited on
+	struct Env *fw_env;		// The waiting env
+	struct FutexWaiter *fw_next;	// Next waiter in the same hash bucket
+};
+
 // Values of env_status in struct Env
 enum {
 	ENV_FREE = 0,
@@ -66,6 +107,7 @@ struct Env {
 	unsigned env_status;		// Status of the environment
 	uint32_t env_runs;		// Number of times environment has run
 	int env_cpunum;			// The CPU that the env is running on
+	uint32_t env_quantum;		// Time slice in LAPIC timer counts
 
 	// Address space
 	pde_t *env_pgdir;		// Kernel virtual address of page dir
@@ -83,6 +125,49 @@ struct Env {
 	uint32_t env_ipc_value;		// Data value sent to us
 	envid_t env_ipc_from;		// envid of the sender
 	int env_ipc_perm;		// Perm of page mapping received
+	uint32_t env_ipc_words[IPC_NWORDS]; // Inline words received
+	uint32_t env_ipc_dstnpages;	// Pages in the window at env_ipc_dstva
+	uint32_t env_ipc_npages;	// Pages received into that window
+	void *env_ipc_rcvbuf;		// Registered byte-copy buffer
+	size_t env_ipc_rcvbuflen;	// Its size, 0 if none
+	size_t env_ipc_rcvlen;		// Bytes copied in for this message
+
+	// Blocking IPC send: senders parked on a receiver, oldest first
+	struct Env *env_ipc_sendq;	// Senders blocked sending to us
+	struct Env *env_ipc_sendq_next;	// Next sender in target's queue
+	struct Env *env_ipc_send_target;// Env we are blocked sending to
+	uint32_t env_ipc_send_value;	// Value we are waiting to send
+	uint32_t env_ipc_send_words[IPC_NWORDS]; // Inline words to send
+	const void *env_ipc_send_buf;	// Bytes to copy to the receiver
+	size_t env_ipc_send_buflen;	// How many
+	void *env_ipc_send_srcva;	// Page we are waiting to send
+	int env_ipc_send_perm;		// Perm of that page
+	struct IpcSeg env_ipc_send_segs[IPC_MAXSEGS]; // Runs of pages to send
+	int env_ipc_send_nsegs;		// How many, 0 for a single page
+	bool env_ipc_calling;		// Parked by sys_ipc_call: await reply
+	void *env_ipc_call_dstva;	// Where to map the reply's page
+
+	// Notifications: bits set by other envs without blocking, taken
+	// all at once by sys_ipc_recv_notify
+	uint32_t env_notify_pending;	// Bits set since last taken
+	uint32_t env_notify_taken;	// Bits taken by the last receive
+	bool env_notify_waiting;	// Receive also returns on a notification
+
+	// Futex wait state (see sys_futex_waitv)
+	uint32_t env_futex_nwait;	// Number of words waited on, or 0
+	struct FutexWaiter env_futex[FUTEX_MAXWAIT];
+	uint32_t env_futex_unmaps;	// futex_unmap_gen at last system call
+
+	// Timer for sleeps and timeouts (see kern/timer.c)
+	uint64_t env_timer_deadline;	// TSC time it fires, or 0 if unarmed
+	int32_t env_timer_result;	// Return value of the timed system call
+	int env_timer_cpu;		// CPU whose wheel it is on
+	int env_timer_slot;		// Wheel slot it is in
+	struct Env *env_timer_next;	// Next timer in the same slot
+
+	// Doorbell: a one-bit wakeup that carries no data
+	bool env_doorbell;		// Rung since the last sys_doorbell_wait
+	bool env_doorbell_waiting;	// Blocked in sys_doorbell_wait
 };
 
 #endif // !JOS_INC_ENV_H
@@ -27,6 +27,10 @@ enum {
 	E_NOT_SUPP	= 15,	// Operation not supported
 	E_MODE_ERR	= 16,	// File mode doesn't support this call
 
+	E_AGAIN		= 17,	// Futex value changed; try again
+	E_TIMEOUT	= 18,	// Timed out waiting
+	E_NOCHAN	= 19,	// File server has no request channel for us
+
 	MAXERROR
 };
 
@@ -11,6 +11,7 @@
 struct Fd;
 struct Stat;
 struct Dev;
+struct FutexWaitv;
 
 // Per-device-class file descriptor operations
 struct Dev {
@@ -21,6 +22,22 @@ struct Dev {
 	int (*dev_close)(struct Fd *fd);
 	int (*dev_stat)(struct Fd *fd, struct Stat *stat);
 	int (*dev_trunc)(struct Fd *fd, off_t length);
+	// Return which POLL* events are ready on fd.  If none of 'events'
+	// are, fill in *wait with a word that changes when that may no
+	// longer be so (see sys_futex_waitv).
+	int (*dev_poll)(struct Fd *fd, int events, struct FutexWaitv *wait);
+};
+
+// poll() events
+#define POLLIN		0x001	// Reading won't block
+#define POLLOUT		0x004	// Writing won't block
+#define POLLHUP		0x010	// The other end is gone (output only)
+#define POLLNVAL	0x020	// fd isn't open (output only)
+
+struct pollfd {
+	int fd;
+	short events;
+	short revents;
 };
 
 struct FdFile {
@@ -44,6 +61,11 @@ struct Stat {
 	struct Dev *st_dev;
 };
 
+// Each file descriptor has FDDATASIZE bytes of address space at
+// fd2data(fd) that its device may map pages into.  dup() shares
+// whatever is mapped there.
+#define FDDATASIZE	(32*PGSIZE)
+
 char*	fd2data(struct Fd *fd);
 int	fd2num(struct Fd *fd);
 int	fd_alloc(struct Fd **fd_store);
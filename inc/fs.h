@@ -19,26 +19,42 @@
 // Maximum size of a complete pathname, including null
 #define MAXPATHLEN	1024
 
-// Number of block pointers in a File descriptor
-#define NDIRECT		10
-// Number of direct block pointers in an indirect block
-#define NINDIRECT	(BLKSIZE / 4)
+// A file's blocks are a list of extents, each a run of consecutive disk
+// blocks holding consecutive blocks of the file.  An extent that starts
+// at block 0 is a hole: those file blocks have no disk blocks yet.
+struct Extent {
+	uint32_t e_start;		// first disk block, or 0 for a hole
+	uint32_t e_len;			// number of blocks
+};
+
+// Number of extents in a File descriptor
+#define NINLINE		13
+// Number of extents in an overflow block, which holds the extents that
+// do not fit in the File, after the number of the next overflow block
+#define NOVERFLOW	((BLKSIZE - 8) / sizeof(struct Extent))
+
+struct ExtentBlock {
+	uint32_t eb_next;		// next overflow block, or 0
+	uint32_t eb_pad;
+	struct Extent eb_ext[NOVERFLOW];
+};
 
-#define MAXFILESIZE	((NDIRECT + NINDIRECT) * BLKSIZE)
+#define MAXFILESIZE	(1 << 30)
 
 struct File {
 	char f_name[MAXNAMELEN];	// filename
 	off_t f_size;			// file size in bytes
 	uint32_t f_type;		// file type
 
-	// Block pointers.
-	// A block is allocated iff its value is != 0.
-	uint32_t f_direct[NDIRECT];	// direct blocks
-	uint32_t f_indirect;		// indirect block
+	// Extents, in file order.  The first NINLINE are here, the rest
+	// in a chain of overflow blocks.
+	uint32_t f_nextents;
+	uint32_t f_overflow;		// first overflow block, or 0
+	struct Extent f_extents[NINLINE];
 
 	// Pad out to 256 bytes; must do arithmetic in case we're compiling
 	// fsformat on a 64-bit machine.
-	uint8_t f_pad[256 - MAXNAMELEN - 8 - 4*NDIRECT - 4];
+	uint8_t f_pad[256 - MAXNAMELEN - 16 - 8*NINLINE];
 } __attribute__((packed));	// required only on some 64-bit machines
 
 // An inode block contains exactly BLKFILES 'struct File's
@@ -51,7 +67,7 @@ struct File {
 
 // File system super-block (both in-memory and on-disk)
 
-#define FS_MAGIC	0x4A0530AE	// related vaguely to 'J\0S!'
+#define FS_MAGIC	0x4A0530AF	// related vaguely to 'J\0S!', extent layout
 
 struct Super {
 	uint32_t s_magic;		// Magic number: FS_MAGIC
@@ -72,9 +88,42 @@ enum {
 	FSREQ_REMOVE,
 	FSREQ_SYNC,
 	// Request a block from a file to the request page
-	FSREQ_BREQ
+	FSREQ_BREQ,
+	// Make the request page the client's persistent channel
+	FSREQ_CHANNEL,
+	// Cache returns a Fsret_cache on the request page
+	FSREQ_CACHE,
+	FSREQ_DISKDMA,
+	FSREQ_ALLOCMODE,
+	// Between file servers only (see fs/peer.c): a helper joins the
+	// primary, and asks it for cache blocks
+	FSREQ_JOIN,
+	FSREQ_BLOCKS
 };
 
+// Up to this many file server envs run, one per CPU.  The top bits of
+// a file id say which of them opened the file, in the order they appear
+// in envs[], and all requests on the file go to that one.
+#define FS_NSERVERS	4
+#define FSID_SHIFT	28
+#define FSID_SERVER(fileid)	((uint32_t) (fileid) >> FSID_SHIFT)
+
+// Buffer cache limit and counters, as returned by FSREQ_CACHE
+struct BcStat {
+	uint32_t bs_nblocks;		// blocks in memory
+	uint32_t bs_maxblocks;		// blocks held before evicting
+	uint32_t bs_hits;		// block lookups that found it in memory
+	uint32_t bs_misses;		// block lookups that had to read it
+	uint32_t bs_readahead;		// blocks read before they were needed
+	uint32_t bs_evictions;		// blocks dropped from memory
+	uint32_t bs_writebacks;		// dirty blocks the clock wrote back
+};
+
+// Or'ed into the request type of a request sent without a page: its
+// arguments are on the channel page the client set up with
+// FSREQ_CHANNEL, and the reply data goes back there.
+#define FSREQ_ONCHAN	0x80000000
+
 union Fsipc {
 	struct Fsreq_open {
 		char req_path[MAXPATHLEN];
@@ -117,7 +166,25 @@ union Fsipc {
 		int req_fileid;
 		uint32_t req_offset;
 		int req_perm;
+		uint32_t req_nblocks;	// > 1 asks for a vector reply
 	} breq;
+	struct Fsreq_cache {
+		uint32_t req_maxblocks;	// new cache limit, or 0
+	} cache;
+	struct Fsret_cache {
+		struct BcStat ret_stat;
+	} cacheRet;
+	struct Fsreq_diskdma {
+		bool req_dma;		// DMA rather than PIO transfers
+	} diskdma;
+	struct Fsreq_allocmode {
+		bool req_fast;		// next-fit extent allocator, not first fit
+	} allocmode;
+	struct Fsreq_blocks {
+		uint32_t req_blockno;	// first disk block
+		uint32_t req_nblocks;
+		uint32_t req_cow;	// map them copy-on-write first
+	} blocks;
 
 	// Ensure Fsipc is one page
 	char _pad[PGSIZE];
@@ -51,6 +51,7 @@ void	sys_yield(void);
 static envid_t sys_exofork(void);
 int	sys_env_set_status(envid_t env, int status);
 int	sys_env_set_trapframe(envid_t env, struct Trapframe *tf);
+int	sys_env_set_quantum(envid_t env, uint32_t quantum);
 int	sys_env_set_pgfault_upcall(envid_t env, void *upcall);
 int	sys_env_set_global_pgfault(envid_t env, void *handler);
 int	sys_env_set_region_pgfault(envid_t env, void *func, void *minaddr, void *maxaddr);
@@ -60,7 +61,33 @@ int	sys_page_map(envid_t src_env, void *src_pg,
 int	sys_page_unmap(envid_t env, void *pg);
 int	sys_page_reserve(envid_t envid, void *va, int pgnum, int perm);
 int	sys_ipc_try_send(envid_t to_env, uint32_t value, void *pg, int perm);
+int	sys_ipc_send(envid_t to_env, uint32_t value, void *pg, int perm);
 int	sys_ipc_recv(envid_t from_env, void *rcv_pg);
+int	sys_ipc_recv_timeout(envid_t from_env, void *rcv_pg, uint64_t timeout);
+int	sys_ipc_call(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm, void *rcv_pg);
+int	sys_ipc_send_words(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2);
+int	sys_ipc_call_words(envid_t to_env, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2);
+int	sys_ipc_reply_recv_words(envid_t to_env, uint32_t value, const uint32_t *words, void *rcv_pg);
+int	sys_env_doorbell(envid_t envid);
+int	sys_doorbell_wait(void);
+int	sys_ipc_try_sendv(envid_t to_env, uint32_t value, const struct IpcSeg *segs, int nsegs);
+int	sys_ipc_sendv(envid_t to_env, uint32_t value, const struct IpcSeg *segs, int nsegs);
+int	sys_ipc_recv_window(envid_t from_env, void *rcv_pg, size_t npages);
+int	sys_ipc_send_buf(envid_t to_env, uint32_t value, const void *buf, size_t len);
+int	sys_ipc_call_buf(envid_t to_env, uint32_t value, const void *buf, size_t len, void *rcv_pg);
+int	sys_ipc_set_rcvbuf(void *buf, size_t len);
+int	sys_ipc_recv_notify(envid_t from_env, void *rcv_pg);
+int	sys_notify(envid_t envid, uint32_t bits);
+int	sys_futex_wait(const volatile uint32_t *addr, uint32_t expected,
+		       uint64_t timeout);
+int	sys_futex_wake(const volatile uint32_t *addr, uint32_t n);
+int	sys_futex_waitv(const struct FutexWaitv *v, uint32_t n,
+			uint64_t timeout);
+int	sys_sleep(uint64_t ns);
+unsigned int sys_time_msec(void);
+int	sys_page_phys(void *va);
+int	sys_irq_notify(int irq, uint32_t bits);
 
 // This must be inlined.  Exercise for reader: why?
 static __inline envid_t __attribute__((always_inline))
@@ -82,6 +109,66 @@ envid_t	ipc_find_env(enum EnvType type);
 
 // CHALLENGE: receive message only from the given environment
 int32_t ipc_recv_src(envid_t from_env, envid_t *from_env_store, void *pg, int *perm_store);
+int32_t ipc_recv_timeout(envid_t from_env, envid_t *from_env_store, void *pg,
+			 int *perm_store, uint64_t timeout);
+
+// Remote procedure call: send a request and wait for the reply at once
+int32_t ipc_call(envid_t to_env, uint32_t value, void *pg, int perm,
+		 void *rcv_pg, int *perm_store);
+int32_t ipc_reply_recv(envid_t to_env, uint32_t value, void *pg, int perm,
+		       envid_t *from_env_store, void *rcv_pg, int *perm_store);
+
+// Small messages: a value plus IPC_NWORDS inline words, and no page.
+// The receiver finds the words in thisenv->env_ipc_words.
+void	ipc_send_words(envid_t to_env, uint32_t value, const uint32_t *words);
+int32_t	ipc_call_words(envid_t to_env, uint32_t value, const uint32_t *words);
+int32_t	ipc_reply_recv_words(envid_t to_env, uint32_t value, const uint32_t *words,
+			     envid_t *from_env_store, void *rcv_pg, int *perm_store);
+
+// Scatter/gather: many pages in one message
+int	ipc_sendv(envid_t to_env, uint32_t value, const struct IpcSeg *segs, int nsegs);
+int32_t	ipc_recv_window(envid_t from_env, envid_t *from_env_store, void *pg,
+			size_t npages, size_t *npages_store);
+
+// Byte-copy messages: the kernel copies the sender's bytes into the
+// receiver's registered buffer; the length is in thisenv->env_ipc_rcvlen.
+int	ipc_set_rcvbuf(void *buf, size_t len);
+
+// Notifications: set bits for an env without blocking; receive either
+// a message or all pending bits at once.
+int32_t	ipc_recv_notify(envid_t *from_env_store, void *pg, int *perm_store,
+			uint32_t *notify_store);
+void	ipc_send_buf(envid_t to_env, uint32_t value, const void *buf, size_t len);
+int32_t	ipc_call_buf(envid_t to_env, uint32_t value, const void *buf, size_t len,
+		     void *rcv_pg, int *perm_store);
+
+// Single-producer, single-consumer message ring in a page shared by two
+// environments.  Messages are copied through the page without system
+// calls; the doorbell is rung only when a peer has gone to sleep on an
+// empty (or full) ring.
+#define IPCRING_MSGSIZE		60
+#define IPCRING_NSLOTS		(PGSIZE / 64 - 1)
+
+struct IpcRing {
+	envid_t r_producer;
+	envid_t r_consumer;
+	volatile uint32_t r_head;	// Next slot to read, consumer only
+	volatile uint32_t r_tail;	// Next slot to write, producer only
+	volatile uint32_t r_rsleep;	// Consumer waiting for a message
+	volatile uint32_t r_wsleep;	// Producer waiting for a free slot
+	uint8_t r_pad[64 - 6 * sizeof(uint32_t)];
+	struct {
+		uint32_t m_len;
+		uint8_t m_data[IPCRING_MSGSIZE];
+	} r_slot[IPCRING_NSLOTS];
+};
+
+int	ipcring_connect(struct IpcRing *ring, envid_t consumer);
+int	ipcring_accept(struct IpcRing *ring, envid_t *producer_store);
+int	ipcring_send(struct IpcRing *ring, const void *msg, size_t len);
+int	ipcring_try_send(struct IpcRing *ring, const void *msg, size_t len);
+int	ipcring_recv(struct IpcRing *ring, void *buf);
+int	ipcring_try_recv(struct IpcRing *ring, void *buf);
 
 // fork.c
 envid_t	fork(void);
@@ -98,6 +185,7 @@ ssize_t	readn(int fd, void *buf, size_t nbytes);
 int	dup(int oldfd, int newfd);
 int	fstat(int fd, struct Stat *statbuf);
 int	stat(const char *path, struct Stat *statbuf);
+int	poll(struct pollfd *fds, int nfds, int timeout);
 int	fgetid(int fd);
 
 // file.c
@@ -105,7 +193,14 @@ int	flush(int fileid, size_t len, off_t offset, bool flush);
 int	open(const char *path, int mode);
 int	remove(const char *path);
 int	sync(void);
+int	cachestat(uint32_t maxblocks, struct BcStat *stat);
+int	diskdma(bool dma);
+int	allocmode(bool fast);
+int	fsreadserver(int srv);
 int     request_block(int fileid, off_t offset, void * dstva, uint32_t perm);
+int	request_blocks(int fileid, off_t offset, void *dstva, uint32_t perm,
+		       size_t nblocks);
+ssize_t	sendfile(int outfd, int infd, size_t count);
 
 // mmap.c
 void *	mmap(void *addr, size_t len, int prot, int flags, int fd_num, off_t off);
@@ -130,11 +225,21 @@ int	opencons(void);
 
 // pipe.c
 int	pipe(int pipefds[2]);
+int	pipe_sized(int pipefds[2], size_t bufsize);
 int	pipeisclosed(int pipefd);
 
 // wait.c
 void	wait(envid_t env);
 
+// bench.c
+envid_t	bench_fork(void (*fn)(void *), void *arg);
+envid_t	bench_spinner(void);
+uint32_t bench_spins(void);
+void	bench_delay(uint32_t n);
+uint32_t bench_cycles(uint64_t start, uint32_t n);
+uint32_t bench_cache_limit(uint32_t maxblocks);
+size_t	bench_readfile(const char *path);
+
 /* PTE bit definitions */
 #define	PTE_SHARE	0x400
 #define PTE_COW		0x800		/* Copy-on-write page table permissions */
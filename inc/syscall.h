@@ -20,6 +20,30 @@ enum {
 	SYS_yield,
 	SYS_ipc_try_send,
 	SYS_ipc_recv,
+	SYS_env_set_quantum,
+	SYS_ipc_send,
+	SYS_ipc_call,
+	SYS_ipc_reply_recv,
+	SYS_ipc_send_words,
+	SYS_ipc_call_words,
+	SYS_env_doorbell,
+	SYS_doorbell_wait,
+	SYS_ipc_try_sendv,
+	SYS_ipc_recv_window,
+	SYS_ipc_send_buf,
+	SYS_ipc_call_buf,
+	SYS_ipc_set_rcvbuf,
+	SYS_ipc_recv_notify,
+	SYS_notify,
+	SYS_futex_wait,
+	SYS_futex_wake,
+	SYS_futex_waitv,
+	SYS_sleep,
+	SYS_time_msec,
+	SYS_page_phys,
+	SYS_irq_notify,
+	SYS_ipc_reply_recv_words,
+	SYS_ipc_sendv,
 	NSYSCALLS
 };
 
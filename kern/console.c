@@ -8,6 +8,8 @@
 
 #include <kern/console.h>
 #include <kern/picirq.h>
+#include <kern/pmap.h>
+#include <kern/syscall.h>
 
 static void cons_intr(int (*proc)(void));
 static void cons_putc(int c);
@@ -399,6 +401,7 @@ static void
 cons_intr(int (*proc)(void))
 {
 	int c;
+	bool any = 0;
 
 	while ((c = (*proc)()) != -1) {
 		if (c == 0)
@@ -406,7 +409,28 @@ cons_intr(int (*proc)(void))
 		cons.buf[cons.wpos++] = c;
 		if (cons.wpos == CONSBUFSIZE)
 			cons.wpos = 0;
+		any = 1;
 	}
+
+	// wake envs waiting for input (see sys_futex_waitv)
+	if (any)
+		futex_wake_pa(cons_futex_key(), ~0U, false);
+}
+
+// return nonzero if an input character is waiting
+int
+cons_ready(void)
+{
+	serial_intr();
+	kbd_intr();
+	return cons.rpos != cons.wpos;
+}
+
+// the futex key that console input wakes; no user page has it
+physaddr_t
+cons_futex_key(void)
+{
+	return PADDR(&cons);
 }
 
 // return the next input character from the console, or 0 if none waiting
@@ -19,6 +19,8 @@
 
 void cons_init(void);
 int cons_getc(void);
+int cons_ready(void);
+physaddr_t cons_futex_key(void);
 
 void kbd_intr(void); // irq 1
 void serial_intr(void); // irq 4
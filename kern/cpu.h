@@ -23,6 +23,11 @@ struct CpuInfo {
 	volatile unsigned cpu_status;   // The status of the CPU
 	struct Env *cpu_env;            // The currently-running environment.
 	struct Taskstate cpu_ts;        // Used by x86 to find stack for interrupt
+	bool cpu_tickless;              // Timer disarmed; nothing else to run
+	uint32_t cpu_runnable_gen;      // sched_runnable_gen at last timer check
+	bool cpu_wakeup_pending;        // Reschedule IPI sent, not yet taken
+	uint64_t cpu_slice_end;         // TSC time the running env's slice ends
+	uint64_t cpu_timer_armed;       // TSC time the LAPIC timer is set for
 };
 
 // Initialized in mpconfig.c
@@ -30,6 +35,8 @@ extern struct CpuInfo cpus[NCPU];
 extern int ncpu;                    // Total number of CPUs in the system
 extern struct CpuInfo *bootcpu;     // The boot-strap processor (BSP)
 extern physaddr_t lapicaddr;        // Physical MMIO address of the local APIC
+extern uint32_t lapic_per_ms;       // LAPIC timer counts per millisecond
+extern uint64_t tsc_per_ms;         // TSC cycles per millisecond
 
 // Per-CPU kernel stacks
 extern unsigned char percpu_kstacks[NCPU][KSTKSIZE];
@@ -42,5 +49,8 @@ void lapic_init(void);
 void lapic_startap(uint8_t apicid, uint32_t addr);
 void lapic_eoi(void);
 void lapic_ipi(int vector);
+void lapic_ipi_cpu(int apicid, int vector);
+void lapic_timer_oneshot(uint32_t count);
+uint32_t lapic_timer_remaining(void);
 
 #endif
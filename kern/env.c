@@ -14,6 +14,8 @@
 #include <kern/sched.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/syscall.h>
+#include <kern/timer.h>
 
 struct Env *envs = NULL;		// All environments
 static struct Env *env_free_list;	// Free environment list
@@ -236,8 +238,9 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 	// Set the basic status variables.
 	e->env_parent_id = parent_id;
 	e->env_type = ENV_TYPE_USER;
-	e->env_status = ENV_RUNNABLE;
+	env_set_status(e, ENV_RUNNABLE);
 	e->env_runs = 0;
+	e->env_quantum = SCHED_QUANTUM;
 
 	// Clear out all the saved register state,
 	// to prevent the register values
@@ -272,8 +275,20 @@ env_alloc(struct Env **newenv_store, envid_t parent_id)
 		e->env_pgfault_handlers[r].erh_maxaddr = 0;
 	}
 
-	// Also clear the IPC receiving flag.
+	// Also clear the IPC receiving flag and send queues.
 	e->env_ipc_recving = 0;
+	e->env_ipc_sendq = NULL;
+	e->env_ipc_sendq_next = NULL;
+	e->env_ipc_send_target = NULL;
+	e->env_ipc_calling = 0;
+	e->env_notify_pending = 0;
+	e->env_notify_taken = 0;
+	e->env_notify_waiting = 0;
+	e->env_futex_nwait = 0;
+	e->env_futex_unmaps = 0;
+	e->env_timer_deadline = 0;
+	e->env_doorbell = 0;
+	e->env_doorbell_waiting = 0;
 
 	// commit the allocation
 	env_free_list = e->env_link;
@@ -452,6 +467,11 @@ env_free(struct Env *e)
 	// Note the environment's demise.
 	// cprintf("[%08x] free env %08x\n", curenv ? curenv->env_id : 0, e->env_id);
 
+	// Take e off any IPC queue and fail senders waiting on it
+	ipc_env_free(e);
+	futex_env_free(e);
+	timer_cancel(e);
+
 	// Flush all mapped pages in the user portion of the address space
 	static_assert(UTOP % PTSIZE == 0);
 	for (pdeno = 0; pdeno < PDX(UTOP); pdeno++) {
@@ -467,7 +487,7 @@ env_free(struct Env *e)
 		// unmap all PTEs in this page table
 		for (pteno = 0; pteno <= PTX(~0); pteno++) {
 			if (pt[pteno] & PTE_P)
-				page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
+				futex_page_remove(e->env_pgdir, PGADDR(pdeno, pteno, 0));
 		}
 
 		// free the page table itself
@@ -481,9 +501,12 @@ env_free(struct Env *e)
 	page_decref(pa2page(pa));
 
 	// return the environment to the free list
-	e->env_status = ENV_FREE;
+	env_set_status(e, ENV_FREE);
 	e->env_link = env_free_list;
 	env_free_list = e;
+
+	// wake anyone waiting for us to exit (see wait() in lib/wait.c)
+	futex_wake_pa(PADDR(&e->env_status), ~0U, false);
 }
 
 //
@@ -498,7 +521,10 @@ env_destroy(struct Env *e)
 	// ENV_DYING. A zombie environment will be freed the next time
 	// it traps to the kernel.
 	if (e->env_status == ENV_RUNNING && curenv != e) {
-		e->env_status = ENV_DYING;
+		env_set_status(e, ENV_DYING);
+		// Its CPU may be running tickless, so interrupt it to
+		// make sure it traps back into the kernel soon.
+		lapic_ipi_cpu(cpus[e->env_cpunum].cpu_id, IRQ_OFFSET + IRQ_RESCHED);
 		return;
 	}
 
@@ -559,20 +585,25 @@ env_run(struct Env *e)
 	//	and make sure you have set the relevant parts of
 	//	e->env_tf to sensible values.
 
+	bool switched = (curenv != e);
+
 	// If e is different than curenv, switch the current environment.
-	if(curenv != e) {
+	if(switched) {
 		// Mark the old environment as free to run if it was running
 		if(curenv != NULL && curenv->env_status == ENV_RUNNING)
-			curenv->env_status = ENV_RUNNABLE;
+			env_set_status(curenv, ENV_RUNNABLE);
 
 		// Now set up the new environment
 		curenv = e;
-		curenv->env_status = ENV_RUNNING;
+		env_set_status(curenv, ENV_RUNNING);
 		curenv->env_runs++;
 		curenv->env_cpunum = cpunum();
 		lcr3(PADDR(curenv->env_pgdir));
 	}
 
+	// Decide whether this CPU needs a timer tick while e runs
+	sched_arm_timer(e, switched);
+
 	// Finally, release the kernel lock and start running the new
 	//  environment.  Doesn't return.
 	unlock_kernel();
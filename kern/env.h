@@ -9,6 +9,7 @@
 extern struct Env *envs;		// All environments
 #define curenv (thiscpu->cpu_env)		// Current environment
 extern struct Segdesc gdt[];
+extern uint32_t sched_nrunnable;	// Envs that are ENV_RUNNABLE
 
 void	env_init(void);
 void	env_init_percpu(void);
@@ -22,6 +23,18 @@ int	envid2env(envid_t envid, struct Env **env_store, bool checkperm);
 void	env_run(struct Env *e) __attribute__((noreturn));
 void	env_pop_tf(struct Trapframe *tf) __attribute__((noreturn));
 
+// Change e's env_status, keeping count of the runnable environments so
+// the scheduler need not scan envs[] for them.
+static inline void
+env_set_status(struct Env *e, unsigned status)
+{
+	if (e->env_status == ENV_RUNNABLE)
+		sched_nrunnable--;
+	if (status == ENV_RUNNABLE)
+		sched_nrunnable++;
+	e->env_status = status;
+}
+
 // Without this extra macro, we couldn't pass macros like TEST to
 // ENV_CREATE because of the C pre-processor's argument prescan rule.
 #define ENV_PASTE3(x, y, z) x ## y ## z
@@ -3,6 +3,7 @@
 #include <inc/stdio.h>
 #include <inc/string.h>
 #include <inc/assert.h>
+#include <inc/fs.h>
 
 #include <kern/monitor.h>
 #include <kern/console.h>
@@ -22,6 +23,7 @@ void
 i386_init(void)
 {
 	extern char edata[], end[];
+	int i;
 
 	// Before doing anything else, complete the ELF loading process.
 	// Clear the uninitialized global data (BSS) section of our program.
@@ -54,8 +56,10 @@ i386_init(void)
 	// Starting non-boot CPUs
 	boot_aps();
 
-	// Start fs.
-	ENV_CREATE(fs_fs, ENV_TYPE_FS);
+	// Start fs, up to FSSERVERS servers but no more than one per CPU.
+	// The first one created owns the disk.
+	for (i = 0; i < MIN(ncpu, MIN(FSSERVERS, FS_NSERVERS)); i++)
+		ENV_CREATE(fs_fs, ENV_TYPE_FS);
 
 #if defined(TEST)
 	// Don't touch -- used by grading script!
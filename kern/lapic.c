@@ -32,6 +32,7 @@
 #define ICRHI   (0x0310/4)   // Interrupt Command [63:32]
 #define TIMER   (0x0320/4)   // Local Vector Table 0 (TIMER)
 	#define X1         0x0000000B   // divide counts by 1
+	#define ONESHOT    0x00000000   // One-shot
 	#define PERIODIC   0x00020000   // Periodic
 #define PCINT   (0x0340/4)   // Performance Counter LVT
 #define LINT0   (0x0350/4)   // Local Vector Table 1 (LINT0)
@@ -45,6 +46,10 @@
 physaddr_t lapicaddr;        // Initialized in mpconfig.c
 volatile uint32_t *lapic;
 
+// Measured by lapic_calibrate on the boot CPU
+uint32_t lapic_per_ms;
+uint64_t tsc_per_ms;
+
 static void
 lapicw(int index, int value)
 {
@@ -52,6 +57,43 @@ lapicw(int index, int value)
 	lapic[ID];  // wait for write to finish, by reading
 }
 
+// Measure the LAPIC timer and TSC rates against channel 2 of the 8253
+// PIT, whose input clock runs at a known 1193182 Hz.  Assumes the
+// timer divide is already set.
+#define PIT_HZ		1193182
+#define CALIBRATE_MS	10
+
+static void
+lapic_calibrate(void)
+{
+	uint64_t tsc;
+	uint32_t count;
+
+	// Gate channel 2 on with the speaker off, and count down once
+	outb(0x61, (inb(0x61) & ~0x02) | 0x01);
+	outb(0x43, 0xB0);
+	outb(0x42, (PIT_HZ * CALIBRATE_MS / 1000) & 0xFF);
+	outb(0x42, (PIT_HZ * CALIBRATE_MS / 1000) >> 8);
+
+	lapicw(TICR, 0xFFFFFFFF);
+	tsc = read_tsc();
+	while (!(inb(0x61) & 0x20))
+		;
+	tsc = read_tsc() - tsc;
+	count = 0xFFFFFFFF - lapic[TCCR];
+	lapicw(TICR, 0);
+
+	lapic_per_ms = count / CALIBRATE_MS;
+	tsc_per_ms = tsc / CALIBRATE_MS;
+	// Keep going with a guess if the PIT didn't cooperate
+	if (lapic_per_ms == 0 || tsc_per_ms == 0) {
+		lapic_per_ms = 1000000;
+		tsc_per_ms = 1000000;
+	}
+	cprintf("LAPIC timer %u counts/ms, TSC %u cycles/ms\n",
+		lapic_per_ms, (uint32_t) tsc_per_ms);
+}
+
 void
 lapic_init(void)
 {
@@ -65,13 +107,18 @@ lapic_init(void)
 	// Enable local APIC; set spurious interrupt vector.
 	lapicw(SVR, ENABLE | (IRQ_OFFSET + IRQ_SPURIOUS));
 
-	// The timer repeatedly counts down at bus frequency
-	// from lapic[TICR] and then issues an interrupt.  
-	// If we cared more about precise timekeeping,
-	// TICR would be calibrated using an external time source.
+	// The timer counts down once at bus frequency from lapic[TICR]
+	// and then issues an interrupt.  It is left stopped here; the
+	// scheduler re-arms it with lapic_timer_oneshot() each time it
+	// hands the CPU to an environment, and only when some other
+	// environment is waiting to run (see sched_arm_timer).
+	// The boot CPU calibrates the timer against the PIT, so that
+	// timers can be set in real time (see kern/timer.c).
 	lapicw(TDCR, X1);
-	lapicw(TIMER, PERIODIC | (IRQ_OFFSET + IRQ_TIMER));
-	lapicw(TICR, 10000000); 
+	lapicw(TIMER, ONESHOT | (IRQ_OFFSET + IRQ_TIMER));
+	lapicw(TICR, 0);
+	if (!lapic_per_ms)
+		lapic_calibrate();
 
 	// Leave LINT0 of the BSP enabled so that it can get
 	// interrupts from the 8259A chip.
@@ -180,3 +227,34 @@ lapic_ipi(int vector)
 	while (lapic[ICRLO] & DELIVS)
 		;
 }
+
+// Send an interrupt with the given vector to a single CPU.
+void
+lapic_ipi_cpu(int apicid, int vector)
+{
+	if (!lapic)
+		return;
+	lapicw(ICRHI, apicid << 24);
+	lapicw(ICRLO, FIXED | vector);
+	while (lapic[ICRLO] & DELIVS)
+		;
+}
+
+// Arm this CPU's timer to fire once after 'count' bus cycles.
+// A count of 0 stops the timer.
+void
+lapic_timer_oneshot(uint32_t count)
+{
+	if (lapic)
+		lapicw(TICR, count);
+}
+
+// Returns the number of bus cycles left before the timer fires,
+// or 0 if the timer is stopped.
+uint32_t
+lapic_timer_remaining(void)
+{
+	if (!lapic)
+		return 0;
+	return lapic[TCCR];
+}
@@ -4,9 +4,82 @@
 #include <kern/env.h>
 #include <kern/pmap.h>
 #include <kern/monitor.h>
+#include <kern/timer.h>
+#include <kern/syscall.h>
 
 void sched_halt(void);
 
+// Bumped every time an environment becomes runnable, so that a CPU
+// running tickless can tell whether it needs to look for new work.
+uint32_t sched_runnable_gen;
+
+// Number of ENV_RUNNABLE environments; see env_set_status.
+uint32_t sched_nrunnable;
+
+// Mark 'e' runnable so that the scheduler will pick it up.
+//
+// Halted CPUs otherwise sit in sched_halt until something interrupts
+// them, so kick one with a reschedule IPI.  A halted CPU that already
+// has a kick on the way is spoken for by some earlier wakeup, so each
+// newly runnable environment wakes at most one additional CPU.
+void
+sched_wakeup(struct Env *e)
+{
+	struct CpuInfo *c;
+
+	env_set_status(e, ENV_RUNNABLE);
+	sched_runnable_gen++;
+
+	for (c = cpus; c < cpus + ncpu; c++) {
+		if (c == thiscpu || c->cpu_status != CPU_HALTED ||
+		    c->cpu_wakeup_pending)
+			continue;
+		c->cpu_wakeup_pending = true;
+		lapic_ipi_cpu(c->cpu_id, IRQ_OFFSET + IRQ_RESCHED);
+		return;
+	}
+}
+
+// Returns true if some environment other than 'e' is waiting for a CPU.
+static bool
+sched_other_runnable(struct Env *e)
+{
+	return sched_nrunnable > (e->env_status == ENV_RUNNABLE);
+}
+
+// Program this CPU's timer before returning to user environment 'e'.
+// 'switched' is true if 'e' was not the environment last running here.
+//
+// The time slice only needs to end when another environment is waiting
+// to run; a CPU running the only runnable environment runs tickless,
+// and its timer only fires for sleeps and timeouts armed on it (see
+// kern/timer.c).  The quantum otherwise comes from e->env_quantum, so
+// each environment gets its own time slice.  Re-entering the same
+// environment after a system call leaves the slice alone, so that
+// frequent system calls don't restart it.
+void
+sched_arm_timer(struct Env *e, bool switched)
+{
+	uint64_t now = read_tsc();
+
+	if (switched ||
+	    // Slice used up
+	    (!thiscpu->cpu_tickless && now >= thiscpu->cpu_slice_end) ||
+	    // Tickless, and something new has become runnable since
+	    (thiscpu->cpu_tickless &&
+	     thiscpu->cpu_runnable_gen != sched_runnable_gen)) {
+		thiscpu->cpu_runnable_gen = sched_runnable_gen;
+		if (sched_other_runnable(e)) {
+			thiscpu->cpu_tickless = false;
+			thiscpu->cpu_slice_end = now + timer_lapic2tsc(e->env_quantum);
+		} else {
+			thiscpu->cpu_tickless = true;
+			thiscpu->cpu_slice_end = 0;
+		}
+	}
+	timer_program(thiscpu->cpu_slice_end);
+}
+
 // Choose a user environment to run and run it.
 void
 sched_yield(void)
@@ -58,12 +131,15 @@ sched_halt(void)
 	int i;
 
 	// For debugging and testing purposes, if there are no runnable
-	// environments in the system, then drop into the kernel monitor.
+	// environments in the system, and none that a timer or a device
+	// interrupt will wake, then drop into the kernel monitor.
 	for (i = 0; i < NENV; i++) {
 		if ((envs[i].env_status == ENV_RUNNABLE ||
 		     envs[i].env_status == ENV_RUNNING ||
 		     envs[i].env_status == ENV_DYING))
 			break;
+		if (envs[i].env_timer_deadline || env_waits_for_device(&envs[i]))
+			break;
 	}
 	if (i == NENV) {
 		cprintf("No runnable environments in the system!\n");
@@ -75,6 +151,12 @@ sched_halt(void)
 	curenv = NULL;
 	lcr3(PADDR(kern_pgdir));
 
+	// An idle CPU has nothing to preempt, so only wake up for timers
+	// armed here
+	thiscpu->cpu_tickless = true;
+	thiscpu->cpu_slice_end = 0;
+	timer_program(0);
+
 	// Mark that this CPU is in the HALT state, so that when
 	// timer interupts come in, we know we should re-acquire the
 	// big kernel lock
@@ -6,7 +6,14 @@
 # error "This is a JOS kernel header; user programs should not #include it"
 #endif
 
+#include <inc/types.h>
+
+struct Env;
+
 // This function does not return.
 void sched_yield(void) __attribute__((noreturn));
 
+void sched_wakeup(struct Env *e);
+void sched_arm_timer(struct Env *e, bool switched);
+
 #endif	// !JOS_KERN_SCHED_H
@@ -11,6 +11,8 @@
 #include <kern/syscall.h>
 #include <kern/console.h>
 #include <kern/sched.h>
+#include <kern/timer.h>
+#include <kern/picirq.h>
 
 // Print a string to the system console.
 // The string is exactly 'len' characters long.
@@ -84,7 +86,8 @@ sys_exofork(void)
 	// Set the new environment to be not runnable, and to return 0 if
 	//  the environment allocation was successful.
 	if(retval == 0) {
-		e->env_status = ENV_NOT_RUNNABLE;
+		env_set_status(e, ENV_NOT_RUNNABLE);
+		e->env_quantum = curenv->env_quantum;
 		e->env_tf = curenv->env_tf;
 		e->env_tf.tf_regs.reg_eax = 0;
 		retval = e->env_id;
@@ -118,7 +121,10 @@ sys_env_set_status(envid_t envid, int status)
 	if(!(status == ENV_RUNNABLE || status == ENV_NOT_RUNNABLE)) return -E_INVAL;
 
 	// Finally, make the change
-	e->env_status = status;
+	if(status == ENV_RUNNABLE)
+		sched_wakeup(e);
+	else
+		env_set_status(e, status);
 	return 0;
 }
 
@@ -162,6 +168,25 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	return 0;
 }
 
+// Set the scheduler time slice of 'envid' to 'quantum' LAPIC timer
+//  counts.  Throughput-oriented environments can ask for long slices,
+//  while interactive ones keep the short default.  A quantum of 0
+//  restores the default, SCHED_QUANTUM.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist,
+//		or the caller doesn't have permission to change envid.
+static int
+sys_env_set_quantum(envid_t envid, uint32_t quantum)
+{
+	struct Env *e;
+
+	if(envid2env(envid, &e, 1) != 0) return -E_BAD_ENV;
+
+	e->env_quantum = quantum ? quantum : SCHED_QUANTUM;
+	return 0;
+}
+
 // Set the page fault upcall for the given environment.  This upcall is run in user
 //  mode, and passed a handler function as an argument.  The idea is to allow this
 //  function to return directly to the faulting instruction as opposed to returning
@@ -445,7 +470,7 @@ sys_page_unmap(envid_t envid, void *va)
 	if(envid2env(envid, &e, 1) != 0) return -E_BAD_ENV;
 
 	// Now remove the page
-	page_remove(e->env_pgdir, va);
+	futex_page_remove(e->env_pgdir, va);
 	return 0;
 }
 
@@ -526,6 +551,307 @@ sys_page_reserve(envid_t envid, void *va, int pgnum, int perm)
 	return (int)retva; // need casting when used
 }
 
+// Copy 'len' bytes from 'srcva' in src's address space to 'dstva' in
+// dst's.  The copy goes through the kernel's mapping of physical memory
+// a page-sized piece at a time, so it works no matter whose page
+// directory is loaded.  Both ranges must already have been checked
+// with user_mem_check.
+static void
+ipc_copy(struct Env *dst, void *dstva, struct Env *src, const void *srcva, size_t len)
+{
+	struct PageInfo *spi, *dpi;
+	size_t n;
+
+	while(len > 0) {
+		n = MIN(len, PGSIZE - PGOFF(srcva));
+		n = MIN(n, PGSIZE - PGOFF(dstva));
+		spi = page_lookup(src->env_pgdir, (void *) srcva, NULL);
+		dpi = page_lookup(dst->env_pgdir, dstva, NULL);
+		memmove(page2kva(dpi) + PGOFF(dstva),
+			page2kva(spi) + PGOFF(srcva), n);
+		srcva += n;
+		dstva += n;
+		len -= n;
+	}
+}
+
+// Deliver 'value' (and the page at 'srcva' in src's address space, if
+// any) to 'dst', which must be waiting in sys_ipc_recv.  This is the
+// common tail of every send path.  dst's ipc fields are updated as
+// described for sys_ipc_try_send below, but its env_status is left
+// alone; the caller decides who runs next.
+//
+// 'words', if not NULL, holds IPC_NWORDS inline words (zeroes are
+// delivered otherwise).  'buflen' bytes at 'buf' in src's address space
+// are copied into the buffer dst registered with sys_ipc_set_rcvbuf.
+//
+// Returns 0 on success, < 0 on error.  The errors are those listed for
+// srcva and perm in sys_ipc_try_send, plus:
+//	-E_INVAL if buflen is larger than dst's registered buffer.
+//	-E_FAULT if either buffer is not (or no longer) mapped with the
+//		right permissions.
+static int
+ipc_transfer(struct Env *src, struct Env *dst, uint32_t value,
+	     const uint32_t *words, const void *buf, size_t buflen,
+	     void *srcva, unsigned perm)
+{
+	struct PageInfo *pi;
+	pte_t *pte;
+	int retval;
+
+	// Check the byte buffers before anything is handed over
+	if(buflen > 0) {
+		if(buflen > dst->env_ipc_rcvbuflen) return -E_INVAL;
+		if(user_mem_check(src, buf, buflen, PTE_U) != 0 ||
+		   user_mem_check(dst, dst->env_ipc_rcvbuf, buflen, PTE_U|PTE_W) != 0)
+			return -E_FAULT;
+	}
+
+	// If the target is recieving environment wants a page and we're
+	//  sending one, try to send the page.
+	if((int)dst->env_ipc_dstva < UTOP && (int)srcva < UTOP) {
+		// Sanity check the src address and permissions
+		if((unsigned int)srcva%PGSIZE != 0) return -E_INVAL;
+
+		// Grab the permissions of the source page
+		if((pi = page_lookup(src->env_pgdir, srcva, &pte)) == NULL)
+			return -E_INVAL;
+
+		// Check that we aren't mapping a read-only page
+		//  to be writable
+		if((perm&PTE_W) && ((*pte)&PTE_W) == 0) return -E_INVAL;
+
+		// Finally, attempt to install the new mapping to the target
+		//  environment.
+		if((retval = page_insert(dst->env_pgdir, pi, dst->env_ipc_dstva, perm)) != 0)
+			return retval;
+
+		// Success! Signal that a page was transferred
+		dst->env_ipc_perm = perm;
+		dst->env_ipc_npages = 1;
+	}
+
+	// From here on, we can't fail, so set all the receiving data
+	if(buflen > 0)
+		ipc_copy(dst, dst->env_ipc_rcvbuf, src, buf, buflen);
+	dst->env_ipc_rcvlen = buflen;
+	dst->env_ipc_value = value;
+	if(words)
+		memmove(dst->env_ipc_words, words, sizeof(dst->env_ipc_words));
+	else
+		memset(dst->env_ipc_words, 0, sizeof(dst->env_ipc_words));
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_recving = 0;
+	return 0;
+}
+
+// Deliver 'value' and the 'nsegs' runs of pages described by 'segv'
+// (already copied into the kernel) from 'src' to 'dst', which must be
+// waiting in sys_ipc_recv or sys_ipc_recv_window.  The pages are mapped
+// one after another into dst's window starting at env_ipc_dstva, each
+// run with its own permissions.  env_ipc_npages tells dst how many pages
+// arrived and env_ipc_perm holds the first run's permissions.  As with
+// ipc_transfer, dst's env_status is left alone.
+//
+// The transfer is all or nothing: every page is checked and every page
+// table dst needs is allocated before any mapping is made.  If dst isn't
+// asking for pages, only the value is delivered.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_send, plus:
+//	-E_INVAL if the runs hold more pages than fit in dst's window.
+static int
+ipc_transferv(struct Env *src, struct Env *dst, uint32_t value,
+	      const struct IpcSeg *segv, int nsegs)
+{
+	struct PageInfo *pis[IPC_MAXPAGES];
+	int perms[IPC_MAXPAGES];
+	pte_t *pte;
+	void *va;
+	int i;
+	uint32_t j, n;
+
+	// Look up and check every page before touching the target
+	n = 0;
+	if((unsigned int)dst->env_ipc_dstva < UTOP)
+		for(i = 0; i < nsegs; i++) {
+			if((unsigned int)segv[i].seg_va%PGSIZE != 0 ||
+			   segv[i].seg_npages > IPC_MAXPAGES - n ||
+			   (segv[i].seg_perm&PTE_U) == 0 ||
+			   (segv[i].seg_perm&~PTE_SYSCALL) != 0)
+				return -E_INVAL;
+			for(j = 0; j < segv[i].seg_npages; j++, n++) {
+				va = segv[i].seg_va + j*PGSIZE;
+				if((unsigned int)va >= UTOP ||
+				   (pis[n] = page_lookup(src->env_pgdir, va, &pte)) == NULL)
+					return -E_INVAL;
+				if((segv[i].seg_perm&PTE_W) && ((*pte)&PTE_W) == 0)
+					return -E_INVAL;
+				perms[n] = segv[i].seg_perm;
+			}
+		}
+	if(n > dst->env_ipc_dstnpages) return -E_INVAL;
+
+	// Allocate the target's page tables up front so that the
+	//  insertions below cannot fail halfway.
+	for(j = 0; j < n; j++)
+		if(pgdir_walk(dst->env_pgdir, dst->env_ipc_dstva + j*PGSIZE, 1) == NULL)
+			return -E_NO_MEM;
+	for(j = 0; j < n; j++)
+		if(page_insert(dst->env_pgdir, pis[j],
+			       dst->env_ipc_dstva + j*PGSIZE, perms[j]) != 0)
+			panic("ipc_transferv: page_insert failed");
+
+	dst->env_ipc_value = value;
+	memset(dst->env_ipc_words, 0, sizeof(dst->env_ipc_words));
+	dst->env_ipc_perm = n ? perms[0] : 0;
+	dst->env_ipc_npages = n;
+	dst->env_ipc_rcvlen = 0;
+	dst->env_ipc_from = src->env_id;
+	dst->env_ipc_recving = 0;
+	return 0;
+}
+
+// Copy the 'nsegs' IpcSeg entries at 'segs' in curenv's address space
+// into 'segv'.  Returns 0, or -E_INVAL if nsegs is 0 or more than
+// IPC_MAXSEGS, or -E_FAULT if 'segs' is not readable.
+static int
+ipc_copy_segs(struct IpcSeg *segv, const struct IpcSeg *segs, int nsegs)
+{
+	if(nsegs <= 0 || nsegs > IPC_MAXSEGS) return -E_INVAL;
+	if(user_mem_check(curenv, segs, nsegs * sizeof(segs[0]), PTE_U) != 0)
+		return -E_FAULT;
+	memmove(segv, segs, nsegs * sizeof(segs[0]));
+	return 0;
+}
+
+// Returns true if 'dst' is blocked in sys_ipc_recv and willing to hear
+// from 'src'.
+static bool
+ipc_accepts(struct Env *dst, struct Env *src)
+{
+	return dst->env_ipc_recving &&
+		(dst->env_ipc_from == 0 || dst->env_ipc_from == src->env_id);
+}
+
+// Remove 'e' from the send queue of the environment it is blocked
+// sending to, if any.
+static void
+ipc_sendq_remove(struct Env *e)
+{
+	struct Env **pp;
+
+	if (e->env_ipc_send_target == NULL)
+		return;
+	for (pp = &e->env_ipc_send_target->env_ipc_sendq; *pp; pp = &(*pp)->env_ipc_sendq_next)
+		if (*pp == e) {
+			*pp = e->env_ipc_sendq_next;
+			break;
+		}
+	e->env_ipc_sendq_next = NULL;
+	e->env_ipc_send_target = NULL;
+}
+
+// Finish a parked sender's sys_ipc_send with return value 'r' and let
+// it run again.
+static void
+ipc_sender_done(struct Env *e, int r)
+{
+	e->env_tf.tf_regs.reg_eax = r;
+	sched_wakeup(e);
+}
+
+// Called when 'e' is freed: take it off any send queue it is parked on,
+// and fail with -E_BAD_ENV every sender parked on it and every receiver
+// waiting for a message from it only (such as a client in sys_ipc_call
+// waiting for its reply).
+void
+ipc_env_free(struct Env *e)
+{
+	struct Env *s;
+	int i;
+
+	ipc_sendq_remove(e);
+	while ((s = e->env_ipc_sendq) != NULL) {
+		e->env_ipc_sendq = s->env_ipc_sendq_next;
+		s->env_ipc_sendq_next = NULL;
+		s->env_ipc_send_target = NULL;
+		s->env_ipc_calling = 0;
+		ipc_sender_done(s, -E_BAD_ENV);
+	}
+
+	for (i = 0; i < NENV; i++) {
+		s = &envs[i];
+		if (s != e && s->env_status == ENV_NOT_RUNNABLE &&
+		    s->env_ipc_recving && s->env_ipc_from == e->env_id) {
+			s->env_ipc_recving = 0;
+			ipc_sender_done(s, -E_BAD_ENV);
+		}
+	}
+}
+
+// Put 'e' in the receiving state: willing to take a message from
+// 'source' (0 for anyone), mapping any page sent at 'dstva'.
+static void
+ipc_recv_state(struct Env *e, envid_t source, void *dstva)
+{
+	e->env_ipc_recving = true;
+	e->env_ipc_dstva = dstva;
+	e->env_ipc_value = 0;
+	e->env_ipc_from = source;
+	e->env_ipc_perm = 0;
+	e->env_ipc_dstnpages = 1;
+	e->env_ipc_npages = 0;
+	e->env_ipc_rcvlen = 0;
+	e->env_notify_waiting = 0;
+}
+
+// Set curenv up to receive from 'source' into the 'npages' page window
+// at 'dstva', and take the oldest parked sender we are willing to hear
+// from, if any.  A sender
+// whose page can no longer be transferred gets the error and we move on
+// to the next one.  A sender parked by sys_ipc_call is not woken; it
+// goes straight to waiting for our reply.
+//
+// Returns 1 if a message was taken, 0 if curenv has to block.
+static int
+ipc_recv_prepare(envid_t source, void *dstva, uint32_t npages)
+{
+	struct Env *env, **pp;
+	int r;
+
+	ipc_recv_state(curenv, source, dstva);
+	curenv->env_ipc_dstnpages = npages;
+
+	for(pp = &curenv->env_ipc_sendq; (env = *pp) != NULL; ) {
+		if(!ipc_accepts(curenv, env)) {
+			pp = &env->env_ipc_sendq_next;
+			continue;
+		}
+		*pp = env->env_ipc_sendq_next;
+		env->env_ipc_sendq_next = NULL;
+		env->env_ipc_send_target = NULL;
+
+		if(env->env_ipc_send_nsegs > 0)
+			r = ipc_transferv(env, curenv, env->env_ipc_send_value,
+					  env->env_ipc_send_segs,
+					  env->env_ipc_send_nsegs);
+		else
+			r = ipc_transfer(env, curenv, env->env_ipc_send_value,
+					 env->env_ipc_send_words,
+					 env->env_ipc_send_buf, env->env_ipc_send_buflen,
+					 env->env_ipc_send_srcva, env->env_ipc_send_perm);
+		if(r == 0 && env->env_ipc_calling)
+			ipc_recv_state(env, curenv->env_id, env->env_ipc_call_dstva);
+		else
+			ipc_sender_done(env, r);
+		env->env_ipc_calling = 0;
+		if(r == 0)
+			return 1;
+	}
+	return 0;
+}
+
 // Try to send 'value' to the target env 'envid'.
 // If srcva < UTOP, then also send page currently mapped at 'srcva',
 // so that receiver gets a duplicate mapping of the same page.
@@ -573,53 +899,239 @@ static int
 sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 {
 	struct Env *target;
-	struct PageInfo *pi;
-	pte_t *pte;
 	int retval = 0;
 
 	// Grab the target environment without checking permissions
 	if((retval = envid2env(envid, &target, 0)) != 0) return retval;
 
-	// Ensure that the target is recieving ipc messages
-	if(!target->env_ipc_recving) return -E_IPC_NOT_RECV;
+	// Ensure that the target is recieving ipc messages, and wants
+	//  to hear a message from us
+	if(!ipc_accepts(target, curenv)) return -E_IPC_NOT_RECV;
 
-	// Ensure that the target wants to hear a message from us
-	if(target->env_ipc_from != 0 && target->env_ipc_from != curenv->env_id)
-		return -E_IPC_NOT_RECV;
+	// Hand over the value and page
+	if((retval = ipc_transfer(curenv, target, value, NULL, NULL, 0, srcva, perm)) != 0)
+		return retval;
 
-	// If the target is recieving environment wants a page and we're
-	//  sending one, try to send the page.
-	if((int)target->env_ipc_dstva < UTOP && (int)srcva < UTOP) {
-		// Sanity check the src address and permissions
-		if((unsigned int)srcva%PGSIZE != 0) return -E_INVAL;
+	// Set the target to be runnable again, then return
+	sched_wakeup(target);
+	return 0;
+}
 
-		// Grab the permissions of the source page
-		if((pi = page_lookup(curenv->env_pgdir, srcva, &pte)) == NULL)
-			return -E_INVAL;
+// Send 'value' together with several runs of pages to 'envid' in one
+// message, which the target must be waiting for in sys_ipc_recv or
+// sys_ipc_recv_window.  'segs' points to 'nsegs' IpcSeg entries in the
+// caller's address space; see ipc_transferv for how they are mapped.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// ipc_transferv, plus:
+//	-E_INVAL if nsegs is 0 or more than IPC_MAXSEGS.
+//	-E_FAULT if 'segs' is not readable.
+static int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs, int nsegs)
+{
+	struct IpcSeg segv[IPC_MAXSEGS];
+	struct Env *target;
+	int retval;
 
-		// Check that we aren't mapping a read-only page
-		//  to be writable
-		if((perm&PTE_W) && ((*pte)&PTE_W) == 0) return -E_INVAL;
+	if((retval = envid2env(envid, &target, 0)) != 0) return retval;
+	if((retval = ipc_copy_segs(segv, segs, nsegs)) != 0) return retval;
 
-		// Finally, attempt to install the new mapping to the target
-		//  environment.
-		if((retval = page_insert(target->env_pgdir, pi, target->env_ipc_dstva, perm)) != 0)
+	if(!ipc_accepts(target, curenv)) return -E_IPC_NOT_RECV;
+
+	if((retval = ipc_transferv(curenv, target, value, segv, nsegs)) != 0)
+		return retval;
+	sched_wakeup(target);
+	return 0;
+}
+
+// Park curenv at the tail of 'target's send queue with the message
+// 'value', 'words' (NULL for none), the bytes at 'buf' and the page at
+// 'srcva'.
+static void
+ipc_park(struct Env *target, uint32_t value, const uint32_t *words,
+	 const void *buf, size_t buflen, void *srcva, unsigned perm)
+{
+	struct Env **pp;
+
+	curenv->env_ipc_send_target = target;
+	curenv->env_ipc_send_value = value;
+	if(words)
+		memmove(curenv->env_ipc_send_words, words,
+			sizeof(curenv->env_ipc_send_words));
+	else
+		memset(curenv->env_ipc_send_words, 0,
+		       sizeof(curenv->env_ipc_send_words));
+	curenv->env_ipc_send_buf = buf;
+	curenv->env_ipc_send_buflen = buflen;
+	curenv->env_ipc_send_srcva = srcva;
+	curenv->env_ipc_send_perm = perm;
+	curenv->env_ipc_send_nsegs = 0;
+	curenv->env_ipc_sendq_next = NULL;
+	for(pp = &target->env_ipc_sendq; *pp; pp = &(*pp)->env_ipc_sendq_next)
+		;
+	*pp = curenv;
+}
+
+// Send 'value' (and the page at 'srcva', as in sys_ipc_try_send) to
+// 'envid', blocking until the target receives it.
+//
+// If the target is already waiting in sys_ipc_recv for us, the message
+// is delivered at once.  Otherwise the caller is parked at the tail of
+// the target's send queue and marked not runnable.  The next
+// sys_ipc_recv by the target takes the oldest matching sender off the
+// queue, transfers its message and wakes it, so blocked senders are
+// served in FIFO order and never spin.
+//
+// This function only returns on immediate delivery or error; a parked
+// sender returns from the system call once its message is delivered.
+// Returns 0 on success, < 0 on error.  Errors are as for
+// sys_ipc_try_send, except that -E_IPC_NOT_RECV is never returned, and:
+//	-E_INVAL if envid is the current environment.
+//	-E_BAD_ENV if the target exits while we are parked on it.
+//
+// 'words' and 'buf' are as for ipc_transfer.
+static int
+sys_ipc_send_msg(envid_t envid, uint32_t value, const uint32_t *words,
+		 const void *buf, size_t buflen, void *srcva, unsigned perm)
+{
+	struct Env *target;
+	int retval;
+
+	// Grab the target environment without checking permissions
+	if((retval = envid2env(envid, &target, 0)) != 0) return retval;
+
+	// Sending to ourselves would never complete
+	if(target == curenv) return -E_INVAL;
+
+	// Catch a bad page address now rather than at delivery time
+	if((unsigned int)srcva < UTOP && (unsigned int)srcva%PGSIZE != 0)
+		return -E_INVAL;
+
+	// Fast path: the target is already waiting for us
+	if(ipc_accepts(target, curenv)) {
+		if((retval = ipc_transfer(curenv, target, value, words, buf, buflen, srcva, perm)) != 0)
 			return retval;
+		sched_wakeup(target);
+		return 0;
+	}
 
-		// Success! Signal that a page was transferred
-		target->env_ipc_perm = perm;
+	// Otherwise park at the tail of the target's send queue
+	ipc_park(target, value, words, buf, buflen, srcva, perm);
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
+
+	// Technically this is never run
+	return 0;
+}
+
+static int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
+{
+	return sys_ipc_send_msg(envid, value, NULL, NULL, 0, srcva, perm);
+}
+
+// Send 'value' and the IPC_NWORDS inline words 'w0', 'w1' and 'w2' to
+// 'envid' without a page, blocking as sys_ipc_send does.  Small
+// messages sent this way cost no page mapping at either end.
+static int
+sys_ipc_send_words(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+	uint32_t words[IPC_NWORDS] = { w0, w1, w2 };
+
+	return sys_ipc_send_msg(envid, value, words, NULL, 0, (void *) UTOP, 0);
+}
+
+// Send 'value' and a copy of the 'len' bytes at 'buf' to 'envid',
+// blocking as sys_ipc_send does.  The kernel copies the bytes straight
+// into the buffer the receiver registered with sys_ipc_set_rcvbuf, and
+// reports the length in env_ipc_rcvlen; no page table changes at all.
+// This suits payloads too big for the inline words but much smaller
+// than a page.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_send, plus:
+//	-E_INVAL if len is larger than IPC_MAXBUF or than the receiver's
+//		buffer.
+//	-E_FAULT if buf is not readable, or the receiver's buffer is not
+//		writable.
+static int
+sys_ipc_send_buf(envid_t envid, uint32_t value, const void *buf, size_t len)
+{
+	if(len > IPC_MAXBUF) return -E_INVAL;
+	if(user_mem_check(curenv, buf, len, PTE_U) != 0) return -E_FAULT;
+
+	return sys_ipc_send_msg(envid, value, NULL, buf, len, (void *) UTOP, 0);
+}
+
+// Send 'value' and the runs of pages described by 'segs' to 'envid', as
+// sys_ipc_try_sendv does, but block until the target receives them.
+// Like sys_ipc_send, a sender that finds the target busy is parked on its
+// send queue with a copy of 'segs' and never spins; the pages are looked
+// up when the target takes the message, so they must stay mapped until
+// then.
+//
+// Returns 0 on success, < 0 on error.  Errors are those of
+// sys_ipc_try_sendv, except that -E_IPC_NOT_RECV is never returned, and:
+//	-E_INVAL if envid is the current environment.
+//	-E_BAD_ENV if the target exits while we are parked on it.
+static int
+sys_ipc_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs, int nsegs)
+{
+	struct IpcSeg segv[IPC_MAXSEGS];
+	struct Env *target;
+	int retval;
+
+	if((retval = envid2env(envid, &target, 0)) != 0) return retval;
+	if(target == curenv) return -E_INVAL;
+	if((retval = ipc_copy_segs(segv, segs, nsegs)) != 0) return retval;
+
+	// Fast path: the target is already waiting for us
+	if(ipc_accepts(target, curenv)) {
+		if((retval = ipc_transferv(curenv, target, value, segv, nsegs)) != 0)
+			return retval;
+		sched_wakeup(target);
+		return 0;
 	}
 
-	// From here on, we can't fail, so set all the receiving data
-	target->env_ipc_value = value;
-	target->env_ipc_from = curenv->env_id;
-	target->env_ipc_recving = 0;
+	// Otherwise park with the runs, as sys_ipc_send_msg does
+	ipc_park(target, value, NULL, NULL, 0, (void *) UTOP, 0);
+	memmove(curenv->env_ipc_send_segs, segv, nsegs * sizeof(segv[0]));
+	curenv->env_ipc_send_nsegs = nsegs;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
 
-	// Set the target to be runnable again, then return
-	target->env_status = ENV_RUNNABLE;
+	// Technically this is never run
+	return 0;
+}
+
+// Register the 'len' byte buffer at 'buf' as the place where messages
+// sent with sys_ipc_send_buf or sys_ipc_call_buf are copied.  The
+// registration lasts across receives until replaced; a 'len' of 0
+// removes it, after which such messages fail with -E_INVAL.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_INVAL if len is larger than IPC_MAXBUF.
+//	-E_FAULT if buf is not mapped writable.
+static int
+sys_ipc_set_rcvbuf(void *buf, size_t len)
+{
+	if(len > IPC_MAXBUF) return -E_INVAL;
+	if(user_mem_check(curenv, buf, len, PTE_U|PTE_W) != 0) return -E_FAULT;
+
+	curenv->env_ipc_rcvbuf = buf;
+	curenv->env_ipc_rcvbuflen = len;
 	return 0;
 }
 
+// Arm curenv's timer to end the blocking system call it is in with
+// -E_TIMEOUT after 'timeout' nanoseconds, unless 'timeout' is 0.
+static void
+timeout_arm(uint64_t timeout)
+{
+	if(timeout)
+		timer_set(curenv, read_tsc() + timer_ns2tsc(timeout), -E_TIMEOUT);
+}
+
 // Block until a value is ready.  Record that you want to receive
 // using the env_ipc_recving and env_ipc_dstva fields of struct Env,
 // mark yourself not runnable, and then give up the CPU.
@@ -627,10 +1139,16 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // If 'dstva' is < UTOP, then you are willing to receive a page of data.
 // 'dstva' is the virtual address at which the sent page should be mapped.
 //
+// If a sender is already parked on us by sys_ipc_send, its message is
+// taken right away, the sender is woken, and we don't block at all.
+//
+// If 'timeout' is nonzero, give up after that many nanoseconds.
+//
 // This function only returns on error, but the system call will eventually
 // return 0 on success.
 // Return < 0 on error.  Errors are:
 //	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_TIMEOUT if nothing arrived in time (returned by the system call).
 //
 // CHALLENGE: You may also specify a source environment.  If this is not
 //  0, then only messages from that environment will be recieved. Passing
@@ -640,7 +1158,7 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, unsigned perm)
 // New possible error:
 //      -E_BAD_ENV if the source environment doesn't exist
 static int
-sys_ipc_recv(envid_t source, void *dstva)
+sys_ipc_recv(envid_t source, void *dstva, uint64_t timeout)
 {
 	struct Env *env;
 
@@ -651,24 +1169,654 @@ sys_ipc_recv(envid_t source, void *dstva)
 	if((unsigned int)dstva < UTOP && (int)dstva%PGSIZE != 0)
 		return -E_INVAL;
 
-	// Set up this environment to recieve ipcs
-	curenv->env_ipc_recving = true;
-	curenv->env_ipc_dstva = dstva;
-	curenv->env_ipc_value = 0;
-	curenv->env_ipc_from = source;
-	curenv->env_ipc_perm = 0;
+	// Set up this environment to recieve ipcs, and take a message
+	//  from a parked sender if there is one.
+	if(ipc_recv_prepare(source, dstva, 1))
+		return 0;
 
 	// Now set this environment to be not runnable, and
 	//  schedule a new environment to run on this cpu.
 	//  This way, the environment won't run again until
 	//  it receives an ipc.
-	curenv->env_status = ENV_NOT_RUNNABLE;
+	timeout_arm(timeout);
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
+
+	// Technically this is never run
+	return 0;
+}
+
+// Like sys_ipc_recv, but willing to receive up to 'npages' pages from
+// sys_ipc_sendv or sys_ipc_try_sendv, mapped one after another from 'dstva' on.  Senders
+// of a single page are received as usual.
+//
+// Return < 0 on error.  Errors are those of sys_ipc_recv, plus:
+//	-E_INVAL if npages is 0 or more than IPC_MAXPAGES, or the window
+//		reaches past UTOP.
+static int
+sys_ipc_recv_window(envid_t source, void *dstva, uint32_t npages)
+{
+	struct Env *env;
+
+	if(source != 0 && envid2env(source, &env, 0) != 0) return -E_BAD_ENV;
+
+	if(npages == 0 || npages > IPC_MAXPAGES) return -E_INVAL;
+	if((unsigned int)dstva < UTOP &&
+	   ((unsigned int)dstva%PGSIZE != 0 ||
+	    (unsigned int)dstva + npages*PGSIZE > UTOP))
+		return -E_INVAL;
+
+	if(ipc_recv_prepare(source, dstva, npages))
+		return 0;
+
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
 	sched_yield();
 
 	// Technically this is never run
 	return 0;
 }
 
+// Like sys_ipc_recv, but also return when notification bits are set for
+// us with sys_notify.  If any bits are already pending, return at once
+// without receiving.
+//
+// The system call returns 0 when a message arrived, as sys_ipc_recv
+// does, or 1 when notifications did; then every pending bit has been
+// moved into env_notify_taken and cleared, so a burst of notifications
+// costs the receiver a single wakeup.
+//
+// Return < 0 on error.  Errors are those of sys_ipc_recv.
+static int
+sys_ipc_recv_notify(envid_t source, void *dstva)
+{
+	struct Env *env;
+
+	if(source != 0 && envid2env(source, &env, 0) != 0) return -E_BAD_ENV;
+
+	if((unsigned int)dstva < UTOP && (int)dstva%PGSIZE != 0)
+		return -E_INVAL;
+
+	curenv->env_notify_taken = 0;
+	if(curenv->env_notify_pending) {
+		curenv->env_notify_taken = curenv->env_notify_pending;
+		curenv->env_notify_pending = 0;
+		return 1;
+	}
+
+	if(ipc_recv_prepare(source, dstva, 1))
+		return 0;
+	curenv->env_notify_waiting = 1;
+
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
+
+	// Technically this is never run
+	return 0;
+}
+
+// Set notification bits 'bits' for 'e', waking it if it is waiting in
+// sys_ipc_recv_notify.
+static void
+notify_env(struct Env *e, uint32_t bits)
+{
+	e->env_notify_pending |= bits;
+	if(e->env_notify_pending && e->env_notify_waiting && e->env_ipc_recving) {
+		e->env_notify_taken = e->env_notify_pending;
+		e->env_notify_pending = 0;
+		e->env_notify_waiting = 0;
+		e->env_ipc_recving = 0;
+		e->env_tf.tf_regs.reg_eax = 1;
+		sched_wakeup(e);
+	}
+}
+
+// Set the notification bits 'bits' for 'envid' without blocking.  Bits
+// accumulate until the target takes them; if it is waiting in
+// sys_ipc_recv_notify it is woken right away.  Setting a bit that is
+// already pending has no further effect, which is what lets bursts of
+// events coalesce.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+//		(No need to check permissions.)
+static int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	struct Env *e;
+
+	if(envid2env(envid, &e, 0) != 0) return -E_BAD_ENV;
+	notify_env(e, bits);
+	return 0;
+}
+
+// Environments that take hardware interrupts as notifications (see
+// sys_irq_notify), by IRQ number.
+static struct IrqNotify {
+	envid_t in_env;
+	uint32_t in_bits;
+} irq_notify[MAX_IRQS];
+
+// Turn hardware interrupt 'irq' into notification bits for the
+// environment that asked for it.  If that environment is gone, the IRQ
+// is masked again.  Returns false if nobody asked for 'irq'.
+bool
+irq_deliver(int irq)
+{
+	struct IrqNotify *in = &irq_notify[irq];
+	struct Env *e;
+
+	if(!in->in_env)
+		return false;
+	// The slave 8259A is not in automatic EOI mode
+	if(irq >= 8)
+		outb(IO_PIC2, 0x20);
+	if(envid2env(in->in_env, &e, 0) != 0) {
+		in->in_env = 0;
+		irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+		return true;
+	}
+	notify_env(e, in->in_bits);
+	return true;
+}
+
+// Have every occurrence of hardware interrupt 'irq' set notification
+// bits 'bits' for the current environment, which it takes with
+// sys_ipc_recv_notify, and unmask 'irq'.  Bits 0 stops the notifications
+// and masks 'irq' again.  The IRQs the kernel handles itself cannot be
+// taken, and only environments with I/O privilege, which can quiet the
+// device, may ask.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment does not have I/O privilege, or
+//		another environment already takes 'irq'.
+//	-E_INVAL if 'irq' is out of range or handled by the kernel.
+static int
+sys_irq_notify(int irq, uint32_t bits)
+{
+	struct Env *e;
+
+	if((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0) return -E_BAD_ENV;
+	if(irq < 0 || irq >= MAX_IRQS || irq == IRQ_TIMER || irq == IRQ_KBD ||
+	   irq == IRQ_SLAVE || irq == IRQ_SERIAL || irq == IRQ_SPURIOUS)
+		return -E_INVAL;
+	if(irq_notify[irq].in_env && irq_notify[irq].in_env != curenv->env_id &&
+	   envid2env(irq_notify[irq].in_env, &e, 0) == 0)
+		return -E_BAD_ENV;
+
+	if(bits == 0) {
+		irq_notify[irq].in_env = 0;
+		irq_setmask_8259A(irq_mask_8259A | (1 << irq));
+		return 0;
+	}
+	irq_notify[irq].in_env = curenv->env_id;
+	irq_notify[irq].in_bits = bits;
+	irq_setmask_8259A(irq_mask_8259A & ~(1 << irq));
+	return 0;
+}
+
+// Returns true if 'e' waits for notifications from a hardware interrupt.
+static bool
+irq_waits(struct Env *e)
+{
+	int irq;
+
+	if(!e->env_notify_waiting || !e->env_ipc_recving)
+		return false;
+	for(irq = 0; irq < MAX_IRQS; irq++)
+		if(irq_notify[irq].in_env == e->env_id)
+			return true;
+	return false;
+}
+
+// Send a request to 'envid' and wait for its reply, in one system call.
+// The request is 'value' and the page at 'srcva', as in sys_ipc_send;
+// the reply is received as by sys_ipc_recv(envid, dstva), so only the
+// callee can answer it.
+//
+// If the callee is already waiting in sys_ipc_recv, the request is
+// handed over and this CPU switches straight to the callee, without a
+// trip through sched_yield.  Otherwise the caller is parked on the
+// callee's send queue, and is moved directly to waiting for the reply
+// when the callee takes the request.
+//
+// Returns 0 once the reply has arrived (the reply value and page are
+// reported in env_ipc_value and env_ipc_perm), < 0 on error.  Errors
+// are those of sys_ipc_send, plus:
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	-E_BAD_ENV if the callee exits before replying.
+static int
+sys_ipc_call_msg(envid_t envid, uint32_t value, const uint32_t *words,
+		 const void *buf, size_t buflen, void *srcva, unsigned perm,
+		 void *dstva)
+{
+	struct Env *target;
+	int retval;
+
+	// Grab the target environment without checking permissions
+	if((retval = envid2env(envid, &target, 0)) != 0) return retval;
+
+	// Calling ourselves would never complete
+	if(target == curenv) return -E_INVAL;
+
+	// Sanity check both page addresses
+	if(((unsigned int)srcva < UTOP && (unsigned int)srcva%PGSIZE != 0) ||
+	   ((unsigned int)dstva < UTOP && (unsigned int)dstva%PGSIZE != 0))
+		return -E_INVAL;
+
+	// Fast path: hand the request over and run the callee right here
+	if(ipc_accepts(target, curenv)) {
+		if((retval = ipc_transfer(curenv, target, value, words, buf, buflen, srcva, perm)) != 0)
+			return retval;
+		ipc_recv_state(curenv, target->env_id, dstva);
+		env_set_status(curenv, ENV_NOT_RUNNABLE);
+		env_run(target);
+	}
+
+	// Otherwise park on the callee's send queue as a caller
+	ipc_park(target, value, words, buf, buflen, srcva, perm);
+	curenv->env_ipc_calling = 1;
+	curenv->env_ipc_call_dstva = dstva;
+
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
+
+	// Technically this is never run
+	return 0;
+}
+
+static int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	return sys_ipc_call_msg(envid, value, NULL, NULL, 0, srcva, perm, dstva);
+}
+
+// Like sys_ipc_call, but the request is 'value' and the inline words
+// 'w0', 'w1' and 'w2', with no page, and no page is accepted with the
+// reply.  Meant for small requests and replies: a reply sent with
+// sys_ipc_reply_recv_words (or sys_ipc_send_words) leaves its words in
+// env_ipc_words.
+static int
+sys_ipc_call_words(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+	uint32_t words[IPC_NWORDS] = { w0, w1, w2 };
+
+	return sys_ipc_call_msg(envid, value, words, NULL, 0, (void *) UTOP, 0, (void *) UTOP);
+}
+
+// Like sys_ipc_call, but the request is 'value' and a copy of the 'len'
+// bytes at 'buf' (as in sys_ipc_send_buf), with no page.  The reply may
+// still carry a page, mapped at 'dstva'.
+static int
+sys_ipc_call_buf(envid_t envid, uint32_t value, const void *buf, size_t len, void *dstva)
+{
+	if(len > IPC_MAXBUF) return -E_INVAL;
+	if(user_mem_check(curenv, buf, len, PTE_U) != 0) return -E_FAULT;
+
+	return sys_ipc_call_msg(envid, value, NULL, buf, len, (void *) UTOP, 0, dstva);
+}
+
+// Reply to 'envid' with 'value' and the page at 'srcva' (as in
+// sys_ipc_try_send), then receive the next message from anyone at
+// 'dstva' (as in sys_ipc_recv).  This is the server half of
+// sys_ipc_call.
+//
+// If no request is waiting, this CPU switches straight to the client
+// that was just answered, without a trip through sched_yield.
+//
+// Returns 0 once the next message has arrived, < 0 on error.  If the
+// reply cannot be delivered no message is received.  Errors are:
+//	-E_IPC_NOT_RECV if envid is not waiting for a message from us.
+//		The caller should fall back to a plain send.
+//	-E_INVAL if dstva < UTOP but dstva is not page-aligned.
+//	any error of sys_ipc_try_send for the reply.
+//
+// 'words' is as for ipc_transfer.
+static int
+sys_ipc_reply_recv_msg(envid_t envid, uint32_t value, const uint32_t *words,
+		       void *srcva, unsigned perm, void *dstva)
+{
+	struct Env *client;
+	int retval;
+
+	// Sanity check dstva before the reply goes out
+	if((unsigned int)dstva < UTOP && (unsigned int)dstva%PGSIZE != 0)
+		return -E_INVAL;
+
+	// Deliver the reply
+	if((retval = envid2env(envid, &client, 0)) != 0) return retval;
+	if(!ipc_accepts(client, curenv)) return -E_IPC_NOT_RECV;
+	if((retval = ipc_transfer(curenv, client, value, words, NULL, 0, srcva, perm)) != 0)
+		return retval;
+
+	// If another request is already queued, take it and keep
+	//  running; the client will be picked up by the scheduler.
+	if(ipc_recv_prepare(0, dstva, 1)) {
+		sched_wakeup(client);
+		return 0;
+	}
+
+	// Otherwise block and give this CPU straight to the client
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	env_run(client);
+}
+
+static int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, unsigned perm, void *dstva)
+{
+	return sys_ipc_reply_recv_msg(envid, value, NULL, srcva, perm, dstva);
+}
+
+// Like sys_ipc_reply_recv, but the reply is 'value' and the IPC_NWORDS
+// inline words at 'words', with no page, so a server can answer an
+// sys_ipc_call_words request with more than a single value.
+//
+// Errors are those of sys_ipc_reply_recv, plus:
+//	-E_FAULT if 'words' is not readable.
+static int
+sys_ipc_reply_recv_words(envid_t envid, uint32_t value, const uint32_t *words, void *dstva)
+{
+	uint32_t w[IPC_NWORDS];
+
+	if(user_mem_check(curenv, words, sizeof(w), PTE_U) != 0) return -E_FAULT;
+	memmove(w, words, sizeof(w));
+
+	return sys_ipc_reply_recv_msg(envid, value, w, (void *) UTOP, 0, dstva);
+}
+
+// Ring the doorbell of 'envid'.  If the target is blocked in
+// sys_doorbell_wait it is woken; otherwise its next sys_doorbell_wait
+// returns at once.  Rings are not counted, and carry no data, so this
+// is much cheaper than an IPC message when the peer only needs to know
+// that something changed (such as a shared-memory ring filling up).
+//
+// Any environment may ring any other's doorbell, just as any environment
+// may send it an IPC message or notification bits: the two ends of a
+// ring are usually not parent and child, so envid2env's permission
+// check would refuse the peers that need it.  This is safe because a
+// ring tells the target nothing beyond "look again".  Every waiter
+// must re-check its own state after sys_doorbell_wait returns and wait
+// again if nothing changed, as ipcring_send and ipcring_recv do, so a
+// stray ring costs the target one wakeup and nothing else.
+//
+// Returns 0 on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if environment envid doesn't currently exist.
+static int
+sys_env_doorbell(envid_t envid)
+{
+	struct Env *e;
+
+	if(envid2env(envid, &e, 0) != 0) return -E_BAD_ENV;
+
+	if(e->env_doorbell_waiting) {
+		e->env_doorbell_waiting = 0;
+		sched_wakeup(e);
+	} else
+		e->env_doorbell = 1;
+	return 0;
+}
+
+// Block until our doorbell is rung, unless it has been rung since the
+// last call, in which case return at once.  Anyone may ring it (see
+// sys_env_doorbell), so a return only means that something may have
+// changed.  Returns 0.
+static int
+sys_doorbell_wait(void)
+{
+	if(curenv->env_doorbell) {
+		curenv->env_doorbell = 0;
+		return 0;
+	}
+
+	curenv->env_doorbell_waiting = 1;
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
+
+	// Technically this is never run
+	return 0;
+}
+
+// Futexes.  Waiters are keyed on the physical address of the word they
+// wait on, so envs sharing a page through different virtual addresses
+// (PTE_SHARE mappings, or the read-only envs array) meet on the same
+// key.  They are kept in FIFO lists hashed by physical page, so a wake
+// only looks at one bucket, even when it covers a whole page.
+#define FUTEX_NHASH	64
+#define FUTEX_HASH(pa)	(PGNUM(pa) % FUTEX_NHASH)
+
+static struct FutexWaiter *futex_hash[FUTEX_NHASH];
+
+// Bumped whenever a page that is still mapped elsewhere loses a mapping
+// through sys_page_unmap or env_free (see futex_page_remove).
+// Page reference counts can't be futex words, yet user code (pipes, for
+// one) decides whether to sleep by comparing them; so a wait fails if the
+// page of one of its words lost a mapping since the waiter's last system
+// call, when it may have been looking at the counts.  futex_unmap_seq
+// records, per hash bucket of physical pages, the value futex_unmap_gen
+// took at the last such unmap, so unmaps elsewhere leave waiters alone.
+static uint32_t futex_unmap_gen;
+static uint32_t futex_unmap_seq[FUTEX_NHASH];
+
+// Find the futex key for user address 'addr' in curenv.
+static int
+futex_key(const void *addr, physaddr_t *key_store)
+{
+	struct PageInfo *pi;
+
+	if((uintptr_t)addr % sizeof(uint32_t) != 0) return -E_INVAL;
+	if(user_mem_check(curenv, addr, sizeof(uint32_t), PTE_U) != 0)
+		return -E_FAULT;
+	pi = page_lookup(curenv->env_pgdir, (void *)addr, NULL);
+	*key_store = page2pa(pi) + PGOFF(addr);
+	return 0;
+}
+
+// Take 'e' off every futex wait list it is on.  Called on wakeup, and
+// when 'e' is freed.
+void
+futex_env_free(struct Env *e)
+{
+	struct FutexWaiter *w, **pp;
+	uint32_t i;
+
+	for(i = 0; i < e->env_futex_nwait; i++) {
+		w = &e->env_futex[i];
+		for(pp = &futex_hash[FUTEX_HASH(w->fw_key)]; *pp; pp = &(*pp)->fw_next)
+			if(*pp == w) {
+				*pp = w->fw_next;
+				break;
+			}
+	}
+	e->env_futex_nwait = 0;
+}
+
+// Wake up to 'n' envs waiting on physical address 'pa', oldest first,
+// or, if 'wholepage' is set, on any address in the page holding 'pa'.
+// Returns the number of envs woken.
+uint32_t
+futex_wake_pa(physaddr_t pa, uint32_t n, bool wholepage)
+{
+	struct FutexWaiter *w;
+	struct Env *e;
+	uint32_t woken = 0;
+
+	// Waking an env takes all its entries off the lists, perhaps
+	// including ones in this bucket, so start over after each
+	while(woken < n) {
+		for(w = futex_hash[FUTEX_HASH(pa)]; w; w = w->fw_next)
+			if(wholepage ? PTE_ADDR(w->fw_key) == PTE_ADDR(pa)
+				     : w->fw_key == pa)
+				break;
+		if(!w)
+			break;
+		e = w->fw_env;
+		futex_env_free(e);
+		if(e->env_status == ENV_NOT_RUNNABLE)
+			sched_wakeup(e);
+		woken++;
+	}
+	return woken;
+}
+
+// page_remove for an env letting go of a page, by unmapping it or by
+// exiting.  If someone else still maps the page, they may be waiting for
+// us to let go of it, so fail their next wait and wake everyone waiting
+// anywhere in the page.
+void
+futex_page_remove(pde_t *pgdir, void *va)
+{
+	struct PageInfo *pp;
+
+	if((pp = page_lookup(pgdir, va, NULL)) && pp->pp_ref > 1) {
+		futex_unmap_seq[FUTEX_HASH(page2pa(pp))] = ++futex_unmap_gen;
+		futex_wake_pa(page2pa(pp), ~0U, true);
+	}
+	page_remove(pgdir, va);
+}
+
+// Returns true if 'e' is waiting for something an interrupt can bring,
+// such as console input or a notification from a device.
+bool
+env_waits_for_device(struct Env *e)
+{
+	uint32_t i;
+
+	for(i = 0; i < e->env_futex_nwait; i++)
+		if(e->env_futex[i].fw_key == cons_futex_key())
+			return true;
+	return irq_waits(e);
+}
+
+// Block until woken by sys_futex_wake on any of the 'n' words in 'v',
+// provided each still holds its expected value.  The checks and the
+// sleep happen under the kernel lock, so a waker that changes a word
+// and then calls sys_futex_wake can never be missed.  The words may be
+// at any readable user address, including the read-only envs array.
+// An entry with a null address waits for console input instead, and
+// counts as changed whenever some is buffered.
+//
+// If 'timeout' is nonzero, give up after that many nanoseconds.
+//
+// Waiters may also be woken spuriously, so callers must recheck their
+// condition.  This function only returns on error; the system call
+// returns 0 once woken.
+// Return < 0 on error.  Errors are:
+//	-E_TIMEOUT if not woken in time (returned by the system call).
+//	-E_AGAIN if some word doesn't hold its expected value, if console
+//		input is waiting, or if the page of some word lost a
+//		mapping since the caller's last system call.
+//	-E_INVAL if n is 0 or more than FUTEX_MAXWAIT, or an address is
+//		not 4-byte aligned.
+//	-E_FAULT if v or an address is not mapped readable.
+static int
+sys_futex_waitv(const struct FutexWaitv *v, uint32_t n, uint64_t timeout)
+{
+	struct FutexWaiter *w, **pp;
+	physaddr_t keys[FUTEX_MAXWAIT];
+	uint32_t i;
+	int r;
+
+	if(n == 0 || n > FUTEX_MAXWAIT) return -E_INVAL;
+	if(user_mem_check(curenv, v, n * sizeof(*v), PTE_U) != 0)
+		return -E_FAULT;
+	for(i = 0; i < n; i++) {
+		if(v[i].fw_addr == NULL) {
+			if(cons_ready()) return -E_AGAIN;
+			keys[i] = cons_futex_key();
+			continue;
+		}
+		if((r = futex_key((const void *)v[i].fw_addr, &keys[i])) < 0)
+			return r;
+		if(*v[i].fw_addr != v[i].fw_val) return -E_AGAIN;
+		if((int32_t)(futex_unmap_seq[FUTEX_HASH(keys[i])] -
+			     curenv->env_futex_unmaps) > 0)
+			return -E_AGAIN;
+	}
+
+	// Drop stale entries left if something else woke us last time
+	futex_env_free(curenv);
+	for(i = 0; i < n; i++) {
+		w = &curenv->env_futex[i];
+		w->fw_key = keys[i];
+		w->fw_env = curenv;
+		w->fw_next = NULL;
+		for(pp = &futex_hash[FUTEX_HASH(keys[i])]; *pp; pp = &(*pp)->fw_next)
+			;
+		*pp = w;
+	}
+	curenv->env_futex_nwait = n;
+
+	timeout_arm(timeout);
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
+
+	// Technically this is never run
+	return 0;
+}
+
+// sys_futex_waitv on the single word at 'addr', with the same timeout.
+static int
+sys_futex_wait(const uint32_t *addr, uint32_t expected, uint64_t timeout)
+{
+	struct FutexWaitv v;
+
+	if(addr == NULL) return -E_FAULT;
+	v.fw_addr = addr;
+	v.fw_val = expected;
+	return sys_futex_waitv(&v, 1, timeout);
+}
+
+// Wake up to 'n' envs waiting in sys_futex_waitv on the word at 'addr',
+// oldest first.  Returns the number woken, or < 0 on error.  Errors are
+// those of sys_futex_waitv for 'addr'.
+static int
+sys_futex_wake(const uint32_t *addr, uint32_t n)
+{
+	physaddr_t key;
+	int r;
+
+	if((r = futex_key(addr, &key)) < 0) return r;
+	return futex_wake_pa(key, n, false);
+}
+
+// Sleep for 'ns' nanoseconds.  Returns 0, once the time is up.
+static int
+sys_sleep(uint64_t ns)
+{
+	if(ns == 0) return 0;
+	timer_set(curenv, read_tsc() + timer_ns2tsc(ns), 0);
+	env_set_status(curenv, ENV_NOT_RUNNABLE);
+	sched_yield();
+
+	// Technically this is never run
+	return 0;
+}
+
+// Return the number of milliseconds since boot.
+static int
+sys_time_msec(void)
+{
+	return read_tsc() / tsc_per_ms;
+}
+
+// Return the physical address that 'va' maps to in the current
+// environment, so that it can point a device at the memory for DMA.
+// Only environments with I/O privilege, which can make a device read or
+// write any memory anyway, may ask.
+//
+// Returns the physical address on success, < 0 on error.  Errors are:
+//	-E_BAD_ENV if the environment does not have I/O privilege.
+//	-E_INVAL if va >= UTOP or va is not mapped.
+static int
+sys_page_phys(void *va)
+{
+	struct PageInfo *pp;
+
+	if((curenv->env_tf.tf_eflags & FL_IOPL_MASK) == 0) return -E_BAD_ENV;
+	if((uintptr_t)va >= UTOP) return -E_INVAL;
+	if(!(pp = page_lookup(curenv->env_pgdir, va, NULL))) return -E_INVAL;
+	return page2pa(pp) | PGOFF(va);
+}
+
 // Dispatches to the correct kernel function, passing the arguments.
 int32_t
 syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5)
@@ -678,6 +1826,10 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 	// The default return value is 0 for success
 	int retval = 0;
 
+	// Whatever blocking call curenv's timer was for is over
+	if(curenv->env_timer_deadline)
+		timer_cancel(curenv);
+
 	// Switch on the system call
 	switch(syscallno) {
 	case SYS_cputs:
@@ -722,6 +1874,9 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		user_mem_assert(curenv, (void *)a2, sizeof(struct Trapframe), PTE_U);
 		retval = sys_env_set_trapframe(a1, (void *)a2);
 		break;
+	case SYS_env_set_quantum:
+		retval = sys_env_set_quantum(a1, a2);
+		break;
 	case SYS_env_set_pgfault_upcall:
 		retval = sys_env_set_pgfault_upcall(a1, (void *)a2);
 		break;
@@ -735,12 +1890,85 @@ syscall(uint32_t syscallno, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4,
 		retval = sys_ipc_try_send(a1, a2, (void *)a3, a4);
 		break;
 	case SYS_ipc_recv:
-		retval = sys_ipc_recv(a1, (void *)a2);
+		retval = sys_ipc_recv(a1, (void *)a2, ((uint64_t)a4 << 32) | a3);
+		break;
+	case SYS_ipc_send:
+		retval = sys_ipc_send(a1, a2, (void *)a3, a4);
+		break;
+	case SYS_ipc_call:
+		retval = sys_ipc_call(a1, a2, (void *)a3, a4, (void *)a5);
+		break;
+	case SYS_ipc_reply_recv:
+		retval = sys_ipc_reply_recv(a1, a2, (void *)a3, a4, (void *)a5);
+		break;
+	case SYS_ipc_sendv:
+		retval = sys_ipc_sendv(a1, a2, (const struct IpcSeg *)a3, a4);
+		break;
+	case SYS_ipc_reply_recv_words:
+		retval = sys_ipc_reply_recv_words(a1, a2, (const uint32_t *)a3, (void *)a4);
+		break;
+	case SYS_ipc_send_words:
+		retval = sys_ipc_send_words(a1, a2, a3, a4, a5);
+		break;
+	case SYS_ipc_call_words:
+		retval = sys_ipc_call_words(a1, a2, a3, a4, a5);
+		break;
+	case SYS_env_doorbell:
+		retval = sys_env_doorbell(a1);
+		break;
+	case SYS_doorbell_wait:
+		retval = sys_doorbell_wait();
+		break;
+	case SYS_ipc_try_sendv:
+		retval = sys_ipc_try_sendv(a1, a2, (const struct IpcSeg *)a3, a4);
+		break;
+	case SYS_ipc_recv_window:
+		retval = sys_ipc_recv_window(a1, (void *)a2, a3);
+		break;
+	case SYS_ipc_send_buf:
+		retval = sys_ipc_send_buf(a1, a2, (const void *)a3, a4);
+		break;
+	case SYS_ipc_call_buf:
+		retval = sys_ipc_call_buf(a1, a2, (const void *)a3, a4, (void *)a5);
+		break;
+	case SYS_ipc_set_rcvbuf:
+		retval = sys_ipc_set_rcvbuf((void *)a1, a2);
+		break;
+	case SYS_ipc_recv_notify:
+		retval = sys_ipc_recv_notify(a1, (void *)a2);
+		break;
+	case SYS_notify:
+		retval = sys_notify(a1, a2);
+		break;
+	case SYS_futex_wait:
+		retval = sys_futex_wait((const uint32_t *)a1, a2,
+					((uint64_t)a4 << 32) | a3);
+		break;
+	case SYS_futex_wake:
+		retval = sys_futex_wake((const uint32_t *)a1, a2);
+		break;
+	case SYS_futex_waitv:
+		retval = sys_futex_waitv((const struct FutexWaitv *)a1, a2,
+					 ((uint64_t)a4 << 32) | a3);
+		break;
+	case SYS_sleep:
+		retval = sys_sleep(((uint64_t)a2 << 32) | a1);
+		break;
+	case SYS_time_msec:
+		retval = sys_time_msec();
+		break;
+	case SYS_page_phys:
+		retval = sys_page_phys((void *)a1);
+		break;
+	case SYS_irq_notify:
+		retval = sys_irq_notify(a1, a2);
 		break;
 	default:
 		// Unknown/unimplemented system call number
 		retval = -E_INVAL;
 	}
 
+	// See futex_unmap_gen
+	curenv->env_futex_unmaps = futex_unmap_gen;
 	return retval;
 }
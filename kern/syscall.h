@@ -6,6 +6,14 @@
 
 #include <inc/syscall.h>
 
+struct Env;
+
 int32_t syscall(uint32_t num, uint32_t a1, uint32_t a2, uint32_t a3, uint32_t a4, uint32_t a5);
+void	ipc_env_free(struct Env *e);
+void	futex_env_free(struct Env *e);
+uint32_t futex_wake_pa(physaddr_t pa, uint32_t n, bool wholepage);
+void	futex_page_remove(pde_t *pgdir, void *va);
+bool	env_waits_for_device(struct Env *e);
+bool	irq_deliver(int irq);
 
 #endif /* !JOS_KERN_SYSCALL_H */
@@ -0,0 +1,192 @@
+// Per-CPU timers for sleeping and for timeouts on blocking system calls.
+//
+// Time is kept in TSC cycles.  Each env has at most one timer, armed by
+// the blocking system call it is in; the next system call it makes
+// cancels it.  When a timer expires while its env is still blocked, the
+// env is taken off any wait lists and woken with env_timer_result as the
+// system call's return value.
+
+#include <inc/x86.h>
+#include <inc/assert.h>
+
+#include <kern/env.h>
+#include <kern/cpu.h>
+#include <kern/sched.h>
+#include <kern/syscall.h>
+#include <kern/timer.h>
+
+// Each CPU keeps the timers armed on it in a wheel of TIMER_NSLOTS lists,
+// one per millisecond tick, so arming, cancelling and expiring a timer
+// only touch one list.  Timers more than a revolution out share slots
+// with nearer ones and are passed over until their time comes round.
+#define TIMER_NSLOTS	64
+
+struct TimerWheel {
+	struct Env *tw_slots[TIMER_NSLOTS];
+	uint64_t tw_tick;	// Earliest tick whose slot may hold due timers
+	uint32_t tw_count;	// Number of timers armed
+};
+
+static struct TimerWheel wheels[NCPU];
+
+static uint64_t
+tick_of(uint64_t t)
+{
+	return t / tsc_per_ms;
+}
+
+// Convert nanoseconds to TSC cycles, without overflowing for long waits.
+uint64_t
+timer_ns2tsc(uint64_t ns)
+{
+	return (ns / 1000000) * tsc_per_ms + (ns % 1000000) * tsc_per_ms / 1000000;
+}
+
+// Convert LAPIC timer counts to TSC cycles.
+uint64_t
+timer_lapic2tsc(uint32_t count)
+{
+	return (uint64_t) count * tsc_per_ms / lapic_per_ms;
+}
+
+// Convert TSC cycles to LAPIC timer counts, saturating.
+static uint32_t
+timer_tsc2lapic(uint64_t cycles)
+{
+	uint64_t count = (cycles / tsc_per_ms) * lapic_per_ms +
+		(cycles % tsc_per_ms) * lapic_per_ms / tsc_per_ms;
+
+	return count > 0xffffffff ? 0xffffffff : count;
+}
+
+// Arm e's timer on this CPU to fire at TSC time 'deadline', waking e
+// with 'result' if it is still blocked then.  Replaces any timer e had.
+void
+timer_set(struct Env *e, uint64_t deadline, int32_t result)
+{
+	struct TimerWheel *w = &wheels[cpunum()];
+	uint64_t tick;
+
+	timer_cancel(e);
+	if (w->tw_count == 0)
+		w->tw_tick = tick_of(read_tsc());
+	// A deadline already past goes where the next expiry looks first
+	tick = MAX(tick_of(deadline), w->tw_tick);
+
+	e->env_timer_deadline = deadline;
+	e->env_timer_result = result;
+	e->env_timer_cpu = cpunum();
+	e->env_timer_slot = tick % TIMER_NSLOTS;
+	e->env_timer_next = w->tw_slots[e->env_timer_slot];
+	w->tw_slots[e->env_timer_slot] = e;
+	w->tw_count++;
+}
+
+// Disarm e's timer, if it has one.
+void
+timer_cancel(struct Env *e)
+{
+	struct TimerWheel *w;
+	struct Env **pp;
+
+	if (!e->env_timer_deadline)
+		return;
+	w = &wheels[e->env_timer_cpu];
+	for (pp = &w->tw_slots[e->env_timer_slot]; *pp; pp = &(*pp)->env_timer_next)
+		if (*pp == e) {
+			*pp = e->env_timer_next;
+			w->tw_count--;
+			break;
+		}
+	e->env_timer_deadline = 0;
+}
+
+static void
+timer_fire(struct Env *e)
+{
+	// Woken some other way already
+	if (e->env_status != ENV_NOT_RUNNABLE)
+		return;
+	futex_env_free(e);
+	e->env_ipc_recving = 0;
+	e->env_tf.tf_regs.reg_eax = e->env_timer_result;
+	sched_wakeup(e);
+}
+
+// Fire every timer on this CPU whose deadline has passed.
+void
+timer_expire(void)
+{
+	struct TimerWheel *w = &wheels[cpunum()];
+	struct Env *e, **pp;
+	uint64_t now, nowtick, i, n;
+
+	if (w->tw_count == 0)
+		return;
+	now = read_tsc();
+	nowtick = tick_of(now);
+	n = MIN(nowtick - w->tw_tick + 1, TIMER_NSLOTS);
+	for (i = 0; i < n; i++) {
+		pp = &w->tw_slots[(w->tw_tick + i) % TIMER_NSLOTS];
+		while ((e = *pp) != NULL) {
+			if (e->env_timer_deadline > now) {
+				pp = &e->env_timer_next;
+				continue;
+			}
+			*pp = e->env_timer_next;
+			w->tw_count--;
+			e->env_timer_deadline = 0;
+			timer_fire(e);
+		}
+	}
+	w->tw_tick = nowtick;
+}
+
+// Return the earliest deadline armed on this CPU, or 0 if none.
+static uint64_t
+timer_next(void)
+{
+	struct TimerWheel *w = &wheels[cpunum()];
+	struct Env *e;
+	uint64_t i, best = 0;
+
+	if (w->tw_count == 0)
+		return 0;
+	// The first slot holding a timer due in its own revolution has
+	// the earliest one
+	for (i = 0; i < TIMER_NSLOTS; i++) {
+		for (e = w->tw_slots[(w->tw_tick + i) % TIMER_NSLOTS]; e; e = e->env_timer_next)
+			if (tick_of(e->env_timer_deadline) <= w->tw_tick + i
+			    && (!best || e->env_timer_deadline < best))
+				best = e->env_timer_deadline;
+		if (best)
+			return best;
+	}
+	// Everything is more than a revolution out
+	for (i = 0; i < TIMER_NSLOTS; i++)
+		for (e = w->tw_slots[i]; e; e = e->env_timer_next)
+			if (!best || e->env_timer_deadline < best)
+				best = e->env_timer_deadline;
+	return best;
+}
+
+// Set this CPU's LAPIC timer for the earlier of TSC time 'slice_end'
+// (0 for none) and the next timer armed here.  The timer is left alone
+// if it is already set for that time.
+void
+timer_program(uint64_t slice_end)
+{
+	uint64_t deadline = slice_end, next = timer_next(), now;
+
+	if (next && (!deadline || next < deadline))
+		deadline = next;
+	if (deadline == thiscpu->cpu_timer_armed)
+		return;
+	thiscpu->cpu_timer_armed = deadline;
+	if (!deadline) {
+		lapic_timer_oneshot(0);
+		return;
+	}
+	now = read_tsc();
+	lapic_timer_oneshot(MAX(timer_tsc2lapic(deadline > now ? deadline - now : 0), 1));
+}
@@ -0,0 +1,21 @@
+/* See COPYRIGHT for copyright information. */
+
+#ifndef JOS_KERN_TIMER_H
+#define JOS_KERN_TIMER_H
+#ifndef JOS_KERNEL
+# error "This is a JOS kernel header; user programs should not #include it"
+#endif
+
+#include <inc/types.h>
+
+struct Env;
+
+void	timer_set(struct Env *e, uint64_t deadline, int32_t result);
+void	timer_cancel(struct Env *e);
+void	timer_expire(void);
+void	timer_program(uint64_t slice_end);
+
+uint64_t timer_ns2tsc(uint64_t ns);
+uint64_t timer_lapic2tsc(uint32_t count);
+
+#endif	// !JOS_KERN_TIMER_H
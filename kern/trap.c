@@ -13,6 +13,7 @@
 #include <kern/picirq.h>
 #include <kern/cpu.h>
 #include <kern/spinlock.h>
+#include <kern/timer.h>
 
 
 
@@ -44,6 +45,7 @@ void handle_irq_serial();
 void handle_irq_spurious();
 void handle_irq_ide();
 void handle_irq_error();
+void handle_irq_resched();
 
 // These handlers may not push error codes
 //  when they should.
@@ -99,7 +101,8 @@ static const char *trapname(int trapno)
 		[IRQ_OFFSET+IRQ_SERIAL]   = "Serial Interrupt",
 		[IRQ_OFFSET+IRQ_SPURIOUS] = "Spurious Interrupt",
 		[IRQ_OFFSET+IRQ_IDE]      = "IDE Interrupt",
-		[IRQ_OFFSET+IRQ_ERROR]    = "Error"
+		[IRQ_OFFSET+IRQ_ERROR]    = "Error",
+		[IRQ_OFFSET+IRQ_RESCHED]  = "Reschedule IPI"
 	};
 
 	if (trapno < sizeof(excnames)/sizeof(excnames[0]))
@@ -140,6 +143,7 @@ trap_init(void)
 	SETGATE(idt[IRQ_OFFSET+IRQ_SPURIOUS], 0, GD_KT, handle_irq_spurious, 0);
 	SETGATE(idt[IRQ_OFFSET+IRQ_IDE], 0, GD_KT, handle_irq_ide, 0);
 	SETGATE(idt[IRQ_OFFSET+IRQ_ERROR], 0, GD_KT, handle_irq_error, 0);
+	SETGATE(idt[IRQ_OFFSET+IRQ_RESCHED], 0, GD_KT, handle_irq_resched, 0);
 
 	// Per-CPU setup
 	trap_init_percpu();
@@ -289,7 +293,21 @@ trap_dispatch(struct Trapframe *tf)
 	// Handle clock interrupts. Don't forget to acknowledge the
 	// interrupt using lapic_eoi() before calling the scheduler!
 	if(tf->tf_trapno == IRQ_OFFSET+IRQ_TIMER) {
-		// Timer interrupts should cause the scheduler to be run
+		lapic_eoi();
+		thiscpu->cpu_timer_armed = 0;
+		timer_expire();
+
+		// Only the end of its time slice preempts the running
+		// environment; otherwise the timer was for a sleeper.
+		if(curenv && curenv->env_status == ENV_RUNNING &&
+		   (thiscpu->cpu_tickless || read_tsc() < thiscpu->cpu_slice_end))
+			return;
+		sched_yield();
+	}
+
+	// Another CPU made an environment runnable, or wants the
+	// environment running here to trap into the kernel.
+	if(tf->tf_trapno == IRQ_OFFSET+IRQ_RESCHED) {
 		lapic_eoi();
 		sched_yield();
 	}
@@ -307,6 +325,11 @@ trap_dispatch(struct Trapframe *tf)
 		return;
 	}
 
+	// Device interrupts that an environment takes as notifications
+	if(tf->tf_trapno >= IRQ_OFFSET && tf->tf_trapno < IRQ_OFFSET + MAX_IRQS &&
+	   irq_deliver(tf->tf_trapno - IRQ_OFFSET))
+		return;
+
 	// Unexpected trap: The user process or the kernel has a bug.
 	print_trapframe(tf);
 	if (tf->tf_cs == GD_KT)
@@ -331,8 +354,10 @@ trap(struct Trapframe *tf)
 
 	// Re-acqurie the big kernel lock if we were halted in
 	// sched_yield()
-	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED)
+	if (xchg(&thiscpu->cpu_status, CPU_STARTED) == CPU_HALTED) {
 		lock_kernel();
+		thiscpu->cpu_wakeup_pending = false;
+	}
 
 	// Check that interrupts are disabled.  If this assertion
 	// fails, DO NOT be tempted to fix it by inserting a "cli" in
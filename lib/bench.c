@@ -0,0 +1,105 @@
+// Helpers for the user/bench* benchmarks, which would otherwise each
+// carry a copy of them.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+// The spinner's count, on a page it shares with whoever forked it
+static volatile uint32_t spins[PGSIZE / 4] __attribute__((aligned(PGSIZE)));
+
+static char readbuf[BLKSIZE];
+
+// Fork a child that calls fn(arg) and then exits.  Returns the child's
+// env id to the parent.
+envid_t
+bench_fork(void (*fn)(void *), void *arg)
+{
+	envid_t who;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		fn(arg);
+		exit();
+	}
+	return who;
+}
+
+static void
+spinner(void *arg)
+{
+	for (;;)
+		spins[0]++;
+}
+
+// Fork a child that does nothing but count, so that how far it gets
+// (see bench_spins) shows how much CPU time everything else left over.
+envid_t
+bench_spinner(void)
+{
+	int r;
+
+	if ((r = sys_page_alloc(0, (void *) spins,
+				PTE_P|PTE_U|PTE_W|PTE_SHARE)) < 0)
+		panic("sys_page_alloc: %e", r);
+	return bench_fork(spinner, NULL);
+}
+
+// Return how far the spinner has counted.
+uint32_t
+bench_spins(void)
+{
+	return spins[0];
+}
+
+// Busy-wait for 'n' turns of an empty loop.
+void
+bench_delay(uint32_t n)
+{
+	volatile uint32_t i;
+
+	for (i = 0; i < n; i++)
+		;
+}
+
+// Return the cycles per round of 'n' rounds that began when the time
+// stamp counter read 'start'.
+uint32_t
+bench_cycles(uint64_t start, uint32_t n)
+{
+	return (read_tsc() - start) / n;
+}
+
+// Set the file server's cache limit to 'maxblocks' blocks.  Returns the
+// limit before.
+uint32_t
+bench_cache_limit(uint32_t maxblocks)
+{
+	struct BcStat stat;
+	uint32_t limit;
+	int r;
+
+	if ((r = cachestat(0, &stat)) < 0)
+		panic("cachestat: %e", r);
+	limit = stat.bs_maxblocks;
+	if ((r = cachestat(maxblocks, &stat)) < 0)
+		panic("cachestat: %e", r);
+	return limit;
+}
+
+// Read all of 'path' and throw it away.  Returns the number of bytes read.
+size_t
+bench_readfile(const char *path)
+{
+	size_t total;
+	int fd, r;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	for (total = 0; (r = read(fd, readbuf, sizeof(readbuf))) > 0; )
+		total += r;
+	if (r < 0)
+		panic("read %s: %e", path, r);
+	close(fd);
+	return total;
+}
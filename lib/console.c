@@ -38,6 +38,7 @@ static ssize_t devcons_read(struct Fd*, void*, size_t);
 static ssize_t devcons_write(struct Fd*, const void*, size_t);
 static int devcons_close(struct Fd*);
 static int devcons_stat(struct Fd*, struct Stat*);
+static int devcons_poll(struct Fd*, int, struct FutexWaitv*);
 
 struct Dev devcons =
 {
@@ -46,9 +47,13 @@ struct Dev devcons =
 	.dev_read =	devcons_read,
 	.dev_write =	devcons_write,
 	.dev_close =	devcons_close,
-	.dev_stat =	devcons_stat
+	.dev_stat =	devcons_stat,
+	.dev_poll =	devcons_poll
 };
 
+// A character devcons_poll took to see if there was one
+static int peekc;
+
 int
 iscons(int fdnum)
 {
@@ -79,12 +84,17 @@ static ssize_t
 devcons_read(struct Fd *fd, void *vbuf, size_t n)
 {
 	int c;
+	struct FutexWaitv wait = { NULL, 0 };
 
 	if (n == 0)
 		return 0;
 
-	while ((c = sys_cgetc()) == 0)
-		sys_yield();
+	if ((c = peekc) != 0)
+		peekc = 0;
+	else
+		// sleep until a key comes in
+		while ((c = sys_cgetc()) == 0)
+			sys_futex_waitv(&wait, 1, 0);
 	if (c < 0)
 		return c;
 	if (c == 0x04)	// ctl-d is eof
@@ -111,6 +121,20 @@ devcons_write(struct Fd *fd, const void *vbuf, size_t n)
 	return tot;
 }
 
+static int
+devcons_poll(struct Fd *fd, int events, struct FutexWaitv *wait)
+{
+	int revents = events & POLLOUT;
+
+	if ((events & POLLIN) && (peekc != 0 || (peekc = sys_cgetc()) != 0))
+		revents |= POLLIN;
+	if (!revents) {
+		wait->fw_addr = NULL;
+		wait->fw_val = 0;
+	}
+	return revents;
+}
+
 static int
 devcons_close(struct Fd *fd)
 {
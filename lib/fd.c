@@ -5,12 +5,12 @@
 // Maximum number of file descriptors a program may hold open concurrently
 #define MAXFD		32
 
-// Bottom of file data area.  We reserve one data page for each FD,
-// which devices can use if they choose.
+// Bottom of file data area.  We reserve FDDATASIZE bytes of data pages
+// for each FD, which devices can use if they choose.
 #define FILEDATA	(FDTABLE + MAXFD*PGSIZE)
 
-// Return the file data page for file descriptor index i
-#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*PGSIZE))
+// Return the file data area for file descriptor index i
+#define INDEX2DATA(i)	((char*) (FILEDATA + (i)*FDDATASIZE))
 
 
 // --------------------------------------------------------------
@@ -181,6 +181,7 @@ int
 dup(int oldfdnum, int newfdnum)
 {
 	int r;
+	size_t off;
 	char *ova, *nva;
 	pte_t pte;
 	struct Fd *oldfd, *newfd;
@@ -193,9 +194,13 @@ dup(int oldfdnum, int newfdnum)
 	ova = fd2data(oldfd);
 	nva = fd2data(newfd);
 
-	if ((uvpd[PDX(ova)] & PTE_P) && (uvpt[PGNUM(ova)] & PTE_P))
-		if ((r = sys_page_map(0, ova, 0, nva, uvpt[PGNUM(ova)] & PTE_SYSCALL)) < 0)
-			goto err;
+	// Map the data before the fd, so that a device never sees more
+	// references to the fd page than to its data (see pipeisclosed)
+	for (off = 0; off < FDDATASIZE; off += PGSIZE)
+		if ((uvpd[PDX(ova + off)] & PTE_P) && (uvpt[PGNUM(ova + off)] & PTE_P))
+			if ((r = sys_page_map(0, ova + off, 0, nva + off,
+					      uvpt[PGNUM(ova + off)] & PTE_SYSCALL)) < 0)
+				goto err;
 	if ((r = sys_page_map(0, oldfd, 0, newfd, uvpt[PGNUM(oldfd)] & PTE_SYSCALL)) < 0)
 		goto err;
 
@@ -203,7 +208,8 @@ dup(int oldfdnum, int newfdnum)
 
 err:
 	sys_page_unmap(0, newfd);
-	sys_page_unmap(0, nva);
+	for (off = 0; off < FDDATASIZE; off += PGSIZE)
+		sys_page_unmap(0, nva + off);
 	return r;
 }
 
@@ -313,6 +319,59 @@ fstat(int fdnum, struct Stat *stat)
 	return (*dev->dev_stat)(fd, stat);
 }
 
+// Wait until one of the 'nfds' file descriptors in 'fds' is ready for
+// one of its 'events', and set each one's 'revents' to what it is ready
+// for.  Entries with a negative fd are skipped.  Devices without a
+// dev_poll hook are always ready.  'timeout' is the
+// longest to wait in milliseconds: 0 to return at once, or negative to
+// wait as long as it takes.
+//
+// Returns the number of fds with nonzero revents, or < 0 on error.
+int
+poll(struct pollfd *fds, int nfds, int timeout)
+{
+	struct FutexWaitv wait[FUTEX_MAXWAIT];
+	struct Dev *dev;
+	struct Fd *fd;
+	int i, nready, nwait;
+	unsigned int now, deadline = 0;
+
+	if (nfds < 0 || nfds > FUTEX_MAXWAIT)
+		return -E_INVAL;
+	if (timeout > 0)
+		deadline = sys_time_msec() + timeout;
+
+	while (1) {
+		nready = nwait = 0;
+		for (i = 0; i < nfds; i++) {
+			if (fds[i].fd < 0) {
+				fds[i].revents = 0;
+				continue;
+			}
+			if (fd_lookup(fds[i].fd, &fd) < 0
+			    || dev_lookup(fd->fd_dev_id, &dev) < 0)
+				fds[i].revents = POLLNVAL;
+			else if (!dev->dev_poll)
+				fds[i].revents = fds[i].events & (POLLIN|POLLOUT);
+			else
+				fds[i].revents = (*dev->dev_poll)(fd, fds[i].events,
+								  &wait[nwait]);
+			if (fds[i].revents)
+				nready++;
+			else
+				nwait++;
+		}
+		if (nready || timeout == 0 || nwait == 0)
+			return nready;
+		if (timeout > 0 && (int) (deadline - (now = sys_time_msec())) <= 0)
+			return 0;
+		// A failed wait means something changed; look again
+		if (sys_futex_waitv(wait, nwait, timeout > 0 ?
+				    (uint64_t) (deadline - now) * 1000000 : 0) == -E_TIMEOUT)
+			return 0;
+	}
+}
+
 int
 stat(const char *path, struct Stat *stat)
 {
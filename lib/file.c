@@ -4,29 +4,116 @@
 
 #define debug 0
 
+// Writes up to this many bytes go to the server by kernel byte copy
+#define FSIPC_COPYMAX	2048
+
 union Fsipc fsipcbuf __attribute__((aligned(PGSIZE)));
 
-// Send an inter-environment request to the file server, and wait for
+// The file servers, in envs[] order.  The first one, the primary, does
+// everything; the others serve files opened read-only (see fs/peer.c).
+static envid_t fsenvs[FS_NSERVERS];
+static uint32_t nfsenvs;
+
+// The server this env's read-only opens go to, or -1 to pick by env id
+static int fsreadsrv = -1;
+
+// Return the env id of file server 'srv', or of the primary if there is
+// no such server.
+static envid_t
+fsserver(uint32_t srv)
+{
+	int i;
+
+	if (nfsenvs == 0)
+		for (i = 0; i < NENV && nfsenvs < FS_NSERVERS; i++)
+			if (envs[i].env_type == ENV_TYPE_FS)
+				fsenvs[nfsenvs++] = envs[i].env_id;
+	return fsenvs[srv < nfsenvs ? srv : 0];
+}
+
+// The fsipcbuf page doubles as a channel to each file server: once the
+// server keeps it mapped (FSREQ_CHANNEL), requests only name their type
+// and neither side maps or unmaps anything.  Fork gives the child, and
+// on its next write the parent, a new physical page, so the channel is
+// tied to the env and the page it was set up with.
+static envid_t fschan_env[FS_NSERVERS];
+static physaddr_t fschan_pa[FS_NSERVERS];
+
+// Send an inter-environment request to file server 'srv', and wait for
 // a reply.  The request body should be in fsipcbuf, and parts of the
 // response may be written back to fsipcbuf.
 // type: request code, passed as the simple integer IPC value.
 // dstva: virtual address at which to receive reply page, 0 if none.
 // Returns result from the file server.
 static int
-fsipc(unsigned type, void *dstva)
+fsipc(uint32_t srv, unsigned type, void *dstva)
 {
-	static envid_t fsenv;
-	if (fsenv == 0)
-		fsenv = ipc_find_env(ENV_TYPE_FS);
+	envid_t fsenv;
+	physaddr_t pa;
+	int r, tries;
+
+	fsenv = fsserver(srv);
+	if (srv >= nfsenvs)
+		srv = 0;
 
 	static_assert(sizeof(fsipcbuf) == PGSIZE);
 
 	if (debug)
 		cprintf("[%08x] fsipc %d %08x\n", thisenv->env_id, type, *(uint32_t *)&fsipcbuf);
 
-	ipc_send(fsenv, type, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	// The caller has written the request, so fsipcbuf is a private
+	// writable page by now.  Set up the channel if it isn't (still)
+	// this page; if the server can't, send the page along as before.
+	// A server that doesn't know our channel (it may have been
+	// restarted) refuses the request with -E_NOCHAN, so then set the
+	// channel up again and resend, once.
+	pa = PTE_ADDR(uvpt[PGNUM(&fsipcbuf)]);
+	for (tries = 0; ; tries++) {
+		if (fschan_env[srv] != thisenv->env_id || fschan_pa[srv] != pa) {
+			fschan_env[srv] = 0;
+			if (ipc_call(fsenv, FSREQ_CHANNEL, &fsipcbuf,
+				     PTE_P | PTE_W | PTE_U, NULL, NULL) < 0)
+				return ipc_call(fsenv, type, &fsipcbuf,
+						PTE_P | PTE_W | PTE_U, dstva, NULL);
+			fschan_env[srv] = thisenv->env_id;
+			fschan_pa[srv] = pa;
+		}
+
+		r = ipc_call(fsenv, type | FSREQ_ONCHAN, NULL, 0, dstva, NULL);
+		if (r != -E_NOCHAN || tries > 0)
+			return r;
+		fschan_env[srv] = 0;
+	}
+}
+
+// Send a request small enough to fit in the IPC inline words to file
+// server 'srv', and wait for a reply.  No page changes hands, so this
+// skips the mapping work fsipc does for fsipcbuf.  The server decodes
+// the words in serve_words.
+static int
+fsipc_words(uint32_t srv, unsigned type, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+	uint32_t words[IPC_NWORDS] = { w0, w1, w2 };
+
+	if (debug)
+		cprintf("[%08x] fsipc_words %d %08x %08x %08x\n",
+			thisenv->env_id, type, w0, w1, w2);
+
+	return ipc_call_words(fsserver(srv), type, words);
+}
+
+// Send the first 'len' bytes of the request in fsipcbuf to file server
+// 'srv' by kernel byte copy, and wait for a reply.  Unlike fsipc, no
+// page gets mapped for the request; this pays off for requests much
+// smaller than a page, such as path names and small writes.
+// dstva: virtual address at which to receive reply page, 0 if none.
+static int
+fsipc_buf(uint32_t srv, unsigned type, size_t len, void *dstva)
+{
+	if (debug)
+		cprintf("[%08x] fsipc_buf %d %d\n", thisenv->env_id, type, len);
 
-	return ipc_recv(NULL, dstva, NULL);
+	return ipc_call_buf(fsserver(srv), type, &fsipcbuf, len, dstva, NULL);
 }
 
 static int devfile_flush(struct Fd *fd);
@@ -34,6 +121,7 @@ static ssize_t devfile_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devfile_write(struct Fd *fd, const void *buf, size_t n);
 static int devfile_stat(struct Fd *fd, struct Stat *stat);
 static int devfile_trunc(struct Fd *fd, off_t newsize);
+static int devfile_poll(struct Fd *fd, int events, struct FutexWaitv *wait);
 
 struct Dev devfile =
 {
@@ -43,7 +131,8 @@ struct Dev devfile =
 	.dev_write =	devfile_write,
 	.dev_close =	devfile_flush,
 	.dev_stat =	devfile_stat,
-	.dev_trunc =	devfile_trunc
+	.dev_trunc =	devfile_trunc,
+	.dev_poll =	devfile_poll
 };
 
 // Open a file (or directory).
@@ -70,6 +159,7 @@ open(const char *path, int mode)
 	// file descriptor.
 
 	int r;
+	uint32_t srv;
 	struct Fd *fd;
 
 	if (strlen(path) >= MAXPATHLEN)
@@ -81,7 +171,16 @@ open(const char *path, int mode)
 	strcpy(fsipcbuf.open.req_path, path);
 	fsipcbuf.open.req_omode = mode;
 
-	if ((r = fsipc(FSREQ_OPEN, fd)) < 0) {
+	// Any file server can open a file for reading, so spread clients
+	// over them; the rest goes to the primary.  Later requests on the
+	// file go where its id says.
+	srv = 0;
+	if ((mode & (O_ACCMODE|O_CREAT|O_TRUNC|O_MKDIR)) == O_RDONLY &&
+	    fsserver(0) && nfsenvs > 1)
+		srv = (fsreadsrv >= 0 ? fsreadsrv : ENVX(thisenv->env_id)) %
+			nfsenvs;
+
+	if ((r = fsipc_buf(srv, FSREQ_OPEN, sizeof(fsipcbuf.open), fd)) < 0) {
 		fd_close(fd, 0);
 		return r;
 	}
@@ -100,11 +199,12 @@ open(const char *path, int mode)
 static int
 devfile_flush(struct Fd *fd)
 {
-	fsipcbuf.flush.req_fileid = fd->fd_file.id;
-	fsipcbuf.flush.req_length = 0;
-	fsipcbuf.flush.req_offset = 0;
-	fsipcbuf.flush.req_force = false;
-	return fsipc(FSREQ_FLUSH, NULL);
+	int r;
+
+	// The server says how many blocks it wrote; close just succeeds
+	r = fsipc_words(FSID_SERVER(fd->fd_file.id), FSREQ_FLUSH,
+			fd->fd_file.id, 0, 0);
+	return r < 0 ? r : 0;
 }
 
 // Read at most 'n' bytes from 'fd' at the current position into 'buf'.
@@ -123,7 +223,7 @@ devfile_read(struct Fd *fd, void *buf, size_t n)
 
 	fsipcbuf.read.req_fileid = fd->fd_file.id;
 	fsipcbuf.read.req_n = n;
-	if ((r = fsipc(FSREQ_READ, NULL)) < 0)
+	if ((r = fsipc(FSID_SERVER(fd->fd_file.id), FSREQ_READ, NULL)) < 0)
 		return r;
 	assert(r <= n);
 	assert(r <= PGSIZE);
@@ -145,10 +245,18 @@ devfile_write(struct Fd *fd, const void *buf, size_t n)
 	// bytes than requested.
 	int r;
 
+	n = MIN(n, sizeof(fsipcbuf.write.req_buf));
 	fsipcbuf.write.req_fileid = fd->fd_file.id;
 	fsipcbuf.write.req_n = n;
-	memmove(&fsipcbuf.write.req_buf, buf, MIN(PGSIZE-sizeof(int)+sizeof(size_t), n));
-	if ((r = fsipc(FSREQ_WRITE, NULL)) < 0)
+	memmove(&fsipcbuf.write.req_buf, buf, n);
+
+	// Small writes are cheaper to copy than to map
+	if (n <= FSIPC_COPYMAX)
+		r = fsipc_buf(FSID_SERVER(fd->fd_file.id), FSREQ_WRITE,
+			      offsetof(struct Fsreq_write, req_buf) + n, NULL);
+	else
+		r = fsipc(FSID_SERVER(fd->fd_file.id), FSREQ_WRITE, NULL);
+	if (r < 0)
 		return r;
 	assert(r <= n);
 	assert(r <= PGSIZE);
@@ -162,7 +270,7 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 	int r;
 
 	fsipcbuf.stat.req_fileid = fd->fd_file.id;
-	if ((r = fsipc(FSREQ_STAT, NULL)) < 0)
+	if ((r = fsipc(FSID_SERVER(fd->fd_file.id), FSREQ_STAT, NULL)) < 0)
 		return r;
 	strcpy(st->st_name, fsipcbuf.statRet.ret_name);
 	st->st_size = fsipcbuf.statRet.ret_size;
@@ -174,9 +282,22 @@ devfile_stat(struct Fd *fd, struct Stat *st)
 static int
 devfile_trunc(struct Fd *fd, off_t newsize)
 {
-	fsipcbuf.set_size.req_fileid = fd->fd_file.id;
-	fsipcbuf.set_size.req_size = newsize;
-	return fsipc(FSREQ_SET_SIZE, NULL);
+	return fsipc_words(FSID_SERVER(fd->fd_file.id), FSREQ_SET_SIZE,
+			   fd->fd_file.id, newsize, 0);
+}
+
+// A regular file can always be read (if only to find its end) and
+// written without waiting, so it is always ready.
+static int
+devfile_poll(struct Fd *fd, int events, struct FutexWaitv *wait)
+{
+	int revents = events & (POLLIN|POLLOUT);
+
+	if (!revents) {
+		wait->fw_addr = NULL;
+		wait->fw_val = 0;
+	}
+	return revents;
 }
 
 // Delete a file
@@ -186,17 +307,60 @@ remove(const char *path)
 	if (strlen(path) >= MAXPATHLEN)
 		return -E_BAD_PATH;
 	strcpy(fsipcbuf.remove.req_path, path);
-	return fsipc(FSREQ_REMOVE, NULL);
+	return fsipc_buf(0, FSREQ_REMOVE, strlen(path) + 1, NULL);
 }
 
-// Synchronize disk with buffer cache
+// Synchronize disk with buffer cache.
+// Returns the number of blocks written, < 0 on error.
 int
 sync(void)
 {
 	// Ask the file server to update the disk
 	// by writing any dirty blocks in the buffer cache.
 
-	return fsipc(FSREQ_SYNC, NULL);
+	return fsipc_words(0, FSREQ_SYNC, 0, 0, 0);
+}
+
+// Get the file server's buffer cache counters, first setting its limit
+// to 'maxblocks' blocks unless that is 0.
+int
+cachestat(uint32_t maxblocks, struct BcStat *stat)
+{
+	int r;
+
+	fsipcbuf.cache.req_maxblocks = maxblocks;
+	if ((r = fsipc(0, FSREQ_CACHE, NULL)) < 0)
+		return r;
+	*stat = fsipcbuf.cacheRet.ret_stat;
+	return 0;
+}
+
+// Send this env's read-only opens to file server 'srv' from now on,
+// or spread them by env id again if 'srv' is negative.  Returns the
+// number of file servers.
+int
+fsreadserver(int srv)
+{
+	fsserver(0);
+	fsreadsrv = srv;
+	return nfsenvs;
+}
+
+// Make the file server move disk data with bus-master DMA if 'dma' is
+// true, or with programmed I/O.  Returns -E_NOT_SUPP if the disk
+// controller cannot do DMA.
+int
+diskdma(bool dma)
+{
+	return fsipc_words(0, FSREQ_DISKDMA, dma, 0, 0);
+}
+
+// Make the file server allocate blocks with its next-fit extent
+// allocator if 'fast' is true, or with a plain first-fit one, to compare.
+int
+allocmode(bool fast)
+{
+	return fsipc_words(0, FSREQ_ALLOCMODE, fast, 0, 0);
 }
 
 // Request a file block to a given address
@@ -210,23 +374,111 @@ request_block(int fileid, off_t offset, void * dstva, uint32_t perm)
 	fsipcbuf.breq.req_fileid = fileid;
 	fsipcbuf.breq.req_offset = offset;
 	fsipcbuf.breq.req_perm = perm;
+	fsipcbuf.breq.req_nblocks = 1;
 
 	// and send it to the file system
-	return fsipc(FSREQ_BREQ, dstva);
+	return fsipc(FSID_SERVER(fileid), FSREQ_BREQ, dstva);
+}
+
+// Request up to 'nblocks' consecutive file blocks starting at 'offset',
+// mapped one after another from 'dstva' on, in a single round trip.
+// Fewer blocks arrive if the file ends first.
+//
+// Returns the number of blocks mapped, or < 0 on error.
+int
+request_blocks(int fileid, off_t offset, void *dstva, uint32_t perm,
+	       size_t nblocks)
+{
+	envid_t fsenv;
+	size_t npages;
+	int r;
+
+	if (nblocks <= 1)
+		return request_block(fileid, offset, dstva, perm) < 0 ? -E_INVAL : 1;
+	fsenv = fsserver(FSID_SERVER(fileid));
+
+	fsipcbuf.breq.req_fileid = fileid;
+	fsipcbuf.breq.req_offset = offset;
+	fsipcbuf.breq.req_perm = perm;
+	fsipcbuf.breq.req_nblocks = nblocks;
+
+	// The blocks come back as a vector message, so this can't be
+	//  an ipc_call.
+	ipc_send(fsenv, FSREQ_BREQ, &fsipcbuf, PTE_P | PTE_W | PTE_U);
+	if ((r = ipc_recv_window(fsenv, NULL, dstva, nblocks, &npages)) < 0)
+		return r;
+	return npages;
 }
 
-// Request a segment of a file tobe flushed to disk
+// Copy up to 'count' bytes from the current position of file 'infd' to
+// 'outfd', advancing the position past them.  Rather than going through
+// fsipcbuf and a user buffer, the file server's cache blocks are mapped
+// read-only into infd's data area and written to outfd straight from
+// there; for a pipe, that is a single copy into the ring.
 //
-// Returns -E_INVAL if length and offset aren't sane
+// Returns the number of bytes moved, or < 0 if none could be.
+ssize_t
+sendfile(int outfd, int infd, size_t count)
+{
+	struct Fd *fd;
+	struct Stat st;
+	char *va;
+	off_t off, blk;
+	size_t total, n, done;
+	int r, nblocks;
+
+	if ((r = fd_lookup(infd, &fd)) < 0)
+		return r;
+	if (fd->fd_dev_id != devfile.dev_id)
+		return -E_INVAL;
+	if ((r = fstat(infd, &st)) < 0)
+		return r;
+
+	va = fd2data(fd);
+	off = fd->fd_offset;
+	count = MIN(count, (size_t) MAX(st.st_size - off, 0));
+	for (total = 0; total < count; total += n) {
+		blk = ROUNDDOWN(off, BLKSIZE);
+		nblocks = MIN(ROUNDUP(off + count - total, BLKSIZE) - blk,
+			      FDDATASIZE) / BLKSIZE;
+		if ((r = request_blocks(fd->fd_file.id, blk, va, PTE_P|PTE_U,
+					nblocks)) <= 0)
+			break;
+		n = MIN(r*BLKSIZE - (off - blk), count - total);
+		for (done = 0; done < n; done += r)
+			if ((r = write(outfd, va + (off - blk) + done, n - done)) <= 0)
+				break;
+		for (blk = 0; blk < nblocks; blk++)
+			sys_page_unmap(0, va + blk*PGSIZE);
+		off += done;
+		fd->fd_offset = off;
+		if (done < n) {
+			total += done;
+			break;
+		}
+	}
+	return total ? total : r;
+}
+
+// Request a segment of a file tobe flushed to disk, the whole file if
+// 'length' is 0
+//
+// Returns the number of blocks written,
+// or -E_INVAL if length and offset aren't sane
 int
 flush(int fileid, size_t length, off_t offset, bool force)
 {
 	if(length < 0) return -E_INVAL;
 
+	// Unforced flushes fit in the IPC words (see serve_words)
+	if(!force)
+		return fsipc_words(FSID_SERVER(fileid), FSREQ_FLUSH, fileid,
+				   offset, length);
+
 	fsipcbuf.flush.req_fileid = fileid;
 	fsipcbuf.flush.req_length = length;
 	fsipcbuf.flush.req_offset = offset;
 	fsipcbuf.flush.req_force = force;
 
-	return fsipc(FSREQ_FLUSH, NULL);
+	return fsipc(FSID_SERVER(fileid), FSREQ_FLUSH, NULL);
 }
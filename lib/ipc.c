@@ -1,6 +1,7 @@
 // User-level IPC library routines
 
 #include <inc/lib.h>
+#include <inc/x86.h>
 
 // Receive a value via IPC and return it.
 // If 'pg' is nonnull, then any page sent by the sender will be mapped at
@@ -36,6 +37,15 @@ ipc_recv(envid_t *from_env_store, void *pg, int *perm_store)
 // Errors and parameters are otherwise as in ipc_recv
 int32_t
 ipc_recv_src(envid_t source, envid_t *from_env_store, void *pg, int *perm_store)
+{
+	return ipc_recv_timeout(source, from_env_store, pg, perm_store, 0);
+}
+
+// Like ipc_recv_src, but give up and return -E_TIMEOUT if nothing
+// arrives within 'timeout' nanoseconds.  A 'timeout' of 0 waits forever.
+int32_t
+ipc_recv_timeout(envid_t source, envid_t *from_env_store, void *pg,
+		 int *perm_store, uint64_t timeout)
 {
 	int32_t retval;
 
@@ -43,7 +53,7 @@ ipc_recv_src(envid_t source, envid_t *from_env_store, void *pg, int *perm_store)
 	if(pg == NULL) pg = (void *)(-1);
 
 	// Attempt the system call
-	if((retval = sys_ipc_recv(source, pg)) != 0) {
+	if((retval = sys_ipc_recv_timeout(source, pg, timeout)) != 0) {
 		// We failed, set values for non null pointers
 		if(from_env_store != 0) *from_env_store = 0;
 		if(perm_store != 0) *perm_store = 0;
@@ -61,11 +71,14 @@ ipc_recv_src(envid_t source, envid_t *from_env_store, void *pg, int *perm_store)
 }
 
 // Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'toenv'.
-// This function keeps trying until it succeeds.
-// It should panic() on any error other than -E_IPC_NOT_RECV.
+// This function blocks until the message has been received.
+// It should panic() on any error.
+//
+// The kernel parks us on the receiver's send queue instead of having us
+// spin on sys_ipc_try_send, so blocked senders cost no CPU time and are
+// served in the order they arrived.
 //
 // Hint:
-//   Use sys_yield() to be CPU-friendly.
 //   If 'pg' is null, pass sys_ipc_recv a value that it will understand
 //   as meaning "no page".  (Zero is not the right value.)
 void
@@ -76,10 +89,8 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	// If pg is NULL, set it to 0xFFFFFFFF, which is above UTOP
 	if(pg == NULL) pg = (void *)(-1);
 
-	// Begin the loop!
-	while((retval = sys_ipc_try_send(to_env, val, pg, perm)) == -E_IPC_NOT_RECV)
-		// Use sys_yield() to pause between each try
-		sys_yield();
+	// Block in the kernel until the receiver takes the message
+	retval = sys_ipc_send(to_env, val, pg, perm);
 
 	// If the return value was an error, panic!
 	if(retval == -E_BAD_ENV) panic("ipc_send called with a bad envid");
@@ -88,6 +99,382 @@ ipc_send(envid_t to_env, uint32_t val, void *pg, int perm)
 	if(retval != 0) panic("ipc_send failed with an unknown error");
 }
 
+// Receive either a message, as ipc_recv does, or notification bits set
+// with sys_notify, whichever comes first.
+//
+// If notifications arrive, every pending bit is stored in *notify_store
+// and cleared, 0 is returned, and *from_env_store and *perm_store are
+// set to 0.  If a message arrives, *notify_store is set to 0 and the
+// rest is as for ipc_recv.  'notify_store' must be nonnull.
+int32_t
+ipc_recv_notify(envid_t *from_env_store, void *pg, int *perm_store,
+		uint32_t *notify_store)
+{
+	int32_t retval;
+
+	if(pg == NULL) pg = (void *)(-1);
+
+	*notify_store = 0;
+	if((retval = sys_ipc_recv_notify(0, pg)) != 0) {
+		if(from_env_store != NULL) *from_env_store = 0;
+		if(perm_store != NULL) *perm_store = 0;
+		if(retval < 0)
+			return retval;
+		*notify_store = thisenv->env_notify_taken;
+		return 0;
+	}
+
+	if(from_env_store != NULL) *from_env_store = thisenv->env_ipc_from;
+	if(perm_store != NULL) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Send 'val' (and 'pg' with 'perm', if 'pg' is nonnull) to 'to_env' and
+// wait for its reply in a single system call.  The reply is received as
+// by ipc_recv_src(to_env, NULL, rcv_pg, perm_store), so only 'to_env'
+// can answer.
+//
+// When 'to_env' is already waiting for a message the kernel switches to
+// it directly, which makes this the cheapest way to talk to a server.
+//
+// Returns the reply value, or the error (storing 0 in *perm_store) if
+// the request could not be sent or 'to_env' went away before replying.
+int32_t
+ipc_call(envid_t to_env, uint32_t val, void *pg, int perm,
+	 void *rcv_pg, int *perm_store)
+{
+	int32_t retval;
+
+	// NULL pages become 0xFFFFFFFF, which is above UTOP
+	if(pg == NULL) pg = (void *)(-1);
+	if(rcv_pg == NULL) rcv_pg = (void *)(-1);
+
+	if((retval = sys_ipc_call(to_env, val, pg, perm, rcv_pg)) != 0) {
+		if(perm_store != NULL) *perm_store = 0;
+		return retval;
+	}
+
+	if(perm_store != NULL) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Server side of ipc_call: reply to 'to_env' as ipc_send would, then
+// receive the next message from anyone as ipc_recv would.  Parameters
+// and return value are those of the two calls.
+//
+// If 'to_env' is not waiting for our reply (it used a plain ipc_send),
+// this falls back to a blocking ipc_send followed by ipc_recv.  Reply
+// errors panic, as in ipc_send.
+int32_t
+ipc_reply_recv(envid_t to_env, uint32_t val, void *pg, int perm,
+	       envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int32_t retval;
+
+	if(pg == NULL) pg = (void *)(-1);
+	if(rcv_pg == NULL) rcv_pg = (void *)(-1);
+
+	retval = sys_ipc_reply_recv(to_env, val, pg, perm, rcv_pg);
+	if(retval == -E_IPC_NOT_RECV) {
+		ipc_send(to_env, val, pg, perm);
+		return ipc_recv(from_env_store, rcv_pg, perm_store);
+	}
+
+	if(retval == -E_BAD_ENV) panic("ipc_reply_recv called with a bad envid");
+	if(retval == -E_INVAL) panic("ipc_reply_recv called with invalid parameters");
+	if(retval == -E_NO_MEM) panic("ipc_reply_recv ran out of memory");
+	if(retval != 0) panic("ipc_reply_recv failed with an unknown error");
+
+	if(from_env_store != NULL) *from_env_store = thisenv->env_ipc_from;
+	if(perm_store != NULL) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Send 'val' and the IPC_NWORDS words at 'words' to 'to_env' without a
+// page, blocking like ipc_send.  The receiver gets 'val' as usual and
+// the words in thisenv->env_ipc_words; no page is mapped at either end,
+// so this is much cheaper than passing a page for a few integers.
+// Panics on any error, as ipc_send does.
+void
+ipc_send_words(envid_t to_env, uint32_t val, const uint32_t *words)
+{
+	int retval;
+
+	retval = sys_ipc_send_words(to_env, val, words[0], words[1], words[2]);
+
+	if(retval == -E_BAD_ENV) panic("ipc_send_words called with a bad envid");
+	if(retval == -E_INVAL) panic("ipc_send_words called with invalid parameters");
+	if(retval != 0) panic("ipc_send_words failed with an unknown error");
+}
+
+// Like ipc_call, but the request is 'val' and the IPC_NWORDS words at
+// 'words' with no page, and no page is accepted with the reply.  Any
+// words sent with the reply are left in thisenv->env_ipc_words.
+// Returns the reply value, or the error.
+int32_t
+ipc_call_words(envid_t to_env, uint32_t val, const uint32_t *words)
+{
+	int32_t retval;
+
+	if((retval = sys_ipc_call_words(to_env, val, words[0], words[1], words[2])) != 0)
+		return retval;
+	return thisenv->env_ipc_value;
+}
+
+// Like ipc_reply_recv, but the reply is 'val' and the IPC_NWORDS words
+// at 'words', with no page.
+int32_t
+ipc_reply_recv_words(envid_t to_env, uint32_t val, const uint32_t *words,
+		     envid_t *from_env_store, void *rcv_pg, int *perm_store)
+{
+	int32_t retval;
+
+	if(rcv_pg == NULL) rcv_pg = (void *)(-1);
+
+	retval = sys_ipc_reply_recv_words(to_env, val, words, rcv_pg);
+	if(retval == -E_IPC_NOT_RECV) {
+		ipc_send_words(to_env, val, words);
+		return ipc_recv(from_env_store, rcv_pg, perm_store);
+	}
+
+	if(retval == -E_BAD_ENV) panic("ipc_reply_recv_words called with a bad envid");
+	if(retval == -E_INVAL) panic("ipc_reply_recv_words called with invalid parameters");
+	if(retval == -E_FAULT) panic("ipc_reply_recv_words called with bad words");
+	if(retval != 0) panic("ipc_reply_recv_words failed with an unknown error");
+
+	if(from_env_store != NULL) *from_env_store = thisenv->env_ipc_from;
+	if(perm_store != NULL) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Send 'val' and the runs of pages described by 'segs' to 'to_env' in
+// one message, blocking like ipc_send until 'to_env' receives it.  The
+// receiver gets the pages mapped one after another in the window it
+// passed to ipc_recv_window.
+// Returns 0 on success, < 0 on error (see sys_ipc_sendv).
+int
+ipc_sendv(envid_t to_env, uint32_t val, const struct IpcSeg *segs, int nsegs)
+{
+	return sys_ipc_sendv(to_env, val, segs, nsegs);
+}
+
+// Receive a message from 'from_env' (0 for anyone) as ipc_recv_src
+// does, accepting up to 'npages' pages mapped contiguously from 'pg'.
+// The number of pages that arrived is stored in *npages_store if it is
+// nonnull.  Returns the value sent, or the error.
+int32_t
+ipc_recv_window(envid_t from_env, envid_t *from_env_store, void *pg,
+		size_t npages, size_t *npages_store)
+{
+	int32_t retval;
+
+	if(pg == NULL) pg = (void *)(-1);
+
+	if((retval = sys_ipc_recv_window(from_env, pg, npages)) != 0) {
+		if(from_env_store != NULL) *from_env_store = 0;
+		if(npages_store != NULL) *npages_store = 0;
+		return retval;
+	}
+
+	if(from_env_store != NULL) *from_env_store = thisenv->env_ipc_from;
+	if(npages_store != NULL) *npages_store = thisenv->env_ipc_npages;
+	return thisenv->env_ipc_value;
+}
+
+// Register 'buf' as the buffer into which the kernel copies the bytes
+// of messages sent with ipc_send_buf or ipc_call_buf.  The registration
+// stays until replaced.  Each page of the buffer is written once first,
+// so that a copy-on-write mapping left by fork becomes a private
+// writable page the kernel can copy into.
+// Returns 0 on success, < 0 on error.
+int
+ipc_set_rcvbuf(void *buf, size_t len)
+{
+	char *p;
+
+	for (p = buf; p < (char *) buf + len; p = ROUNDDOWN(p + PGSIZE, PGSIZE))
+		*(volatile char *) p = *(volatile char *) p;
+	return sys_ipc_set_rcvbuf(buf, len);
+}
+
+// Send 'val' and a copy of the 'len' bytes at 'buf' to 'to_env',
+// blocking like ipc_send.  Panics on any error.
+void
+ipc_send_buf(envid_t to_env, uint32_t val, const void *buf, size_t len)
+{
+	int retval;
+
+	retval = sys_ipc_send_buf(to_env, val, buf, len);
+
+	if(retval == -E_BAD_ENV) panic("ipc_send_buf called with a bad envid");
+	if(retval == -E_INVAL) panic("ipc_send_buf called with invalid parameters");
+	if(retval == -E_FAULT) panic("ipc_send_buf called with a bad buffer");
+	if(retval != 0) panic("ipc_send_buf failed with an unknown error");
+}
+
+// Like ipc_call, but the request is 'val' and a copy of the 'len' bytes
+// at 'buf', with no page.  The reply may carry a page, mapped at
+// 'rcv_pg'.  Returns the reply value, or the error.
+int32_t
+ipc_call_buf(envid_t to_env, uint32_t val, const void *buf, size_t len,
+	     void *rcv_pg, int *perm_store)
+{
+	int32_t retval;
+
+	if(rcv_pg == NULL) rcv_pg = (void *)(-1);
+
+	if((retval = sys_ipc_call_buf(to_env, val, buf, len, rcv_pg)) != 0) {
+		if(perm_store != NULL) *perm_store = 0;
+		return retval;
+	}
+
+	if(perm_store != NULL) *perm_store = thisenv->env_ipc_perm;
+	return thisenv->env_ipc_value;
+}
+
+// Shared-memory message rings.
+//
+// The producer owns r_tail and the consumer owns r_head; each side only
+// reads the other's index, so no locks are needed.  One slot is always
+// left empty to tell a full ring from an empty one.
+//
+// A side that finds the ring empty (or full) sets its sleep flag, looks
+// again, and only then waits for its doorbell.  The other side clears
+// the flag with xchg after publishing its index and rings the doorbell
+// if it was set, so the doorbell is rung once per sleep rather than
+// once per message.  xchg is a full barrier, which keeps the index
+// store from being reordered after the flag load on either side.
+
+// Set up the page at 'ring' as a new, empty message ring with us as
+// the producer, and share it with 'consumer', which must be waiting in
+// ipcring_accept.  'ring' must be page-aligned and unmapped.
+// Returns 0 on success, < 0 on error.
+int
+ipcring_connect(struct IpcRing *ring, envid_t consumer)
+{
+	int r;
+
+	static_assert(sizeof(struct IpcRing) <= PGSIZE);
+
+	if ((r = sys_page_alloc(0, ring, PTE_P | PTE_U | PTE_W | PTE_SHARE)) < 0)
+		return r;
+	ring->r_producer = thisenv->env_id;
+	ring->r_consumer = consumer;
+	ring->r_head = ring->r_tail = 0;
+	ring->r_rsleep = ring->r_wsleep = 0;
+
+	ipc_send(consumer, 0, ring, PTE_P | PTE_U | PTE_W | PTE_SHARE);
+	return 0;
+}
+
+// Wait for a producer's ipcring_connect and map the ring it shares at
+// 'ring', which must be page-aligned.  The producer's envid is stored
+// in *producer_store if it is nonnull.
+// Returns 0 on success, -E_INVAL if the message carried no page.
+int
+ipcring_accept(struct IpcRing *ring, envid_t *producer_store)
+{
+	envid_t who;
+	int perm;
+
+	ipc_recv(&who, ring, &perm);
+	if (!(perm & PTE_P))
+		return -E_INVAL;
+	if (producer_store)
+		*producer_store = who;
+	return 0;
+}
+
+// Append the 'len' byte message 'msg' to the ring without blocking.
+// Returns 0 on success, -E_INVAL if 'len' exceeds IPCRING_MSGSIZE, or
+// -E_NO_MEM if the ring is full.
+int
+ipcring_try_send(struct IpcRing *ring, const void *msg, size_t len)
+{
+	uint32_t tail, next;
+
+	if (len > IPCRING_MSGSIZE)
+		return -E_INVAL;
+
+	tail = ring->r_tail;
+	next = (tail + 1) % IPCRING_NSLOTS;
+	if (next == ring->r_head)
+		return -E_NO_MEM;
+
+	ring->r_slot[tail].m_len = len;
+	memmove(ring->r_slot[tail].m_data, msg, len);
+
+	// x86 keeps stores in order; just keep the compiler from
+	// publishing the tail before the message.
+	asm volatile("" : : : "memory");
+	ring->r_tail = next;
+
+	if (xchg(&ring->r_rsleep, 0))
+		sys_env_doorbell(ring->r_consumer);
+	return 0;
+}
+
+// Append a message to the ring, sleeping while it is full.
+// Returns 0 on success, -E_INVAL if 'len' exceeds IPCRING_MSGSIZE.
+int
+ipcring_send(struct IpcRing *ring, const void *msg, size_t len)
+{
+	int r;
+
+	while ((r = ipcring_try_send(ring, msg, len)) == -E_NO_MEM) {
+		xchg(&ring->r_wsleep, 1);
+		if ((ring->r_tail + 1) % IPCRING_NSLOTS != ring->r_head) {
+			ring->r_wsleep = 0;
+			continue;
+		}
+		sys_doorbell_wait();
+	}
+	return r;
+}
+
+// Take the oldest message off the ring without blocking, copying it
+// into 'buf', which must hold IPCRING_MSGSIZE bytes.
+// Returns the message length, or -E_NOT_FOUND if the ring is empty.
+int
+ipcring_try_recv(struct IpcRing *ring, void *buf)
+{
+	uint32_t head, len;
+
+	head = ring->r_head;
+	if (head == ring->r_tail)
+		return -E_NOT_FOUND;
+	asm volatile("" : : : "memory");
+
+	len = MIN(ring->r_slot[head].m_len, IPCRING_MSGSIZE);
+	memmove(buf, ring->r_slot[head].m_data, len);
+
+	// Don't hand the slot back before we are done copying it
+	asm volatile("" : : : "memory");
+	ring->r_head = (head + 1) % IPCRING_NSLOTS;
+
+	if (xchg(&ring->r_wsleep, 0))
+		sys_env_doorbell(ring->r_producer);
+	return len;
+}
+
+// Take the oldest message off the ring, sleeping while it is empty.
+// Returns the message length.
+int
+ipcring_recv(struct IpcRing *ring, void *buf)
+{
+	int r;
+
+	while ((r = ipcring_try_recv(ring, buf)) == -E_NOT_FOUND) {
+		xchg(&ring->r_rsleep, 1);
+		if (ring->r_head != ring->r_tail) {
+			ring->r_rsleep = 0;
+			continue;
+		}
+		sys_doorbell_wait();
+	}
+	return r;
+}
+
 // Find the first environment of the given type.  We'll use this to
 // find special environments.
 // Returns 0 if no such environment exists.
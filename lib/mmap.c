@@ -6,6 +6,9 @@
 // fill fit on a single page.
 #define MAXMMAP	204
 
+// Number of pages a fault on a shared mapping brings in at once.
+#define FAULTAROUND	8
+
 // Struct for storing the metadata about each mmapped region.
 struct mmap_metadata {
 	int mmmd_fileid;
@@ -206,29 +209,34 @@ munmap(void *addr, size_t len)
 
 // Sync the mmapped regions within the given length and offset bounds
 // Currently, flags are ignored, and the function behaves as if the
-// the MS_SYNC flag has been passed.
+// the MS_SYNC flag has been passed.  Each region's part of the range
+// is flushed with one request, so the file server can write blocks
+// that are adjacent on disk together.
 int
 msync(void *addr, size_t length, int flags)
 {
 	struct mmap_metadata *mmmd;
-	uint32_t minaddr, maxaddr;
+	uint32_t minaddr, maxaddr, end;
 	int i, j;
 
 	// Calculate the start and end addresses
 	minaddr = (uint32_t)ROUNDDOWN(addr, PGSIZE);
 	maxaddr = (uint32_t)ROUNDUP(addr+length, PGSIZE);
 
-	for (j = minaddr; j < maxaddr; j += PGSIZE) {
+	for (j = minaddr; j < maxaddr; j = end) {
 		for (i = 0; i < MAXMMAP; i++) {
 			// Check if this slot has been allocated
 			if ((mmmd = INDEX2MMAP(i))->mmmd_endaddr == 0)
 				continue;
 
 			// Check to see if the page is in this address. If so,
-			//  sync the associated block.
+			//  sync the region's blocks from here to the end of
+			//  the range or the region, whichever comes first.
 			if (j >= mmmd->mmmd_startaddr && j < mmmd->mmmd_endaddr) {
+				end = MIN(maxaddr,
+					  ROUNDUP(mmmd->mmmd_endaddr, PGSIZE));
 				flush(mmmd->mmmd_fileid,
-				      1,
+				      end - j,
 				      mmmd->mmmd_fileoffset+j-mmmd->mmmd_startaddr,
 				      true);
 				break;
@@ -249,7 +257,7 @@ static void
 mmap_shared_handler(struct UTrapframe *utf)
 {
 	struct mmap_metadata *mmmd;
-	uint32_t err, i;
+	uint32_t err, i, n;
 	void *addr;
 
 	addr = (void *) utf->utf_fault_va;
@@ -272,10 +280,20 @@ mmap_shared_handler(struct UTrapframe *utf)
 	if ((err & 2) && !(mmmd->mmmd_perm & PTE_W))
 		panic("tried to write in a non-writeable mmapped region.\n");
 
+	// Fault in the following pages of the region along with this one,
+	// up to the first one that is already mapped.
+	for (n = 1; n < FAULTAROUND &&
+		    (uint32_t) addr + n * PGSIZE < mmmd->mmmd_endaddr; n++)
+		if ((uvpd[PDX(addr + n * PGSIZE)] & PTE_P) &&
+		    (uvpt[PGNUM(addr + n * PGSIZE)] & PTE_P))
+			break;
+
 	// So, it's either a read or write fault with appropriate perms, so
 	// make the request from the filesystem and panic if that fails.
-	if (request_block(mmmd->mmmd_fileid, mmmd->mmmd_fileoffset, addr,
-			  mmmd->mmmd_perm) < 0)
+	// The file server returns all the blocks in one vector message.
+	if (request_blocks(mmmd->mmmd_fileid, mmmd->mmmd_fileoffset +
+			   (uint32_t) addr - mmmd->mmmd_startaddr, addr,
+			   mmmd->mmmd_perm, n) < 0)
 		panic("request block failed in mmap handler.\n");
 }
 
@@ -311,7 +329,8 @@ mmap_private_handler(struct UTrapframe *utf)
 
 	// Request the file block only if we don't have it yet.
 	if ((!(uvpd[PDX(addr)]&PTE_P) || !(uvpt[PGNUM(addr)]&PTE_P)) &&
-	   request_block(mmmd->mmmd_fileid, mmmd->mmmd_fileoffset, addr,
+	   request_block(mmmd->mmmd_fileid, mmmd->mmmd_fileoffset +
+			 (uint32_t) addr - mmmd->mmmd_startaddr, addr,
 		   	 mmmd->mmmd_perm) < 0)
 		panic("request block failed in mmap handler.\n");
 
@@ -6,6 +6,7 @@ static ssize_t devpipe_read(struct Fd *fd, void *buf, size_t n);
 static ssize_t devpipe_write(struct Fd *fd, const void *buf, size_t n);
 static int devpipe_stat(struct Fd *fd, struct Stat *stat);
 static int devpipe_close(struct Fd *fd);
+static int devpipe_poll(struct Fd *fd, int events, struct FutexWaitv *wait);
 
 struct Dev devpipe =
 {
@@ -15,22 +16,51 @@ struct Dev devpipe =
 	.dev_write =	devpipe_write,
 	.dev_close =	devpipe_close,
 	.dev_stat =	devpipe_stat,
+	.dev_poll =	devpipe_poll,
 };
 
-#define PIPEBUFSIZ 32		// small to provoke races
+// pipe() makes pipes with a PIPEBUFSIZ-byte ring spread over several
+// pages after the Pipe header, so that a writer can hand a reader many
+// pages' worth of data per wakeup.  pipe_sized() makes pipes with other
+// ring sizes; a 32-byte ring, the size pipes used to be, is good for
+// provoking races.
+#define PIPEBUFSIZ	(16*PGSIZE)
 
 struct Pipe {
-	off_t p_rpos;		// read position
-	off_t p_wpos;		// write position
-	uint8_t p_buf[PIPEBUFSIZ];	// data buffer
+	volatile uint32_t p_rpos;	// read position
+	volatile uint32_t p_wpos;	// write position
+	volatile uint32_t p_seq;	// bumped whenever p_rpos or p_wpos moves
+	volatile uint32_t p_nwaiting;	// number of envs sleeping on p_seq
+	volatile uint32_t p_polled;	// someone may be polling on p_seq
+	uint32_t p_size;		// size of p_buf, a power of 2
+	uint8_t p_buf[];		// data ring, runs on into the following pages
 };
 
+// Number of data pages for a pipe with a 'bufsize'-byte ring
+#define PIPE_NPAGES(bufsize) \
+	(ROUNDUP(sizeof(struct Pipe) + (bufsize), PGSIZE) / PGSIZE)
+
 int
 pipe(int pfd[2])
+{
+	return pipe_sized(pfd, PIPEBUFSIZ);
+}
+
+// Make a pipe whose ring holds 'bufsize' bytes.  'bufsize' must be a
+// power of 2 small enough that the ring fits in the fd data area.
+int
+pipe_sized(int pfd[2], size_t bufsize)
 {
 	int r;
+	size_t i, npages;
 	struct Fd *fd0, *fd1;
-	void *va;
+	struct Pipe *p;
+	char *va;
+
+	if (bufsize == 0 || (bufsize & (bufsize - 1)) != 0
+	    || PIPE_NPAGES(bufsize) * PGSIZE > FDDATASIZE)
+		return -E_INVAL;
+	npages = PIPE_NPAGES(bufsize);
 
 	// allocate the file descriptor table entries
 	if ((r = fd_alloc(&fd0)) < 0
@@ -41,12 +71,18 @@ pipe(int pfd[2])
 	    || (r = sys_page_alloc(0, fd1, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
 		goto err1;
 
-	// allocate the pipe structure as first data page in both
+	// allocate the pipe structure and ring as the first data pages
+	// in both
 	va = fd2data(fd0);
-	if ((r = sys_page_alloc(0, va, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err2;
-	if ((r = sys_page_map(0, va, 0, fd2data(fd1), PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
-		goto err3;
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_alloc(0, va + i*PGSIZE, PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err2;
+	for (i = 0; i < npages; i++)
+		if ((r = sys_page_map(0, va + i*PGSIZE, 0, fd2data(fd1) + i*PGSIZE,
+				      PTE_P|PTE_W|PTE_U|PTE_SHARE)) < 0)
+			goto err3;
+	p = (struct Pipe *) va;
+	p->p_size = bufsize;
 
 	// set up fd structures
 	fd0->fd_dev_id = devpipe.dev_id;
@@ -63,8 +99,11 @@ pipe(int pfd[2])
 	return 0;
 
     err3:
-	sys_page_unmap(0, va);
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, fd2data(fd1) + i*PGSIZE);
     err2:
+	for (i = 0; i < npages; i++)
+		sys_page_unmap(0, va + i*PGSIZE);
 	sys_page_unmap(0, fd1);
     err1:
 	sys_page_unmap(0, fd0);
@@ -88,6 +127,18 @@ _pipeisclosed(struct Fd *fd, struct Pipe *p)
 	}
 }
 
+// Tell whoever is waiting on the other end that we moved p_rpos or p_wpos.
+// The wakeup system call is skipped when nobody is asleep.  Pollers
+// don't keep count, so they get one wakeup per poll.
+static void
+pipe_kick(struct Pipe *p)
+{
+	__sync_fetch_and_add(&p->p_seq, 1);
+	if (p->p_nwaiting
+	    || (p->p_polled && __sync_lock_test_and_set(&p->p_polled, 0)))
+		sys_futex_wake(&p->p_seq, ~0U);
+}
+
 int
 pipeisclosed(int fdnum)
 {
@@ -101,11 +152,31 @@ pipeisclosed(int fdnum)
 	return _pipeisclosed(fd, p);
 }
 
+// Copy 'n' bytes between 'buf' and the ring, starting at ring position
+// 'pos', wrapping around the end of the ring.
+static void
+pipe_copy(struct Pipe *p, uint32_t pos, uint8_t *buf, size_t n, bool toring)
+{
+	size_t off, m;
+
+	off = pos & (p->p_size - 1);
+	m = MIN(n, p->p_size - off);
+	if (toring) {
+		memcpy(p->p_buf + off, buf, m);
+		memcpy(p->p_buf, buf + m, n - m);
+	} else {
+		memcpy(buf, p->p_buf + off, m);
+		memcpy(buf + m, p->p_buf, n - m);
+	}
+	// the data must be in place before the position moves
+	__sync_synchronize();
+}
+
 static ssize_t
 devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 {
-	uint8_t *buf;
-	size_t i;
+	size_t m;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*)fd2data(fd);
@@ -113,34 +184,45 @@ devpipe_read(struct Fd *fd, void *vbuf, size_t n)
 		cprintf("[%08x] devpipe_read %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
-	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_rpos == p->p_wpos) {
-			// pipe is empty
-			// if we got any data, return it
-			if (i > 0)
-				return i;
-			// if all the writers are gone, note eof
-			if (_pipeisclosed(fd, p))
-				return 0;
-			// yield and see what happens
-			if (debug)
-				cprintf("devpipe_read yield\n");
-			sys_yield();
+	if (n == 0)
+		return 0;
+	while (p->p_rpos == p->p_wpos) {
+		// pipe is empty
+		// announce ourselves and take the sequence number before
+		// looking, so a write after we look makes the wait fail
+		__sync_fetch_and_add(&p->p_nwaiting, 1);
+		seq = p->p_seq;
+		if (p->p_rpos != p->p_wpos) {
+			__sync_fetch_and_sub(&p->p_nwaiting, 1);
+			break;
+		}
+		// if all the writers are gone, note eof
+		if (_pipeisclosed(fd, p)) {
+			__sync_fetch_and_sub(&p->p_nwaiting, 1);
+			return 0;
 		}
-		// there's a byte.  take it.
-		// wait to increment rpos until the byte is taken!
-		buf[i] = p->p_buf[p->p_rpos % PIPEBUFSIZ];
-		p->p_rpos++;
+		// sleep until a writer moves p_wpos or goes away
+		if (debug)
+			cprintf("devpipe_read wait\n");
+		sys_futex_wait(&p->p_seq, seq, 0);
+		__sync_fetch_and_sub(&p->p_nwaiting, 1);
 	}
-	return i;
+
+	// take everything that's there, up to n bytes.
+	// wait to increment rpos until the bytes are taken!
+	m = MIN(n, p->p_wpos - p->p_rpos);
+	pipe_copy(p, p->p_rpos, vbuf, m, 0);
+	p->p_rpos += m;
+	pipe_kick(p);
+	return m;
 }
 
 static ssize_t
 devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 {
-	const uint8_t *buf;
-	size_t i;
+	uint8_t *buf;
+	size_t i, m;
+	uint32_t seq;
 	struct Pipe *p;
 
 	p = (struct Pipe*) fd2data(fd);
@@ -148,24 +230,35 @@ devpipe_write(struct Fd *fd, const void *vbuf, size_t n)
 		cprintf("[%08x] devpipe_write %08x %d rpos %d wpos %d\n",
 			thisenv->env_id, uvpt[PGNUM(p)], n, p->p_rpos, p->p_wpos);
 
-	buf = vbuf;
-	for (i = 0; i < n; i++) {
-		while (p->p_wpos >= p->p_rpos + sizeof(p->p_buf)) {
+	buf = (uint8_t *) vbuf;
+	for (i = 0; i < n; i += m) {
+		while (p->p_wpos - p->p_rpos == p->p_size) {
 			// pipe is full
+			__sync_fetch_and_add(&p->p_nwaiting, 1);
+			seq = p->p_seq;
+			if (p->p_wpos - p->p_rpos != p->p_size) {
+				__sync_fetch_and_sub(&p->p_nwaiting, 1);
+				break;
+			}
 			// if all the readers are gone
 			// (it's only writers like us now),
 			// note eof
-			if (_pipeisclosed(fd, p))
+			if (_pipeisclosed(fd, p)) {
+				__sync_fetch_and_sub(&p->p_nwaiting, 1);
 				return 0;
-			// yield and see what happens
+			}
+			// sleep until a reader moves p_rpos or goes away
 			if (debug)
-				cprintf("devpipe_write yield\n");
-			sys_yield();
+				cprintf("devpipe_write wait\n");
+			sys_futex_wait(&p->p_seq, seq, 0);
+			__sync_fetch_and_sub(&p->p_nwaiting, 1);
 		}
-		// there's room for a byte.  store it.
-		// wait to increment wpos until the byte is stored!
-		p->p_buf[p->p_wpos % PIPEBUFSIZ] = buf[i];
-		p->p_wpos++;
+		// fill as much of the free space as we can.
+		// wait to increment wpos until the bytes are stored!
+		m = MIN(n - i, p->p_size - (p->p_wpos - p->p_rpos));
+		pipe_copy(p, p->p_wpos, buf + i, m, 1);
+		p->p_wpos += m;
+		pipe_kick(p);
 	}
 
 	return i;
@@ -182,10 +275,40 @@ devpipe_stat(struct Fd *fd, struct Stat *stat)
 	return 0;
 }
 
+static int
+devpipe_poll(struct Fd *fd, int events, struct FutexWaitv *wait)
+{
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	uint32_t seq;
+	int revents = 0;
+
+	// flag ourselves and take the sequence number before looking,
+	// as in devpipe_read
+	__sync_lock_test_and_set(&p->p_polled, 1);
+	seq = p->p_seq;
+	if ((events & POLLIN) && p->p_rpos != p->p_wpos)
+		revents |= POLLIN;
+	if ((events & POLLOUT) && p->p_wpos - p->p_rpos != p->p_size)
+		revents |= POLLOUT;
+	if (_pipeisclosed(fd, p))
+		revents |= POLLHUP;
+	if (!revents) {
+		wait->fw_addr = &p->p_seq;
+		wait->fw_val = seq;
+	}
+	return revents;
+}
+
 static int
 devpipe_close(struct Fd *fd)
 {
+	struct Pipe *p = (struct Pipe*) fd2data(fd);
+	size_t i;
+
+	// unmap the fd first and the Pipe header last, so that the fd
+	// never has more references than the header (see _pipeisclosed)
 	(void) sys_page_unmap(0, fd);
-	return sys_page_unmap(0, fd2data(fd));
+	for (i = PIPE_NPAGES(p->p_size) - 1; i > 0; i--)
+		(void) sys_page_unmap(0, (char *) p + i*PGSIZE);
+	return sys_page_unmap(0, p);
 }
-
@@ -105,6 +105,12 @@ sys_env_set_trapframe(envid_t envid, struct Trapframe *tf)
 	return syscall(SYS_env_set_trapframe, 1, envid, (uint32_t) tf, 0, 0, 0);
 }
 
+int
+sys_env_set_quantum(envid_t envid, uint32_t quantum)
+{
+	return syscall(SYS_env_set_quantum, 1, envid, quantum, 0, 0, 0);
+}
+
 int
 sys_env_set_pgfault_upcall(envid_t envid, void *upcall)
 {
@@ -129,8 +135,156 @@ sys_ipc_try_send(envid_t envid, uint32_t value, void *srcva, int perm)
 	return syscall(SYS_ipc_try_send, 0, envid, value, (uint32_t) srcva, perm, 0);
 }
 
+int
+sys_ipc_send(envid_t envid, uint32_t value, void *srcva, int perm)
+{
+	return syscall(SYS_ipc_send, 0, envid, value, (uint32_t) srcva, perm, 0);
+}
+
+int
+sys_ipc_call(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_call, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv(envid_t envid, uint32_t value, void *srcva, int perm, void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv, 0, envid, value, (uint32_t) srcva, perm, (uint32_t) dstva);
+}
+
+int
+sys_ipc_reply_recv_words(envid_t envid, uint32_t value, const uint32_t *words, void *dstva)
+{
+	return syscall(SYS_ipc_reply_recv_words, 0, envid, value, (uint32_t) words, (uint32_t) dstva, 0);
+}
+
+int
+sys_ipc_send_words(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+	return syscall(SYS_ipc_send_words, 0, envid, value, w0, w1, w2);
+}
+
+int
+sys_ipc_call_words(envid_t envid, uint32_t value, uint32_t w0, uint32_t w1, uint32_t w2)
+{
+	return syscall(SYS_ipc_call_words, 0, envid, value, w0, w1, w2);
+}
+
+int
+sys_env_doorbell(envid_t envid)
+{
+	return syscall(SYS_env_doorbell, 1, envid, 0, 0, 0, 0);
+}
+
+int
+sys_doorbell_wait(void)
+{
+	return syscall(SYS_doorbell_wait, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_ipc_try_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs, int nsegs)
+{
+	return syscall(SYS_ipc_try_sendv, 0, envid, value, (uint32_t) segs, nsegs, 0);
+}
+
+int
+sys_ipc_sendv(envid_t envid, uint32_t value, const struct IpcSeg *segs, int nsegs)
+{
+	return syscall(SYS_ipc_sendv, 0, envid, value, (uint32_t) segs, nsegs, 0);
+}
+
+int
+sys_ipc_recv_window(envid_t envid, void *dstva, size_t npages)
+{
+	return syscall(SYS_ipc_recv_window, 1, envid, (uint32_t) dstva, npages, 0, 0);
+}
+
+int
+sys_ipc_send_buf(envid_t envid, uint32_t value, const void *buf, size_t len)
+{
+	return syscall(SYS_ipc_send_buf, 0, envid, value, (uint32_t) buf, len, 0);
+}
+
+int
+sys_ipc_call_buf(envid_t envid, uint32_t value, const void *buf, size_t len, void *dstva)
+{
+	return syscall(SYS_ipc_call_buf, 0, envid, value, (uint32_t) buf, len, (uint32_t) dstva);
+}
+
+int
+sys_ipc_set_rcvbuf(void *buf, size_t len)
+{
+	return syscall(SYS_ipc_set_rcvbuf, 1, (uint32_t) buf, len, 0, 0, 0);
+}
+
+int
+sys_ipc_recv_notify(envid_t envid, void *dstva)
+{
+	return syscall(SYS_ipc_recv_notify, 0, envid, (uint32_t) dstva, 0, 0, 0);
+}
+
+int
+sys_notify(envid_t envid, uint32_t bits)
+{
+	return syscall(SYS_notify, 1, envid, bits, 0, 0, 0);
+}
+
+int
+sys_futex_wait(const volatile uint32_t *addr, uint32_t expected,
+	       uint64_t timeout)
+{
+	return syscall(SYS_futex_wait, 0, (uint32_t) addr, expected,
+		       (uint32_t) timeout, (uint32_t) (timeout >> 32), 0);
+}
+
+int
+sys_futex_wake(const volatile uint32_t *addr, uint32_t n)
+{
+	return syscall(SYS_futex_wake, 0, (uint32_t) addr, n, 0, 0, 0);
+}
+
+int
+sys_futex_waitv(const struct FutexWaitv *v, uint32_t n, uint64_t timeout)
+{
+	return syscall(SYS_futex_waitv, 0, (uint32_t) v, n,
+		       (uint32_t) timeout, (uint32_t) (timeout >> 32), 0);
+}
+
+int
+sys_sleep(uint64_t ns)
+{
+	return syscall(SYS_sleep, 0, (uint32_t) ns, (uint32_t) (ns >> 32), 0, 0, 0);
+}
+
+unsigned int
+sys_time_msec(void)
+{
+	return (unsigned int) syscall(SYS_time_msec, 0, 0, 0, 0, 0, 0);
+}
+
+int
+sys_page_phys(void *va)
+{
+	return syscall(SYS_page_phys, 0, (uint32_t) va, 0, 0, 0, 0);
+}
+
+int
+sys_irq_notify(int irq, uint32_t bits)
+{
+	return syscall(SYS_irq_notify, 1, irq, bits, 0, 0, 0);
+}
+
 int
 sys_ipc_recv(envid_t envid, void *dstva)
 {
 	return syscall(SYS_ipc_recv, 1, envid, (uint32_t)dstva, 0, 0, 0);
 }
+
+int
+sys_ipc_recv_timeout(envid_t envid, void *dstva, uint64_t timeout)
+{
+	return syscall(SYS_ipc_recv, 0, envid, (uint32_t)dstva,
+		       (uint32_t) timeout, (uint32_t) (timeout >> 32), 0);
+}
@@ -5,9 +5,11 @@ void
 wait(envid_t envid)
 {
 	const volatile struct Env *e;
+	uint32_t status;
 
 	assert(envid != 0);
 	e = &envs[ENVX(envid)];
-	while (e->env_id == envid && e->env_status != ENV_FREE)
-		sys_yield();
+	// env_free wakes anyone waiting on env_status once it is ENV_FREE
+	while (e->env_id == envid && (status = e->env_status) != ENV_FREE)
+		sys_futex_wait(&e->env_status, status, 0);
 }
@@ -0,0 +1,98 @@
+// Benchmark the file server's block allocator, next fit with extents and
+// goal blocks against plain first fit.  Create some files, then append to
+// two of them in turn, then read them all back with the buffer cache
+// shrunk.  The number of disk reads that takes shows how contiguous the
+// allocator kept the files, since only consecutive blocks are read ahead.
+
+#include <inc/lib.h>
+
+#define NFILES		4
+#define FILEBLOCKS	16
+#define CACHEBLOCKS	16
+
+static char buf[BLKSIZE];
+
+static int
+openfile(int i, int mode)
+{
+	char path[16];
+	int fd;
+
+	snprintf(path, sizeof(path), "/balloc%d", i);
+	if ((fd = open(path, mode)) < 0)
+		panic("open %s: %e", path, fd);
+	return fd;
+}
+
+static void
+writeblock(int fd)
+{
+	int r;
+
+	if ((r = write(fd, buf, BLKSIZE)) != BLKSIZE)
+		panic("write: %e", r);
+}
+
+static void
+run(const char *mode)
+{
+	struct BcStat before, after;
+	unsigned int start, create_ms, append_ms, read_ms;
+	uint32_t limit;
+	char path[16];
+	int i, j, fd[2], r;
+
+	start = sys_time_msec();
+	for (i = 0; i < NFILES; i++) {
+		fd[0] = openfile(i, O_RDWR|O_CREAT|O_TRUNC);
+		for (j = 0; j < FILEBLOCKS; j++)
+			writeblock(fd[0]);
+		close(fd[0]);
+	}
+	create_ms = sys_time_msec() - start;
+
+	start = sys_time_msec();
+	for (i = 0; i < 2; i++) {
+		fd[i] = openfile(i, O_RDWR);
+		seek(fd[i], FILEBLOCKS * BLKSIZE);
+	}
+	for (j = 0; j < 2 * FILEBLOCKS; j++)
+		writeblock(fd[j % 2]);
+	close(fd[0]);
+	close(fd[1]);
+	append_ms = sys_time_msec() - start;
+
+	limit = bench_cache_limit(CACHEBLOCKS);
+	if ((r = cachestat(0, &before)) < 0)
+		panic("cachestat: %e", r);
+	start = sys_time_msec();
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "/balloc%d", i);
+		bench_readfile(path);
+	}
+	read_ms = sys_time_msec() - start;
+	if ((r = cachestat(0, &after)) < 0)
+		panic("cachestat: %e", r);
+	bench_cache_limit(limit);
+
+	for (i = 0; i < NFILES; i++) {
+		snprintf(path, sizeof(path), "/balloc%d", i);
+		remove(path);
+	}
+	cprintf("%s: create %u ms, append %u ms, "
+		"read back with %u disk reads in %u ms\n", mode, create_ms,
+		append_ms, after.bs_misses - before.bs_misses, read_ms);
+}
+
+void
+umain(int argc, char **argv)
+{
+	int r;
+
+	if ((r = allocmode(true)) < 0)
+		panic("allocmode: %e", r);
+	run("next fit");
+	allocmode(false);
+	run("first fit");
+	allocmode(true);
+}
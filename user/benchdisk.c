@@ -0,0 +1,58 @@
+// Benchmark disk reads through the file server with DMA and with PIO.
+// With the buffer cache shrunk below the size of /sh, every pass over
+// the file goes to the disk.  A child that does nothing but count runs
+// alongside, so the count it reaches per millisecond shows how much CPU
+// the transfers leave to other environments.
+
+#include <inc/lib.h>
+
+#define NPASSES		20
+#define CACHEBLOCKS	16
+
+static void
+run(const char *mode)
+{
+	struct BcStat before, after;
+	uint32_t spin0, nblocks;
+	unsigned int start, ms;
+	int i, r;
+
+	if ((r = cachestat(0, &before)) < 0)
+		panic("cachestat: %e", r);
+	spin0 = bench_spins();
+	start = sys_time_msec();
+	for (i = 0; i < NPASSES; i++)
+		bench_readfile("/sh");
+	ms = MAX(sys_time_msec() - start, 1);
+	if ((r = cachestat(0, &after)) < 0)
+		panic("cachestat: %e", r);
+
+	nblocks = (after.bs_misses - before.bs_misses) +
+		(after.bs_readahead - before.bs_readahead);
+	cprintf("%s: %u blocks from disk in %u ms, %u KB/s, "
+		"%u spins/ms left over\n", mode, nblocks, ms,
+		nblocks * (BLKSIZE / 1024) * 1000 / ms,
+		(bench_spins() - spin0) / ms);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t spinner;
+	uint32_t limit;
+	int r;
+
+	spinner = bench_spinner();
+	limit = bench_cache_limit(CACHEBLOCKS);
+	if ((r = diskdma(true)) == 0)
+		run("DMA");
+	else
+		cprintf("DMA: %e\n", r);
+	if ((r = diskdma(false)) < 0)
+		panic("diskdma: %e", r);
+	run("PIO");
+
+	diskdma(true);
+	bench_cache_limit(limit);
+	sys_env_destroy(spinner);
+}
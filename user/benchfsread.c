@@ -0,0 +1,49 @@
+// Benchmark how read throughput scales with the number of file servers.
+// NREADERS children read /sh from the buffer cache at the same time,
+// spread over first one server, then two, and so on up to all of them.
+// Run with CPUS=4 FSSERVERS=4 so that there is a file server, and a
+// reader, per CPU.
+
+#include <inc/lib.h>
+
+#define NREADERS	FS_NSERVERS
+#define NPASSES		10
+
+static int nservers;
+
+static void
+reader(void *arg)
+{
+	int i;
+
+	fsreadserver((uint32_t) arg % nservers);
+	ipc_recv(0, 0, 0);
+	for (i = 0; i < NPASSES; i++)
+		bench_readfile("/sh");
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who[NREADERS];
+	unsigned int start, ms;
+	size_t size;
+	int i, n;
+
+	// Bring /sh into the cache, so only serving it is measured
+	size = bench_readfile("/sh");
+	n = fsreadserver(-1);
+	for (nservers = 1; nservers <= n; nservers++) {
+		for (i = 0; i < NREADERS; i++)
+			who[i] = bench_fork(reader, (void *) i);
+		start = sys_time_msec();
+		for (i = 0; i < NREADERS; i++)
+			ipc_send(who[i], 0, 0, 0);
+		for (i = 0; i < NREADERS; i++)
+			wait(who[i]);
+		ms = MAX(sys_time_msec() - start, 1);
+		cprintf("%d readers on %d servers: %u KB in %u ms, %u KB/s\n",
+			NREADERS, nservers, NREADERS * NPASSES * size / 1024, ms,
+			NREADERS * NPASSES * size / ms * 1000 / 1024);
+	}
+}
@@ -0,0 +1,62 @@
+// Benchmark pipe throughput.
+// A child reads a pipe until end of file while the parent writes NBYTES
+// into it in CHUNK-byte writes.  This is timed once with a 32-byte pipe,
+// the size pipes used to be, and once with a default pipe().
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NBYTES	(1024*1024)
+#define CHUNK	4096
+
+static char buf[CHUNK];
+
+static void
+reader(void *arg)
+{
+	int *p = arg, r;
+	size_t total;
+
+	close(p[1]);
+	total = 0;
+	while ((r = read(p[0], buf, sizeof(buf))) > 0)
+		total += r;
+	if (r < 0)
+		panic("read: %e", r);
+	if (total != NBYTES)
+		panic("read %d bytes, expected %d", total, NBYTES);
+}
+
+// Returns the cycles per KB.
+static uint32_t
+run(size_t bufsize)
+{
+	int p[2], r;
+	uint64_t start;
+	envid_t who;
+	size_t total;
+
+	if ((r = bufsize ? pipe_sized(p, bufsize) : pipe(p)) < 0)
+		panic("pipe: %e", r);
+	who = bench_fork(reader, p);
+
+	close(p[0]);
+	start = read_tsc();
+	for (total = 0; total < NBYTES; total += CHUNK)
+		if ((r = write(p[1], buf, CHUNK)) != CHUNK)
+			panic("write: %e", r);
+	close(p[1]);
+	wait(who);
+	return bench_cycles(start, NBYTES / 1024);
+}
+
+void
+umain(int argc, char **argv)
+{
+	uint32_t small, big;
+
+	small = run(32);
+	big = run(0);
+	cprintf("pipe throughput over %d bytes: 32-byte pipe %u cycles/KB, "
+		"default pipe %u cycles/KB\n", NBYTES, small, big);
+}
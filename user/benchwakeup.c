@@ -0,0 +1,46 @@
+// Benchmark wakeup-to-run latency.
+// The child blocks in ipc_recv; the parent stamps each message with the
+// time stamp counter just before sending it, and the child measures how
+// many cycles pass until it is running again.  Run with CPUS=2 or more
+// so that the child waits on a halted CPU.
+
+#include <inc/lib.h>
+#include <inc/x86.h>
+
+#define NROUNDS	100
+
+static void
+child(void *arg)
+{
+	envid_t who;
+	uint32_t sent, delta, min = ~0, max = 0;
+	uint64_t total = 0;
+	int i;
+
+	for (i = 0; i < NROUNDS; i++) {
+		sent = ipc_recv(&who, 0, 0);
+		delta = (uint32_t) read_tsc() - sent;
+		total += delta;
+		min = MIN(min, delta);
+		max = MAX(max, delta);
+		ipc_send(who, 0, 0, 0);
+	}
+
+	cprintf("wakeup latency over %d rounds: min %u avg %u max %u cycles\n",
+		NROUNDS, min, (uint32_t) (total / NROUNDS), max);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i;
+
+	who = bench_fork(child, NULL);
+	for (i = 0; i < NROUNDS; i++) {
+		// Give the child time to block and its CPU time to halt.
+		bench_delay(100000);
+		ipc_send(who, (uint32_t) read_tsc(), 0, 0);
+		ipc_recv(0, 0, 0);
+	}
+}
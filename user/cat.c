@@ -8,6 +8,9 @@ cat(int f, char *s)
 	long n;
 	int r;
 
+	// Files go out without passing through buf
+	while ((n = sendfile(1, f, ~0U >> 1)) > 0)
+		;
 	while ((n = read(f, buf, (long)sizeof(buf))) > 0)
 		if ((r = write(1, buf, n)) != n)
 			panic("write error copying %s: %e", s, r);
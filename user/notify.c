@@ -0,0 +1,52 @@
+// Test notification bits.
+// The parent fires a burst of notifications at the child, then sends it
+// a message.  The child must see every bit and then the message, and
+// the burst should cost it far fewer wakeups than notifications.
+
+#include <inc/lib.h>
+
+#define NBURST	100
+
+static void
+child(void)
+{
+	uint32_t bits, seen = 0;
+	int32_t val;
+	int wakeups = 0;
+
+	while (1) {
+		val = ipc_recv_notify(0, 0, 0, &bits);
+		if (val < 0)
+			panic("ipc_recv_notify: %e", val);
+		if (bits == 0)
+			break;
+		seen |= bits;
+		wakeups++;
+	}
+
+	if (seen != 0xFFFFFFFF)
+		panic("missing notification bits: %08x", seen);
+	if (val != 42)
+		panic("wrong message %d", val);
+	cprintf("notify: %d notifications in %d wakeups\n", NBURST, wakeups);
+}
+
+void
+umain(int argc, char **argv)
+{
+	envid_t who;
+	int i, r;
+
+	if ((who = fork()) < 0)
+		panic("fork: %e", who);
+	if (who == 0) {
+		child();
+		return;
+	}
+
+	for (i = 0; i < NBURST; i++)
+		if ((r = sys_notify(who, 1 << (i % 32))) < 0)
+			panic("sys_notify: %e", r);
+	ipc_send(who, 42, 0, 0);
+	wait(who);
+}
@@ -0,0 +1,41 @@
+// Test blocking ipc_send.  Several children send to the parent before
+// it is receiving; each should block in the kernel (not spin), and the
+// parent should receive their messages in the order they blocked.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+
+void
+umain(int argc, char **argv)
+{
+	envid_t kids[NCHILD], who;
+	uint32_t val;
+	int i;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			// Queue up behind the previous child
+			if (i > 0)
+				while (envs[ENVX(kids[i-1])].env_status != ENV_NOT_RUNNABLE)
+					sys_yield();
+			ipc_send(thisenv->env_parent_id, i, 0, 0);
+			return;
+		}
+	}
+
+	// Wait until every child is parked on our send queue
+	for (i = 0; i < NCHILD; i++)
+		while (envs[ENVX(kids[i])].env_status != ENV_NOT_RUNNABLE)
+			sys_yield();
+
+	for (i = 0; i < NCHILD; i++) {
+		val = ipc_recv(&who, 0, 0);
+		if (val != i || who != kids[i])
+			panic("got %d from %08x, expected %d from %08x",
+			      val, who, i, kids[i]);
+	}
+	cprintf("blocking sends arrived in order\n");
+}
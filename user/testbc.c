@@ -0,0 +1,59 @@
+// Test the file server's buffer cache limit.
+// Shrink the cache to its minimum and read a file several times bigger
+// than that twice.  Both reads have to see the same bytes, and the
+// cache has to evict blocks to make room.
+
+#include <inc/lib.h>
+
+static char buf[BLKSIZE];
+
+static uint32_t
+checksum(const char *path)
+{
+	uint32_t sum, i;
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	sum = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			sum = sum * 31 + (uint8_t) buf[i];
+	if (n < 0)
+		panic("read %s: %e", path, n);
+	close(fd);
+	return sum;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStat before, after;
+	uint32_t sum1, sum2, limit;
+	int r;
+
+	if ((r = cachestat(0, &before)) < 0)
+		panic("cachestat: %e", r);
+	limit = before.bs_maxblocks;
+	if ((r = cachestat(8, &before)) < 0)
+		panic("cachestat(8): %e", r);
+	if ((r = cachestat(4, &after)) != -E_INVAL)
+		panic("cachestat(4) returned %d", r);
+
+	sum1 = checksum("/sh");
+	sum2 = checksum("/sh");
+	if (sum1 != sum2)
+		panic("/sh read back as %08x, then %08x", sum1, sum2);
+
+	if ((r = cachestat(limit, &after)) < 0)
+		panic("cachestat: %e", r);
+	if (after.bs_evictions == before.bs_evictions)
+		panic("no blocks evicted with an 8-block cache");
+	cprintf("block cache: %u hits, %u misses, %u read ahead, "
+		"%u evictions, %u writebacks\n", after.bs_hits - before.bs_hits,
+		after.bs_misses - before.bs_misses,
+		after.bs_readahead - before.bs_readahead,
+		after.bs_evictions - before.bs_evictions,
+		after.bs_writebacks - before.bs_writebacks);
+	cprintf("testbc OK\n");
+}
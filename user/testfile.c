@@ -4,6 +4,10 @@ const char *msg = "This is the NEW message of the day!\n\n";
 
 #define FVA ((struct Fd*)0xCCCCC000)
 
+// Blocks in /big, and blocks /sparse spans, every other one written
+#define BIGBLOCKS	30
+#define SPARSEBLOCKS	64
+
 static int
 xopen(const char *path, int mode)
 {
@@ -21,7 +25,7 @@ xopen(const char *path, int mode)
 void
 umain(int argc, char **argv)
 {
-	int r, f, i;
+	int r, f, rf, i;
 	struct Fd *fd;
 	struct Fd fdcopy;
 	struct Stat st;
@@ -98,11 +102,11 @@ umain(int argc, char **argv)
 		panic("open did not fill struct Fd correctly\n");
 	cprintf("open is good\n");
 
-	// Try files with indirect blocks
+	// Try a file of many blocks
 	if ((f = open("/big", O_WRONLY|O_CREAT)) < 0)
 		panic("creat /big: %e", f);
 	memset(buf, 0, sizeof(buf));
-	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += sizeof(buf)) {
+	for (i = 0; i < BIGBLOCKS*BLKSIZE; i += sizeof(buf)) {
 		*(int*)buf = i;
 		if ((r = write(f, buf, sizeof(buf))) < 0)
 			panic("write /big@%d: %e", i, r);
@@ -111,7 +115,7 @@ umain(int argc, char **argv)
 
 	if ((f = open("/big", O_RDONLY)) < 0)
 		panic("open /big: %e", f);
-	for (i = 0; i < (NDIRECT*3)*BLKSIZE; i += sizeof(buf)) {
+	for (i = 0; i < BIGBLOCKS*BLKSIZE; i += sizeof(buf)) {
 		*(int*)buf = i;
 		if ((r = readn(f, buf, sizeof(buf))) < 0)
 			panic("read /big@%d: %e", i, r);
@@ -124,5 +128,48 @@ umain(int argc, char **argv)
 	}
 	close(f);
 	cprintf("large file is good\n");
+
+	// Try a file with holes between its blocks, which takes more
+	// extents than fit in the File
+	if ((f = open("/sparse", O_RDWR|O_CREAT)) < 0)
+		panic("creat /sparse: %e", f);
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < SPARSEBLOCKS; i += 2) {
+		*(int*)buf = i + 1;
+		seek(f, i*BLKSIZE);
+		if ((r = write(f, buf, sizeof(buf))) < 0)
+			panic("write /sparse@%d: %e", i*BLKSIZE, r);
+	}
+	for (i = 0; i < SPARSEBLOCKS - 1; i++) {
+		seek(f, i*BLKSIZE);
+		if ((r = readn(f, buf, sizeof(buf))) != sizeof(buf))
+			panic("read /sparse@%d: %e", i*BLKSIZE, r);
+		if (*(int*)buf != (i % 2 ? 0 : i + 1))
+			panic("read /sparse@%d returned bad data %d",
+			      i*BLKSIZE, *(int*)buf);
+	}
+	// A read-only open maps its blocks without ever being able to
+	// write them, so the holes have to read as zeros without being
+	// filled in
+	if ((rf = open("/sparse", O_RDONLY)) < 0)
+		panic("open /sparse read-only: %e", rf);
+	for (i = SPARSEBLOCKS - 2; i >= 0; i--) {
+		seek(rf, i*BLKSIZE);
+		if ((r = readn(rf, buf, sizeof(buf))) != sizeof(buf))
+			panic("read-only read /sparse@%d: %e", i*BLKSIZE, r);
+		if (*(int*)buf != (i % 2 ? 0 : i + 1))
+			panic("read-only read /sparse@%d returned bad data %d",
+			      i*BLKSIZE, *(int*)buf);
+	}
+	close(rf);
+	if ((r = ftruncate(f, 5*BLKSIZE)) < 0)
+		panic("ftruncate /sparse: %e", r);
+	seek(f, 4*BLKSIZE);
+	if ((r = readn(f, buf, sizeof(buf))) != sizeof(buf) || *(int*)buf != 5)
+		panic("read /sparse@%d after truncating: %e", 4*BLKSIZE, r);
+	close(f);
+	if ((r = remove("/sparse")) < 0)
+		panic("remove /sparse: %e", r);
+	cprintf("sparse file is good\n");
 }
 
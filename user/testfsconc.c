@@ -0,0 +1,60 @@
+// Test the file server with several clients missing in its cache at
+// once.  Each child reads a different file twice through a small cache,
+// so their requests keep parking on disk reads while the others' are
+// served, and both reads have to see the same bytes.
+
+#include <inc/lib.h>
+
+static const char *files[] = { "/sh", "/cat", "/ls", "/init" };
+#define NCHILD	(sizeof(files) / sizeof(files[0]))
+
+static char buf[BLKSIZE];
+
+static uint32_t
+checksum(const char *path)
+{
+	uint32_t sum, i;
+	int fd, n;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		panic("open %s: %e", path, fd);
+	sum = 0;
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		for (i = 0; i < n; i++)
+			sum = sum * 31 + (uint8_t) buf[i];
+	if (n < 0)
+		panic("read %s: %e", path, n);
+	close(fd);
+	return sum;
+}
+
+void
+umain(int argc, char **argv)
+{
+	struct BcStat stat;
+	envid_t kids[NCHILD];
+	uint32_t limit, sum;
+	int i, r;
+
+	if ((r = cachestat(0, &stat)) < 0)
+		panic("cachestat: %e", r);
+	limit = stat.bs_maxblocks;
+	if ((r = cachestat(16, &stat)) < 0)
+		panic("cachestat: %e", r);
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			sum = checksum(files[i]);
+			if (checksum(files[i]) != sum)
+				panic("%s read back differently", files[i]);
+			exit();
+		}
+	}
+	for (i = 0; i < NCHILD; i++)
+		wait(kids[i]);
+
+	cachestat(limit, &stat);
+	cprintf("testfsconc OK\n");
+}
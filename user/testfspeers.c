@@ -0,0 +1,63 @@
+// Test that all file servers see the same file contents.  Children,
+// which open files on different servers, read /motd while the parent
+// changes it through the primary and then changes it back.
+
+#include <inc/lib.h>
+
+#define NCHILD	8
+#define LEN	16
+
+static void
+check(const char *want)
+{
+	char buf[LEN];
+	envid_t kids[NCHILD];
+	int i, fd, r;
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((kids[i] = fork()) < 0)
+			panic("fork: %e", kids[i]);
+		if (kids[i] == 0) {
+			if ((fd = open("/motd", O_RDONLY)) < 0)
+				panic("open /motd: %e", fd);
+			if ((r = readn(fd, buf, LEN)) != LEN)
+				panic("read /motd: %e", r);
+			if (memcmp(buf, want, LEN) != 0)
+				panic("/motd reads \"%.16s\", not \"%.16s\"",
+				      buf, want);
+			exit();
+		}
+	}
+	for (i = 0; i < NCHILD; i++)
+		wait(kids[i]);
+}
+
+static void
+overwrite(int fd, const char *s)
+{
+	int r;
+
+	seek(fd, 0);
+	if ((r = write(fd, s, LEN)) != LEN)
+		panic("write /motd: %e", r);
+}
+
+void
+umain(int argc, char **argv)
+{
+	char orig[LEN];
+	int fd, r;
+
+	if ((fd = open("/motd", O_RDWR)) < 0)
+		panic("open /motd: %e", fd);
+	if ((r = readn(fd, orig, LEN)) != LEN)
+		panic("read /motd: %e", r);
+
+	check(orig);
+	overwrite(fd, "0123456789abcdef");
+	check("0123456789abcdef");
+	overwrite(fd, orig);
+	check(orig);
+	close(fd);
+	cprintf("testfspeers OK\n");
+}
@@ -9,7 +9,8 @@ umain(int argc, char **argv)
 	const volatile struct Env *kid;
 
 	cprintf("testing for pipeisclosed race...\n");
-	if ((r = pipe(p)) < 0)
+	// A ring the size pipes used to be, so the race stays as likely
+	if ((r = pipe_sized(p, 32)) < 0)
 		panic("pipe: %e", r);
 	if ((r = fork()) < 0)
 		panic("fork: %e", r);
@@ -0,0 +1,64 @@
+// Test poll on several pipes at once.
+// NCHILD children each write NMSG messages down their own pipe, at
+// different paces, then exit.  The parent services all the pipes with
+// poll until every one has hung up, and checks that it got everything.
+
+#include <inc/lib.h>
+
+#define NCHILD	4
+#define NMSG	50
+
+void
+umain(int argc, char **argv)
+{
+	struct pollfd fds[NCHILD];
+	int p[2], i, j, r, nopen, got[NCHILD];
+	char c, buf[16];
+
+	for (i = 0; i < NCHILD; i++) {
+		if ((r = pipe(p)) < 0)
+			panic("pipe: %e", r);
+		if ((r = fork()) < 0)
+			panic("fork: %e", r);
+		if (r == 0) {
+			close(p[0]);
+			for (j = 0; j < NMSG; j++) {
+				c = 'a' + i;
+				if ((r = write(p[1], &c, 1)) != 1)
+					panic("write: %e", r);
+				for (r = 0; r < i; r++)
+					sys_yield();
+			}
+			exit();
+		}
+		close(p[1]);
+		fds[i].fd = p[0];
+		fds[i].events = POLLIN;
+		got[i] = 0;
+	}
+
+	for (nopen = NCHILD; nopen > 0; ) {
+		if ((r = poll(fds, NCHILD, -1)) <= 0)
+			panic("poll: %e", r);
+		for (i = 0; i < NCHILD; i++) {
+			if (!(fds[i].revents & (POLLIN|POLLHUP)))
+				continue;
+			// a ready pipe doesn't block, even when it's hung up
+			if ((r = read(fds[i].fd, buf, sizeof(buf))) < 0)
+				panic("read: %e", r);
+			for (j = 0; j < r; j++)
+				if (buf[j] != 'a' + i)
+					panic("pipe %d got %c", i, buf[j]);
+			got[i] += r;
+			if (r == 0) {
+				close(fds[i].fd);
+				fds[i].fd = -1;
+				nopen--;
+			}
+		}
+	}
+	for (i = 0; i < NCHILD; i++)
+		if (got[i] != NMSG)
+			panic("pipe %d: got %d of %d messages", i, got[i], NMSG);
+	cprintf("poll test OK\n");
+}
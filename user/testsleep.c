@@ -0,0 +1,42 @@
+// Test sys_sleep and the timeouts on IPC receive, futex waits and poll.
+
+#include <inc/lib.h>
+
+#define MS	1000000ULL
+
+static volatile uint32_t word;
+
+void
+umain(int argc, char **argv)
+{
+	struct FutexWaitv wait = { &word, 0 };
+	struct pollfd pfd;
+	unsigned int start, elapsed;
+	int p[2], r;
+
+	start = sys_time_msec();
+	if ((r = sys_sleep(50 * MS)) < 0)
+		panic("sys_sleep: %e", r);
+	elapsed = sys_time_msec() - start;
+	if (elapsed < 49)
+		panic("sys_sleep(50ms) took %u ms", elapsed);
+	cprintf("slept 50ms in %u ms\n", elapsed);
+
+	start = sys_time_msec();
+	if ((r = ipc_recv_timeout(0, NULL, NULL, NULL, 20 * MS)) != -E_TIMEOUT)
+		panic("ipc_recv_timeout returned %d", r);
+	if ((r = sys_futex_waitv(&wait, 1, 20 * MS)) != -E_TIMEOUT)
+		panic("sys_futex_waitv returned %e", r);
+
+	if ((r = pipe(p)) < 0)
+		panic("pipe: %e", r);
+	pfd.fd = p[0];
+	pfd.events = POLLIN;
+	if ((r = poll(&pfd, 1, 20)) != 0)
+		panic("poll returned %d", r);
+	elapsed = sys_time_msec() - start;
+	if (elapsed < 59)
+		panic("three 20ms timeouts took %u ms", elapsed);
+
+	cprintf("timeout test OK\n");
+}
@@ -0,0 +1,33 @@
+// Test that sync writes back only the blocks that are dirty.
+
+#include <inc/lib.h>
+
+void
+umain(int argc, char **argv)
+{
+	char orig[16];
+	int fd, r;
+
+	if ((fd = open("/motd", O_RDWR)) < 0)
+		panic("open /motd: %e", fd);
+	if ((r = readn(fd, orig, sizeof(orig))) != sizeof(orig))
+		panic("read /motd: %e", r);
+
+	// Nothing is left dirty after a sync
+	if ((r = sync()) < 0)
+		panic("sync: %e", r);
+	if ((r = sync()) != 0)
+		panic("second sync wrote %d blocks", r);
+
+	// Rewriting the start of the file dirties just its first block
+	seek(fd, 0);
+	if ((r = write(fd, orig, sizeof(orig))) != sizeof(orig))
+		panic("write /motd: %e", r);
+	if ((r = sync()) != 1)
+		panic("sync after one write wrote %d blocks", r);
+	if ((r = sync()) != 0)
+		panic("sync after sync wrote %d blocks", r);
+
+	close(fd);
+	cprintf("testsync OK\n");
+}
@@ -0,0 +1,38 @@
+// Test per-environment scheduler quanta.  Fork a compute-bound "batch"
+// child with a long time slice, check that the kernel recorded it, let
+// the child run for a few slices alongside us, then kill it.
+
+#include <inc/lib.h>
+
+volatile uint32_t counter;
+
+void
+umain(int argc, char **argv)
+{
+	envid_t env;
+	int i, r;
+
+	if ((env = fork()) == 0) {
+		cprintf("I am the batch child.  Spinning...\n");
+		while (1)
+			counter++;
+	}
+
+	if ((r = sys_env_set_quantum(env, 8 * SCHED_QUANTUM)) < 0)
+		panic("sys_env_set_quantum: %e", r);
+	if (envs[ENVX(env)].env_quantum != 8 * SCHED_QUANTUM)
+		panic("child quantum is %u, not %u",
+		      envs[ENVX(env)].env_quantum, 8 * SCHED_QUANTUM);
+
+	// Our own slice stays at the default.
+	if (thisenv->env_quantum != SCHED_QUANTUM)
+		panic("parent quantum changed to %u", thisenv->env_quantum);
+
+	cprintf("I am the parent.  Running the batch child...\n");
+	for (i = 0; i < 8; i++)
+		sys_yield();
+
+	cprintf("I am the parent.  Killing the batch child...\n");
+	sys_env_destroy(env);
+	cprintf("timeslice test done\n");
+}